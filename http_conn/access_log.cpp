@@ -0,0 +1,220 @@
+#include "access_log.h"
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+//每个线程自己的环形缓冲区,第一次写日志时分配
+static __thread log_ring *local_ring = NULL;
+//生产者线程过多,本线程的日志全部丢弃
+static __thread bool local_overflow = false;
+
+static const char *method_names[] = {"GET", "POST", "HEAD", "PUT", "DELETE", "TRACE", "OPTIONS", "CONNECT", "PATCH"};
+
+int access_log::m_fd = -1;
+atomic<bool> access_log::m_enabled(false);
+bool access_log::m_binary = false;
+log_ring *access_log::m_rings[MAX_RINGS];
+atomic<int> access_log::m_ring_count(0);
+
+bool log_ring::push(const access_record &record)
+{
+	uint32_t head = m_head.load(memory_order_relaxed);
+	if (head - m_tail.load(memory_order_acquire) >= SIZE)
+	{
+		m_dropped.store(m_dropped.load(memory_order_relaxed) + 1, memory_order_relaxed);
+		return false;
+	}
+	m_records[head & (SIZE - 1)] = record;
+	m_head.store(head + 1, memory_order_release);
+	return true;
+}
+
+bool log_ring::pop(access_record &record)
+{
+	uint32_t tail = m_tail.load(memory_order_relaxed);
+	if (tail == m_head.load(memory_order_acquire))
+		return false;
+	record = m_records[tail & (SIZE - 1)];
+	m_tail.store(tail + 1, memory_order_release);
+	return true;
+}
+
+bool access_log::open(const char *path, bool binary)
+{
+	if (strcmp(path, "-") == 0)
+		m_fd = STDOUT_FILENO;
+	else
+		m_fd = ::open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	if (m_fd < 0)
+		return false;
+	m_binary = binary;
+	if (m_binary)
+	{
+		access_log_header header;
+		memcpy(header.magic, "ALOG", 4);
+		header.record_size = sizeof(access_record);
+		header.realtime_offset = realtime_offset();
+		if (::write(m_fd, &header, sizeof(header)) != sizeof(header))
+			return false;
+	}
+
+	pthread_t tid;
+	if (pthread_create(&tid, NULL, work, NULL) != 0)
+		return false;
+	pthread_detach(tid);
+	m_enabled.store(true, memory_order_relaxed);
+	return true;
+}
+
+log_ring *access_log::get_ring()
+{
+	if (local_ring || local_overflow)
+		return local_ring;
+	//每个线程只注册一次,这里加锁不影响热路径
+	//先放入数组再增加计数,后台线程看到计数时指针已经可见
+	static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+	pthread_mutex_lock(&lock);
+	int index = m_ring_count.load(memory_order_relaxed);
+	if (index < MAX_RINGS)
+	{
+		local_ring = new log_ring;
+		m_rings[index] = local_ring;
+		m_ring_count.store(index + 1, memory_order_release);
+	}
+	else
+		local_overflow = true;
+	pthread_mutex_unlock(&lock);
+	return local_ring;
+}
+
+void access_log::write(const access_record &record)
+{
+	log_ring *ring = get_ring();
+	if (ring)
+		ring->push(record);
+}
+
+uint64_t access_log::dropped()
+{
+	uint64_t total = 0;
+	int count = m_ring_count.load(memory_order_acquire);
+	for (int i = 0; i < count; i++)
+		total += m_rings[i]->dropped();
+	return total;
+}
+
+int64_t access_log::realtime_offset()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	int64_t real = ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+	return real - (int64_t)now_us();
+}
+
+int access_log::format(const access_record &record, int64_t offset, char *buf, int size)
+{
+	//同一秒内的记录复用格式化好的时间
+	static __thread time_t last_sec = -1;
+	static __thread char time_str[32];
+	int64_t real = (int64_t)record.start_us + offset;
+	time_t sec = real / 1000000;
+	if (sec != last_sec)
+	{
+		struct tm tm;
+		gmtime_r(&sec, &tm);
+		strftime(time_str, sizeof(time_str), "%d/%b/%Y:%H:%M:%S", &tm);
+		last_sec = sec;
+	}
+
+	char ip[INET_ADDRSTRLEN];
+	struct in_addr addr;
+	addr.s_addr = record.client_ip;
+	inet_ntop(AF_INET, &addr, ip, sizeof(ip));
+	const char *method = (record.method < sizeof(method_names) / sizeof(method_names[0])) ? method_names[record.method] : "-";
+
+	//TCP客户的端口不会是0,地址和端口都为0的是AF_UNIX连接
+	char client[INET_ADDRSTRLEN + 8];
+	if (record.client_ip == 0 && record.client_port == 0)
+		strcpy(client, "unix");
+	else
+		snprintf(client, sizeof(client), "%s:%u", ip, ntohs(record.client_port));
+
+	//客户地址 [时间] "请求行" 状态码 字节数 总用时 处理用时
+	int len = snprintf(buf, size, "%s [%s.%06d +0000] \"%s %.*s HTTP/1.1\" %u %llu %.6f %.6f\n",
+					   client, time_str, (int)(real % 1000000), method,
+					   (int)sizeof(record.url), record.url, record.status, (unsigned long long)record.bytes,
+					   record.total_us / 1000000.0, record.handle_us / 1000000.0);
+	return (len < size) ? len : size - 1;
+}
+
+int access_log::drain()
+{
+	static char buf[65536];
+	static const int LINE_MAX_LEN = 512;
+	int64_t offset = realtime_offset();
+	int len = 0;
+	int total = 0;
+	int count = m_ring_count.load(memory_order_acquire);
+	for (int i = 0; i < count; i++)
+	{
+		access_record record;
+		while (m_rings[i]->pop(record))
+		{
+			if (m_binary)
+			{
+				memcpy(buf + len, &record, sizeof(record));
+				len += sizeof(record);
+			}
+			else
+				len += format(record, offset, buf + len, LINE_MAX_LEN);
+			total++;
+			//成批写入文件
+			if (len > (int)sizeof(buf) - LINE_MAX_LEN)
+			{
+				if (!write_all(buf, len))
+					return -1;
+				len = 0;
+			}
+		}
+	}
+	if (len > 0 && !write_all(buf, len))
+		return -1;
+	return total;
+}
+
+bool access_log::write_all(const char *buf, int len)
+{
+	//写到管道时可能只写入一部分,剩下的必须接着写,否则记录被截断,log_decode无法解析
+	for (int off = 0; off < len;)
+	{
+		ssize_t n = ::write(m_fd, buf + off, len - off);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		off += n;
+	}
+	return true;
+}
+
+void *access_log::work(void *)
+{
+	while (1)
+	{
+		//没有日志时休眠,日志不需要实时写出
+		int n = drain();
+		if (n < 0)
+		{
+			//写文件失败(如磁盘满),停止记录,之后的请求不再写日志
+			m_enabled.store(false, memory_order_relaxed);
+			return NULL;
+		}
+		if (n == 0)
+			usleep(10000);
+	}
+	return NULL;
+}
@@ -0,0 +1,108 @@
+#ifndef ACCESS_LOG_H_
+#define ACCESS_LOG_H_
+
+#include <stdint.h>
+#include <time.h>
+#include <atomic>
+
+using namespace std;
+
+//一条访问日志记录,定长,热路径上只做一次拷贝,不做任何格式化
+struct access_record
+{
+	//收到请求第一个字节的时间(CLOCK_MONOTONIC,微秒)
+	uint64_t start_us;
+	//从收到请求到应答发送完毕的用时(微秒)
+	uint32_t total_us;
+	//工作线程解析和处理请求的用时(微秒)
+	uint32_t handle_us;
+	//发送给客户的字节数,包括应答头部
+	uint64_t bytes;
+	//客户地址,网络字节序,AF_UNIX连接都为0
+	uint32_t client_ip;
+	uint16_t client_port;
+	//应答状态码,0表示应答没有发送完连接就关闭了
+	uint16_t status;
+	//请求方法,对应http_conn::METHOD
+	uint8_t method;
+	//请求的URL,过长时截断
+	char url[95];
+};
+
+//一个线程的日志环形缓冲区,只有一个生产者(所属线程)和一个消费者(后台线程),不需要加锁
+class log_ring
+{
+public:
+	//容量必须是2的幂
+	static const uint32_t SIZE = 1024;
+
+	log_ring() : m_head(0), m_tail(0), m_dropped(0) {}
+	//由所属线程调用,缓冲区满时丢弃记录并返回false
+	bool push(const access_record &record);
+	//由后台线程调用,取出一条记录,没有记录时返回false
+	bool pop(access_record &record);
+	uint64_t dropped() const { return m_dropped.load(memory_order_relaxed); }
+
+private:
+	access_record m_records[SIZE];
+	//下一个写入位置,只由生产者修改
+	atomic<uint32_t> m_head;
+	//下一个读取位置,只由消费者修改
+	atomic<uint32_t> m_tail;
+	atomic<uint64_t> m_dropped;
+};
+
+//访问日志,每个线程第一次写日志时分配自己的环形缓冲区,由后台线程成批格式化并写入文件
+class access_log
+{
+public:
+	//最多的生产者线程数,超过的线程的日志被丢弃
+	static const int MAX_RINGS = 64;
+
+	//打开日志文件并启动后台线程,path为"-"时写到标准输出
+	//binary为true时直接写入定长记录,用log_decode工具转换为文本
+	static bool open(const char *path, bool binary);
+	//写文件失败后停止记录
+	static bool enabled() { return m_enabled.load(memory_order_relaxed); }
+	//写入一条记录,不会阻塞
+	static void write(const access_record &record);
+	//所有线程因缓冲区满而丢弃的记录数
+	static uint64_t dropped();
+
+	//当前的单调时钟(微秒),用于记录中的时间
+	static uint64_t now_us()
+	{
+		struct timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+	}
+	//把记录格式化为一行文本,realtime_offset为实时时钟与单调时钟的差(微秒),返回长度
+	static int format(const access_record &record, int64_t realtime_offset, char *buf, int size);
+	//当前实时时钟与单调时钟的差(微秒)
+	static int64_t realtime_offset();
+
+private:
+	static log_ring *get_ring();
+	static void *work(void *);
+	//取出所有缓冲区中的记录并写入文件,返回取出的记录数,写文件失败时返回-1
+	static int drain();
+	//写入全部len字节,被信号中断时重试,出错时返回false
+	static bool write_all(const char *buf, int len);
+
+private:
+	static int m_fd;
+	static atomic<bool> m_enabled;
+	static bool m_binary;
+	static log_ring *m_rings[MAX_RINGS];
+	static atomic<int> m_ring_count;
+};
+
+//二进制日志文件的头部
+struct access_log_header
+{
+	char magic[4];
+	uint32_t record_size;
+	int64_t realtime_offset;
+};
+
+#endif
@@ -0,0 +1,183 @@
+#include "affinity.h"
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include <string>
+
+int affinity::m_cpu_node[affinity::MAX_CPUS];
+int affinity::m_node_count = 1;
+const char *affinity::m_policy = "default";
+char affinity::m_nodes[64] = "";
+
+//解析"0-3,8"格式的列表,追加到cpus
+static bool parse_list(const char *list, vector<int> &cpus)
+{
+	const char *p = list;
+	while (*p && *p != '\n')
+	{
+		char *end;
+		long first = strtol(p, &end, 10);
+		if (end == p || first < 0 || first >= affinity::MAX_CPUS)
+			return false;
+		long last = first;
+		p = end;
+		if (*p == '-')
+		{
+			last = strtol(p + 1, &end, 10);
+			if (end == p + 1 || last < first || last >= affinity::MAX_CPUS)
+				return false;
+			p = end;
+		}
+		for (long cpu = first; cpu <= last; cpu++)
+			cpus.push_back(cpu);
+		if (*p == ',')
+			p++;
+		else if (*p && *p != '\n')
+			return false;
+	}
+	return true;
+}
+
+static bool read_line(const char *path, char *buf, int size)
+{
+	FILE *fp = fopen(path, "r");
+	if (!fp)
+		return false;
+	bool ok = fgets(buf, size, fp) != NULL;
+	fclose(fp);
+	return ok;
+}
+
+void affinity::init()
+{
+	memset(m_cpu_node, 0, sizeof(m_cpu_node));
+	m_node_count = 1;
+	for (int node = 0; node < MAX_NODES; node++)
+	{
+		char path[64], buf[4096];
+		snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+		if (!read_line(path, buf, sizeof(buf)))
+			continue;
+		vector<int> cpus;
+		parse_list(buf, cpus);
+		for (size_t i = 0; i < cpus.size(); i++)
+			m_cpu_node[cpus[i]] = node;
+		if (node + 1 > m_node_count)
+			m_node_count = node + 1;
+	}
+}
+
+bool affinity::parse(const char *spec, vector<int> &cpus)
+{
+	cpus.clear();
+	if (strncmp(spec, "irq:", 4) == 0)
+		return parse_irq(spec + 4, cpus) && !cpus.empty();
+	return parse_list(spec, cpus) && !cpus.empty();
+}
+
+//网卡的中断在/proc/interrupts中以网卡名(如eth0-TxRx-3)或设备名(如virtio1-input.0)开头,配置中断除外
+bool affinity::parse_irq(const char *ifname, vector<int> &cpus)
+{
+	string prefix = string(ifname) + "-";
+	string dev_prefix;
+	char path[PATH_MAX], real[PATH_MAX];
+	snprintf(path, sizeof(path), "/sys/class/net/%s/device", ifname);
+	if (realpath(path, real))
+	{
+		const char *base = strrchr(real, '/');
+		dev_prefix = string(base ? base + 1 : real) + "-";
+	}
+
+	FILE *fp = fopen("/proc/interrupts", "r");
+	if (!fp)
+		return false;
+	char line[4096];
+	while (fgets(line, sizeof(line), fp))
+	{
+		char *end;
+		long irq = strtol(line, &end, 10);
+		if (end == line || *end != ':')
+			continue;
+		//最后一个字段是中断处理程序的名字
+		int len = strlen(line);
+		while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == ' '))
+			line[--len] = '\0';
+		char *name = strrchr(line, ' ');
+		name = name ? name + 1 : line;
+		bool match = strncmp(name, prefix.c_str(), prefix.size()) == 0 ||
+					 (!dev_prefix.empty() && strncmp(name, dev_prefix.c_str(), dev_prefix.size()) == 0);
+		if (!match || strstr(name, "config"))
+			continue;
+
+		char buf[4096];
+		snprintf(path, sizeof(path), "/proc/irq/%ld/effective_affinity_list", irq);
+		if (!read_line(path, buf, sizeof(buf)))
+		{
+			snprintf(path, sizeof(path), "/proc/irq/%ld/smp_affinity_list", irq);
+			if (!read_line(path, buf, sizeof(buf)))
+				continue;
+		}
+		vector<int> irq_cpus;
+		if (!parse_list(buf, irq_cpus))
+			continue;
+		for (size_t i = 0; i < irq_cpus.size(); i++)
+		{
+			bool seen = false;
+			for (size_t j = 0; j < cpus.size() && !seen; j++)
+				seen = cpus[j] == irq_cpus[i];
+			if (!seen)
+				cpus.push_back(irq_cpus[i]);
+		}
+	}
+	fclose(fp);
+	return true;
+}
+
+bool affinity::pin(pthread_t thread, const vector<int> &cpus)
+{
+	if (cpus.empty())
+		return false;
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	for (size_t i = 0; i < cpus.size(); i++)
+		CPU_SET(cpus[i], &set);
+	return pthread_setaffinity_np(thread, sizeof(set), &set) == 0;
+}
+
+int affinity::current_node()
+{
+	return cpu_node(sched_getcpu());
+}
+
+bool affinity::bind_memory(void *addr, size_t len, const vector<int> &cpus)
+{
+	unsigned long mask = 0;
+	for (size_t i = 0; i < cpus.size(); i++)
+		mask |= 1UL << cpu_node(cpus[i]);
+	if (mask == 0)
+		return false;
+
+	//mbind要求起始地址按页对齐,只设置区域内完整的页
+	long page = sysconf(_SC_PAGESIZE);
+	uintptr_t begin = ((uintptr_t)addr + page - 1) & ~(uintptr_t)(page - 1);
+	uintptr_t end = ((uintptr_t)addr + len) & ~(uintptr_t)(page - 1);
+	if (end <= begin)
+		return false;
+	bool single = (mask & (mask - 1)) == 0;
+	int mode = single ? MPOL_PREFERRED : MPOL_INTERLEAVE;
+	if (syscall(SYS_mbind, begin, end - begin, mode, &mask, sizeof(mask) * 8, 0) != 0)
+		return false;
+
+	m_policy = single ? "preferred" : "interleave";
+	int pos = 0;
+	for (int node = 0; node < MAX_NODES; node++)
+		if (mask & (1UL << node))
+			pos += snprintf(m_nodes + pos, sizeof(m_nodes) - pos, pos ? ",%d" : "%d", node);
+	return true;
+}
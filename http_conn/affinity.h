@@ -0,0 +1,47 @@
+#ifndef AFFINITY_H_
+#define AFFINITY_H_
+
+#include <pthread.h>
+#include <stddef.h>
+#include <vector>
+
+using namespace std;
+
+//CPU亲和性和NUMA节点
+//CPU列表的格式与/sys下的cpulist相同,如"0-3,8,10-11";"irq:eth0"表示当前处理该网卡中断的CPU,
+//按中断号的顺序排列,使处理请求的线程与网卡的接收队列(RSS)一一对应
+class affinity
+{
+public:
+	static const int MAX_CPUS = 1024;
+	static const int MAX_NODES = 8;
+
+	//读取各NUMA节点的CPU列表,启动时调用一次;没有NUMA信息时所有CPU都属于节点0
+	static void init();
+	static bool parse(const char *spec, vector<int> &cpus);
+	//把线程绑定到cpus中的所有CPU上
+	static bool pin(pthread_t thread, const vector<int> &cpus);
+	static int cpu_node(int cpu) { return (cpu >= 0 && cpu < MAX_CPUS) ? m_cpu_node[cpu] : 0; }
+	//当前线程正在运行的CPU所在的节点
+	static int current_node();
+	static int node_count() { return m_node_count; }
+
+	//按cpus所在的节点设置[addr, addr+len)的内存策略,之后第一次访问时才分配物理页:
+	//只涉及一个节点时优先从该节点分配,涉及多个节点时在这些节点间交错分配
+	//返回false表示没有设置(cpus为空或者系统不支持)
+	static bool bind_memory(void *addr, size_t len, const vector<int> &cpus);
+	//bind_memory设置的策略,用于/metrics,如policy="interleave",nodes="0,1"
+	static const char *memory_policy() { return m_policy; }
+	static const char *memory_nodes() { return m_nodes; }
+
+private:
+	static bool parse_irq(const char *ifname, vector<int> &cpus);
+
+private:
+	static int m_cpu_node[MAX_CPUS];
+	static int m_node_count;
+	static const char *m_policy;
+	static char m_nodes[64];
+};
+
+#endif
@@ -0,0 +1,253 @@
+#include "asset_bundle.h"
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <string>
+#include "locker.h"
+#include "metrics.h"
+
+using namespace std;
+
+const char *asset_bundle::m_path = NULL;
+bool asset_bundle::m_populate = false;
+bool asset_bundle::m_huge = false;
+atomic<bundle_map *> asset_bundle::m_current(NULL);
+//只用于超出危险指针个数的线程,这些线程加锁查找,切换时也加锁,保证它们用完之前旧包不被释放
+static locker bundle_lock;
+
+//危险指针的个数,每个查找包的线程第一次查找时分配一个,线程不会退出,不回收
+static const int MAX_READERS = 64;
+//各占一个缓存行,避免不同线程互相使对方的缓存行失效
+struct bundle_hazard
+{
+	atomic<bundle_map *> map;
+	char pad[64 - sizeof(atomic<bundle_map *>)];
+};
+static bundle_hazard hazards[MAX_READERS];
+static atomic<int> hazard_count(0);
+static thread_local int hazard_index = -1;
+
+//本线程的危险指针,分配完时返回NULL
+static atomic<bundle_map *> *my_hazard()
+{
+	if (hazard_index < 0)
+	{
+		int index = hazard_count.fetch_add(1, memory_order_relaxed);
+		hazard_index = index < MAX_READERS ? index : MAX_READERS;
+	}
+	return hazard_index < MAX_READERS ? &hazards[hazard_index].map : NULL;
+}
+
+bool asset_bundle::init(const char *spec)
+{
+	string path(spec);
+	size_t colon;
+	while ((colon = path.rfind(':')) != string::npos)
+	{
+		string flag = path.substr(colon + 1);
+		if (flag == "populate")
+			m_populate = true;
+		else if (flag == "huge")
+			m_huge = true;
+		else
+			break;
+		path.erase(colon);
+	}
+	m_path = strdup(path.c_str());
+	m_current.store(open_map());
+	if (!m_current.load())
+	{
+		m_path = NULL;
+		return false;
+	}
+	pthread_t tid;
+	if (pthread_create(&tid, NULL, work, NULL) != 0)
+		return false;
+	pthread_setname_np(tid, "web-bundle");
+	pthread_detach(tid);
+	return true;
+}
+
+//内容和头部都必须在文件之内
+static bool valid_variant(const bundle_variant &v, size_t size)
+{
+	return v.headers_offset <= size && v.headers_len <= size - v.headers_offset &&
+		   v.body_offset <= size && v.body_len <= size - v.body_offset;
+}
+
+bundle_map *asset_bundle::open_map()
+{
+	int fd = open(m_path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+	struct stat st;
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(bundle_header))
+	{
+		close(fd);
+		return NULL;
+	}
+	void *addr = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE | (m_populate ? MAP_POPULATE : 0), fd, 0);
+	close(fd);
+	if (addr == MAP_FAILED)
+		return NULL;
+	//文件映射的透明大页需要内核支持(CONFIG_READ_ONLY_THP_FOR_FS),不支持时忽略
+	if (m_huge)
+		madvise(addr, st.st_size, MADV_HUGEPAGE);
+
+	size_t size = st.st_size;
+	const bundle_header *header = (const bundle_header *)addr;
+	bool ok = memcmp(header->magic, BUNDLE_MAGIC, sizeof(BUNDLE_MAGIC)) == 0 && header->size == size &&
+			  header->count <= (size - sizeof(bundle_header)) / sizeof(bundle_entry);
+	const bundle_entry *entries = (const bundle_entry *)(header + 1);
+	for (uint32_t i = 0; ok && i < header->count; i++)
+	{
+		const bundle_entry &e = entries[i];
+		ok = e.path_offset <= size && e.path_len <= size - e.path_offset && e.etag[sizeof(e.etag) - 1] == '\0' &&
+			 valid_variant(e.plain, size) && (!e.has_gzip || valid_variant(e.gzip, size));
+	}
+	if (!ok)
+	{
+		munmap(addr, size);
+		return NULL;
+	}
+
+	bundle_map *map = new bundle_map;
+	map->addr = (char *)addr;
+	map->size = size;
+	map->entries = entries;
+	map->count = header->count;
+	map->refs.store(1, memory_order_relaxed);
+	map->dev = st.st_dev;
+	map->ino = st.st_ino;
+	map->mtime = st.st_mtim;
+	return map;
+}
+
+void asset_bundle::destroy(bundle_map *map)
+{
+	munmap(map->addr, map->size);
+	delete map;
+}
+
+bundle_map *asset_bundle::pin(atomic<bundle_map *> *hazard)
+{
+	if (!hazard)
+	{
+		bundle_lock.lock();
+		return m_current.load(memory_order_relaxed);
+	}
+	//标出后再读一次,指针没变说明标出时还没有切换,后台线程切换后一定能看到这个标记
+	bundle_map *map = m_current.load();
+	while (true)
+	{
+		hazard->store(map);
+		bundle_map *now = m_current.load();
+		if (now == map)
+			return map;
+		map = now;
+	}
+}
+
+void asset_bundle::unpin(atomic<bundle_map *> *hazard)
+{
+	if (hazard)
+		hazard->store(NULL, memory_order_release);
+	else
+		bundle_lock.unlock();
+}
+
+const bundle_entry *asset_bundle::acquire(const char *path, bundle_map **map)
+{
+	size_t len = strlen(path);
+	uint64_t hash = bundle_hash(path, len);
+	atomic<bundle_map *> *hazard = my_hazard();
+	bundle_map *current = pin(hazard);
+	//先按哈希二分,再在哈希相同的条目中比较路径
+	uint32_t low = 0, high = current->count;
+	while (low < high)
+	{
+		uint32_t mid = low + (high - low) / 2;
+		if (current->entries[mid].hash < hash)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	const bundle_entry *found = NULL;
+	for (uint32_t i = low; i < current->count && current->entries[i].hash == hash; i++)
+	{
+		const bundle_entry &e = current->entries[i];
+		if (e.path_len == len && memcmp(current->addr + e.path_offset, path, len) == 0)
+		{
+			found = &e;
+			current->refs.fetch_add(1, memory_order_relaxed);
+			*map = current;
+			break;
+		}
+	}
+	unpin(hazard);
+	return found;
+}
+
+void asset_bundle::release(bundle_map *map)
+{
+	if (map->refs.fetch_sub(1, memory_order_acq_rel) == 1)
+		destroy(map);
+}
+
+size_t asset_bundle::entries()
+{
+	if (!enabled())
+		return 0;
+	atomic<bundle_map *> *hazard = my_hazard();
+	size_t count = pin(hazard)->count;
+	unpin(hazard);
+	return count;
+}
+
+size_t asset_bundle::bytes()
+{
+	if (!enabled())
+		return 0;
+	atomic<bundle_map *> *hazard = my_hazard();
+	size_t size = pin(hazard)->size;
+	unpin(hazard);
+	return size;
+}
+
+void *asset_bundle::work(void *)
+{
+	while (true)
+	{
+		sleep(1);
+		//m_current只在本线程中替换,读取不必加锁
+		bundle_map *current = m_current.load(memory_order_relaxed);
+		struct stat st;
+		if (stat(m_path, &st) < 0 || (st.st_dev == current->dev && st.st_ino == current->ino &&
+									   st.st_mtim.tv_sec == current->mtime.tv_sec && st.st_mtim.tv_nsec == current->mtime.tv_nsec))
+			continue;
+		//新的包不完整或格式不对时继续使用原来的包,记下这个文件,再次变化时才重试
+		bundle_map *map = open_map();
+		if (!map)
+		{
+			metrics::add(COUNTER_BUNDLE_RELOAD_FAILS);
+			current->dev = st.st_dev;
+			current->ino = st.st_ino;
+			current->mtime = st.st_mtim;
+			continue;
+		}
+		bundle_lock.lock();
+		m_current.exchange(map);
+		bundle_lock.unlock();
+		//切换之后开始查找的线程只会标出新的包,等标出旧包的线程查找完,它们对旧包的引用已经计入
+		for (int i = 0; i < MAX_READERS; i++)
+			while (hazards[i].map.load() == current)
+				sched_yield();
+		release(current);
+		metrics::add(COUNTER_BUNDLE_SWAPS);
+	}
+	return NULL;
+}
@@ -0,0 +1,111 @@
+#ifndef ASSET_BUNDLE_H_
+#define ASSET_BUNDLE_H_
+
+#include <sys/types.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <atomic>
+
+using namespace std;
+
+//包文件的格式,由bundle_pack把根目录打包生成,整数为本机字节序:
+//	bundle_header | bundle_entry[count] | 路径,应答头部和内容
+//条目按(hash, 路径)排序,查找时二分;路径与doc_tree::normalize的结果相同(相对于根目录,不以'/'开头)
+static const char BUNDLE_MAGIC[8] = {'W', 'E', 'B', 'B', 'N', 'D', 'L', '1'};
+
+struct bundle_header
+{
+	char magic[8];
+	uint32_t count;
+	uint32_t reserved;
+	//包文件的总长度,加载时检查是否完整
+	uint64_t size;
+};
+
+//一种编码的应答
+struct bundle_variant
+{
+	//状态行和头部字段,不含Connection和结尾的空行,由服务器按请求补上
+	uint64_t headers_offset;
+	uint32_t headers_len;
+	uint32_t reserved;
+	uint64_t body_offset;
+	uint64_t body_len;
+};
+
+struct bundle_entry
+{
+	uint64_t hash;
+	uint64_t path_offset;
+	uint32_t path_len;
+	//是否有gzip压缩的版本
+	uint32_t has_gzip;
+	//带引号,以'\0'结尾,如"0123456789abcdef"
+	char etag[24];
+	bundle_variant plain;
+	bundle_variant gzip;
+};
+
+//FNV-1a
+static inline uint64_t bundle_hash(const char *path, size_t len)
+{
+	uint64_t h = 14695981039346656037ULL;
+	for (size_t i = 0; i < len; i++)
+	{
+		h ^= (unsigned char)path[i];
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+//一个已加载的包,被正在发送的应答引用,替换后最后一个应答结束时才munmap
+struct bundle_map
+{
+	char *addr;
+	size_t size;
+	const bundle_entry *entries;
+	uint32_t count;
+	//正在发送的应答数,加上作为当前包的一个引用,减到0时munmap
+	atomic<int> refs;
+	//以下只由后台线程读写
+	dev_t dev;
+	ino_t ino;
+	struct timespec mtime;
+};
+
+//不可变部署时把整个根目录打包成一个文件(web -R bundle):
+//	启动时一次mmap,可选MAP_POPULATE预先读入和透明大页;命中的请求不访问文件系统,
+//	预先生成的应答头部复制到写缓冲区,内容直接从映射writev发送;没有打包的路径仍然从根目录读取
+//	后台线程每秒检查包文件,被替换(如bundle_pack生成后rename)时加载新的包并切换指针,之后的请求使用新的包
+//	查找不加锁:每个线程用一个危险指针标出正在查找的包,切换后后台线程等旧包不再被标出才放弃它作为当前包的引用
+class asset_bundle
+{
+public:
+	//spec为path[:populate][:huge],加载失败时返回false
+	static bool init(const char *spec);
+	static bool enabled() { return m_path != NULL; }
+	//查找path,找到时返回条目,并增加所在包的引用计数,由*map返回,应答结束时release
+	static const bundle_entry *acquire(const char *path, bundle_map **map);
+	static void release(bundle_map *map);
+	//当前包的条目数和字节数,用于/metrics
+	static size_t entries();
+	static size_t bytes();
+
+private:
+	//映射并检查包文件,失败时返回NULL
+	static bundle_map *open_map();
+	static void destroy(bundle_map *map);
+	//取得当前包,在unpin之前不会被释放;hazard为NULL时(线程数超过MAX_READERS)加锁
+	static bundle_map *pin(atomic<bundle_map *> *hazard);
+	static void unpin(atomic<bundle_map *> *hazard);
+	static void *work(void *);
+
+private:
+	static const char *m_path;
+	static bool m_populate;
+	static bool m_huge;
+	static atomic<bundle_map *> m_current;
+};
+
+#endif
@@ -0,0 +1,314 @@
+#!/usr/bin/env python3
+# 端到端基准测试矩阵:构建tiny_web和http_conn两个服务器,在回环地址上用load_gen跑固定的测试矩阵
+# 文件大小1KB/100KB/10MB x 连接数1/100/10000 x 长连接开/关,每个组合重新启动服务器
+# 收集吞吐量,延迟百分位,服务器的RSS,每个请求的CPU时间和系统调用数,输出对比报告
+# 用法: ./bench_matrix.py [-d 秒数] [-s 1k,100k,10m] [-c 1,100,10000] [-k on,off] [--servers tiny,http_conn] [-o 输出目录]
+# 系统调用数优先用perf stat统计raw_syscalls:sys_enter,没有perf时用/proc/<pid>/io中的syscr+syscw,
+# 后者只计入read/write类的系统调用(不含recv/epoll_wait等),只适合同一来源的数据之间比较
+import argparse
+import json
+import os
+import resource
+import shutil
+import signal
+import socket
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+REPO = os.path.dirname(HERE)
+TINY_SRC = os.path.join(REPO, 'tiny_web')
+CLK_TCK = os.sysconf('SC_CLK_TCK')
+
+SIZES = {'1k': 1024, '100k': 100 * 1024, '10m': 10 * 1024 * 1024}
+
+
+def parse_list(text):
+    return [x.strip() for x in text.split(',') if x.strip()]
+
+
+def build(work):
+    # 仓库中带有预先编译的web,重新构建以保证测试的是当前的源码
+    subprocess.check_call(['make', '-s', '-B', '-C', HERE, 'web', 'load_gen'])
+    tiny = os.path.join(work, 'tiny')
+    subprocess.check_call(['gcc', os.path.join(TINY_SRC, 'tiny.c'), os.path.join(TINY_SRC, 'csapp.c'),
+                           '-I', TINY_SRC, '-o', tiny, '-lpthread'])
+    return tiny
+
+
+def make_docroot(work, sizes):
+    # http_conn以工作目录下的var/www/html为根目录,tiny以工作目录为根目录,两者读取同一批文件
+    root = os.path.join(work, 'var', 'www', 'html')
+    os.makedirs(root, exist_ok=True)
+    for name in sizes:
+        with open(os.path.join(root, 'f%s.bin' % name), 'wb') as f:
+            f.write(os.urandom(SIZES[name]))
+
+
+def listening(port):
+    # 不能用connect探测,tiny在对方不发请求就关闭连接时会因为写失败而退出
+    for name in ('/proc/net/tcp', '/proc/net/tcp6'):
+        try:
+            with open(name) as f:
+                next(f)
+                for line in f:
+                    fields = line.split()
+                    if int(fields[1].split(':')[1], 16) == port and fields[3] == '0A':
+                        return True
+        except OSError:
+            pass
+    return False
+
+
+def wait_listen(port, proc, timeout=5.0):
+    deadline = time.time() + timeout
+    while time.time() < deadline:
+        if proc.poll() is not None:
+            return False
+        if listening(port):
+            return True
+        time.sleep(0.05)
+    return False
+
+
+def read_proc(pid):
+    stat = {'time': time.time()}
+    try:
+        with open('/proc/%d/stat' % pid) as f:
+            fields = f.read().rsplit(')', 1)[1].split()
+        if fields[0] == 'Z':
+            return None
+        # utime和stime是第14,15个字段,包括所有线程
+        stat['cpu_s'] = (int(fields[11]) + int(fields[12])) / CLK_TCK
+        with open('/proc/%d/io' % pid) as f:
+            for line in f:
+                key, value = line.split(':')
+                if key in ('syscr', 'syscw'):
+                    stat[key] = int(value)
+        with open('/proc/%d/status' % pid) as f:
+            for line in f:
+                if line.startswith(('VmRSS:', 'VmHWM:')):
+                    stat[line.split(':')[0]] = int(line.split()[1])
+    except (OSError, IndexError, ValueError):
+        return None
+    return stat
+
+
+class sampler(threading.Thread):
+    # 测试期间定期读取服务器的统计,tiny在客户中途断开时会退出,此时使用退出前的最后一次采样
+    def __init__(self, pid):
+        threading.Thread.__init__(self, daemon=True)
+        self.pid = pid
+        self.last = None
+        self.stopped = threading.Event()
+
+    def run(self):
+        while not self.stopped.is_set():
+            sample = read_proc(self.pid)
+            if sample is None:
+                break
+            self.last = sample
+            self.stopped.wait(0.05)
+
+    def stop(self):
+        self.stopped.set()
+        self.join()
+        sample = read_proc(self.pid)
+        if sample is not None:
+            self.last = sample
+        return self.last
+
+
+def run_load(port, path, conns, keep_alive, duration, threads):
+    cmd = [os.path.join(HERE, 'load_gen'), '-a', '127.0.0.1', '-p', str(port), '-c', str(conns),
+           '-t', str(threads), '-d', str(duration), '-u', path]
+    if not keep_alive:
+        cmd.append('-n')
+    out = subprocess.run(cmd, stdout=subprocess.PIPE, stderr=subprocess.DEVNULL, timeout=duration + 60).stdout
+    return json.loads(out.decode())
+
+
+def run_cell(args, work, tiny, server, size, conns, keep_alive, port):
+    if server == 'tiny':
+        cmd = [tiny, str(port)]
+        path = '/var/www/html/f%s.bin' % size
+    else:
+        cmd = [os.path.join(HERE, 'web'), '-p', str(port)]
+        path = '/f%s.bin' % size
+    result = {'server': server, 'size': size, 'connections': conns, 'keep_alive': keep_alive}
+    if server == 'tiny' and keep_alive:
+        # tiny是HTTP/1.0服务器,每个应答后都关闭连接,长连接模式下的请求都会失败
+        result['error'] = 'n/a: tiny closes every connection'
+        return result
+    log = open(os.path.join(args.out, 'server.log'), 'ab')
+    proc = subprocess.Popen(cmd, cwd=work, stdout=log, stderr=log)
+    try:
+        if not wait_listen(port, proc):
+            result['error'] = 'server did not start'
+            return result
+        if args.warmup > 0:
+            run_load(port, path, min(conns, 100), keep_alive, args.warmup, args.threads)
+            # tiny在预热结束,load_gen关闭未完成的连接时会退出(可能稍后才退出),总是重新启动
+            if server == 'tiny':
+                proc.kill()
+                proc.wait()
+                proc = subprocess.Popen(cmd, cwd=work, stdout=log, stderr=log)
+                if not wait_listen(port, proc):
+                    result['error'] = 'server did not restart after warmup'
+                    return result
+        before = read_proc(proc.pid)
+        if before is None:
+            result['error'] = 'server exited before the run'
+            return result
+        watch = sampler(proc.pid)
+        watch.start()
+        perf = None
+        if args.perf:
+            perf_out = os.path.join(args.out, 'perf.tmp')
+            perf = subprocess.Popen(['perf', 'stat', '-x', ',', '-e', 'raw_syscalls:sys_enter', '-o', perf_out,
+                                     '-p', str(proc.pid)], stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+        load = run_load(port, path, conns, keep_alive, args.duration, args.threads)
+        load_end = time.time()
+        after = watch.stop()
+        syscalls = None
+        if perf:
+            perf.send_signal(signal.SIGINT)
+            perf.wait()
+            with open(perf_out) as f:
+                for line in f:
+                    parts = line.strip().split(',')
+                    if len(parts) > 2 and parts[2] == 'raw_syscalls:sys_enter' and parts[0].isdigit():
+                        syscalls = int(parts[0])
+        # load_gen结束时关闭所有连接,tiny此时退出不影响结果
+        if after['time'] < load_end - 0.5:
+            result['error'] = 'server exited %.1fs before the end' % (load_end - after['time'])
+        requests = max(load['requests'], 1)
+        if syscalls is None:
+            syscalls = (after['syscr'] - before['syscr']) + (after['syscw'] - before['syscw'])
+        result.update({
+            'rps': load['rps'],
+            'mbps': load['mbps'],
+            'requests': load['requests'],
+            'errors': load['errors'],
+            'non_2xx': sum(v for k, v in load['status'].items() if k != '2xx'),
+            'latency_us': load['latency_us'],
+            'rss_kb': after.get('VmRSS', 0),
+            'peak_rss_kb': after.get('VmHWM', 0),
+            'cpu_us_per_req': (after['cpu_s'] - before['cpu_s']) * 1e6 / requests,
+            'syscalls_per_req': syscalls / float(requests),
+        })
+        return result
+    finally:
+        proc.kill()
+        proc.wait()
+        log.close()
+
+
+def fmt_row(r):
+    if 'error' in r and 'rps' not in r:
+        return '| %s | %s | %s | %s | %s |' % (r['server'], r['size'], r['connections'],
+                                                'on' if r['keep_alive'] else 'off', r['error']) + ' |' * 9
+    lat = r['latency_us']
+    # 测试时间内没有完成任何请求时(如10MB文件x10000个连接),每个请求的开销没有意义
+    per_req = lambda v: ('%.1f' % v) if r['requests'] else '-'
+    note = r.get('error', '') or ('' if r['requests'] else 'no request completed')
+    return '| %s | %s | %d | %s | %.0f | %.1f | %.0f | %.0f | %.0f | %d | %d | %s | %s | %s |' % (
+        r['server'], r['size'], r['connections'], 'on' if r['keep_alive'] else 'off', r['rps'], r['mbps'],
+        lat['p50'], lat['p99'], lat['p99.9'], r['errors'] + r['non_2xx'], r['peak_rss_kb'] // 1024,
+        per_req(r['cpu_us_per_req']), per_req(r['syscalls_per_req']), note)
+
+
+def report(args, results):
+    lines = []
+    lines.append('# tiny_web vs http_conn')
+    lines.append('')
+    lines.append('%s, %d CPU, %ds per run, load_gen -t %d, syscalls from %s' % (
+        time.strftime('%Y-%m-%d %H:%M:%S'), os.cpu_count(), args.duration, args.threads,
+        'perf raw_syscalls:sys_enter' if args.perf else '/proc/<pid>/io syscr+syscw'))
+    lines.append('')
+    lines.append('| server | size | conns | keep-alive | rps | MB/s | p50 us | p99 us | p99.9 us | errors | peak RSS MB '
+                 '| CPU us/req | syscalls/req | note |')
+    lines.append('|---|---|---|---|---|---|---|---|---|---|---|---|---|---|')
+    for r in results:
+        lines.append(fmt_row(r))
+
+    # 同一组合下http_conn相对tiny的吞吐量和p99
+    pairs = {}
+    for r in results:
+        pairs.setdefault((r['size'], r['connections'], r['keep_alive']), {})[r['server']] = r
+    compared = [(k, v) for k, v in pairs.items() if 'rps' in v.get('tiny', {}) and 'rps' in v.get('http_conn', {})]
+    if compared:
+        lines.append('')
+        lines.append('| size | conns | keep-alive | rps http_conn/tiny | p99 http_conn/tiny | CPU/req http_conn/tiny |')
+        lines.append('|---|---|---|---|---|---|')
+        for (size, conns, ka), v in compared:
+            t, h = v['tiny'], v['http_conn']
+            ratio = lambda a, b: ('%.2f' % (a / b)) if b else '-'
+            lines.append('| %s | %d | %s | %s | %s | %s |' % (
+                size, conns, 'on' if ka else 'off', ratio(h['rps'], t['rps']),
+                ratio(h['latency_us']['p99'], t['latency_us']['p99']), ratio(h['cpu_us_per_req'], t['cpu_us_per_req'])))
+    return '\n'.join(lines) + '\n'
+
+
+def main():
+    parser = argparse.ArgumentParser(description='tiny_web / http_conn benchmark matrix')
+    parser.add_argument('-d', '--duration', type=int, default=10)
+    parser.add_argument('-w', '--warmup', type=int, default=1)
+    parser.add_argument('-s', '--sizes', default='1k,100k,10m')
+    parser.add_argument('-c', '--conns', default='1,100,10000')
+    parser.add_argument('-k', '--keep-alive', default='on,off')
+    parser.add_argument('-t', '--threads', type=int, default=2, help='load_gen threads')
+    parser.add_argument('--servers', default='tiny,http_conn')
+    parser.add_argument('--port', type=int, default=3100)
+    parser.add_argument('-o', '--out', default='bench_results')
+    args = parser.parse_args()
+
+    sizes = parse_list(args.sizes)
+    for s in sizes:
+        if s not in SIZES:
+            parser.error('unknown size %s' % s)
+    conns = [int(x) for x in parse_list(args.conns)]
+    keep_alive = [x == 'on' for x in parse_list(args.keep_alive)]
+    servers = parse_list(args.servers)
+    args.perf = shutil.which('perf') is not None
+    args.out = os.path.abspath(args.out)
+    os.makedirs(args.out, exist_ok=True)
+
+    # 10000个连接时客户和服务器都需要足够的文件描述符
+    soft, hard = resource.getrlimit(resource.RLIMIT_NOFILE)
+    want = max(conns) * 2 + 1024
+    if soft < want:
+        resource.setrlimit(resource.RLIMIT_NOFILE, (min(want, hard), hard))
+
+    work = tempfile.mkdtemp(prefix='bench_matrix.')
+    try:
+        tiny = build(work)
+        make_docroot(work, sizes)
+        results = []
+        port = args.port
+        for size in sizes:
+            for c in conns:
+                for ka in keep_alive:
+                    for server in servers:
+                        # 每次使用新端口,避免上一次的TIME_WAIT影响
+                        port += 1
+                        r = run_cell(args, work, tiny, server, size, c, ka, port)
+                        results.append(r)
+                        print(fmt_row(r), file=sys.stderr)
+                        sys.stderr.flush()
+        with open(os.path.join(args.out, 'results.json'), 'w') as f:
+            for r in results:
+                f.write(json.dumps(r) + '\n')
+        text = report(args, results)
+        with open(os.path.join(args.out, 'report.md'), 'w') as f:
+            f.write(text)
+        print(text)
+    finally:
+        shutil.rmtree(work, ignore_errors=True)
+
+
+if __name__ == '__main__':
+    main()
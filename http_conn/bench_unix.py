@@ -0,0 +1,93 @@
+#!/usr/bin/env python3
+# 比较前端代理通过回环TCP和AF_UNIX socket(web -U)连接本服务器的延迟和吞吐量
+# 同一个web进程同时监听TCP端口和AF_UNIX socket,两种方式交替运行同样的负载,每种负载运行-r次
+# 负载: 单个长连接(只看每个请求的往返延迟),多个长连接,单个短连接(每个请求都要建立连接)
+# 用法: ./bench_unix.py [-d 秒数] [-r 次数] [-c 50] [--server-args "-s 1"] [-o 输出文件]
+import argparse
+import json
+import os
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+
+# (名称, 连接数, load_gen线程数, 长连接)
+LOADS = [('c1 keep-alive', 1, 1, True), ('cN keep-alive', None, 2, True), ('c1 short', 1, 1, False)]
+
+
+def run_load(addr, port, conns, threads, keep_alive, duration):
+    cmd = [os.path.join(HERE, 'load_gen'), '-a', addr, '-p', str(port), '-c', str(conns),
+           '-t', str(threads), '-d', str(duration), '-u', '/f1k.bin']
+    if not keep_alive:
+        cmd.append('-n')
+    out = subprocess.run(cmd, stdout=subprocess.PIPE, stderr=subprocess.DEVNULL, timeout=duration + 60).stdout
+    return json.loads(out.decode())
+
+
+def median(values):
+    values = sorted(values)
+    return values[len(values) // 2]
+
+
+def main():
+    parser = argparse.ArgumentParser(description='loopback TCP vs AF_UNIX latency')
+    parser.add_argument('-d', '--duration', type=int, default=5)
+    parser.add_argument('-r', '--repeat', type=int, default=3)
+    parser.add_argument('-c', '--conns', type=int, default=50, help='connections of the cN load')
+    parser.add_argument('--port', type=int, default=3200)
+    parser.add_argument('--server-args', default='', help='extra arguments for web, e.g. "-s 1"')
+    parser.add_argument('-o', '--out', default=None, help='write raw results as JSON lines')
+    args = parser.parse_args()
+
+    subprocess.check_call(['make', '-s', '-B', '-C', HERE, 'web', 'load_gen'])
+    work = tempfile.mkdtemp(prefix='bench_unix.')
+    sock = os.path.join(work, 'web.sock')
+    root = os.path.join(work, 'var', 'www', 'html')
+    os.makedirs(root)
+    # 1KB的文件,应答很小,差别主要来自传输层
+    with open(os.path.join(root, 'f1k.bin'), 'wb') as f:
+        f.write(os.urandom(1024))
+    cmd = [os.path.join(HERE, 'web'), '-p', str(args.port), '-U', sock] + args.server_args.split()
+    server = subprocess.Popen(cmd, cwd=work, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+    try:
+        deadline = time.time() + 5
+        while not os.path.exists(sock) and time.time() < deadline:
+            time.sleep(0.05)
+        results = []
+        for name, conns, threads, keep_alive in LOADS:
+            conns = conns or args.conns
+            for i in range(args.repeat):
+                for transport, addr in (('tcp', '127.0.0.1'), ('unix', 'unix:' + sock)):
+                    r = run_load(addr, args.port, conns, threads, keep_alive, args.duration)
+                    r['load'] = name
+                    r['transport'] = transport
+                    results.append(r)
+        if args.out:
+            with open(args.out, 'w') as f:
+                for r in results:
+                    f.write(json.dumps(r) + '\n')
+
+        # 每种负载取各次运行的中位数
+        print('| load | transport | rps | p50 us | p99 us | p99.9 us |')
+        print('|---|---|---|---|---|---|')
+        for name, _, _, _ in LOADS:
+            row = {}
+            for transport in ('tcp', 'unix'):
+                rs = [r for r in results if r['load'] == name and r['transport'] == transport]
+                row[transport] = (median([r['rps'] for r in rs]), median([r['latency_us']['p50'] for r in rs]),
+                                  median([r['latency_us']['p99'] for r in rs]), median([r['latency_us']['p99.9'] for r in rs]))
+                print('| %s | %s | %.0f | %.1f | %.1f | %.1f |' % ((name, transport) + row[transport]))
+            tcp, unix = row['tcp'], row['unix']
+            print('| %s | unix/tcp | %.2fx | %.2fx | %.2fx | %.2fx |' %
+                  (name, unix[0] / tcp[0], unix[1] / tcp[1], unix[2] / tcp[2], unix[3] / tcp[3]))
+    finally:
+        server.terminate()
+        server.wait()
+        shutil.rmtree(work, ignore_errors=True)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,240 @@
+//把根目录打包成一个包文件,由web -R加载,格式见asset_bundle.h
+//用法: ./bundle_pack [-z] [-m max_file_bytes] root output
+//  -z 同时保存gzip压缩的版本(压缩后不超过原来的90%时),客户端接受gzip时发送
+//  -m 超过该大小的文件不打包,仍然从根目录读取,默认16MB
+//先写入output.tmp再rename,运行中的服务器一秒内切换到新的包
+//只打包普通文件和指向普通文件的符号链接,不进入指向目录的符号链接
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include "asset_bundle.h"
+
+using namespace std;
+
+static bool use_gzip = false;
+static long long max_file = 16 * 1024 * 1024;
+
+struct pack_file
+{
+	string path;
+	string body;
+	string gzip;
+	uint64_t hash;
+};
+
+static const char *content_type(const string &path)
+{
+	static const char *types[][2] = {
+		{".html", "text/html; charset=utf-8"}, {".htm", "text/html; charset=utf-8"},
+		{".css", "text/css"}, {".js", "application/javascript"}, {".json", "application/json"},
+		{".txt", "text/plain; charset=utf-8"}, {".xml", "application/xml"}, {".svg", "image/svg+xml"},
+		{".png", "image/png"}, {".jpg", "image/jpeg"}, {".jpeg", "image/jpeg"}, {".gif", "image/gif"},
+		{".ico", "image/x-icon"}, {".webp", "image/webp"}, {".woff2", "font/woff2"}, {".wasm", "application/wasm"},
+	};
+	size_t dot = path.rfind('.');
+	if (dot != string::npos && path.find('/', dot) == string::npos)
+	{
+		string ext = path.substr(dot);
+		for (size_t i = 0; i < sizeof(types) / sizeof(types[0]); i++)
+			if (strcasecmp(ext.c_str(), types[i][0]) == 0)
+				return types[i][1];
+	}
+	return "application/octet-stream";
+}
+
+static bool read_file(const string &path, string &out)
+{
+	FILE *fp = fopen(path.c_str(), "rb");
+	if (!fp)
+		return false;
+	char buf[65536];
+	size_t n;
+	while ((n = fread(buf, 1, sizeof(buf), fp)) > 0)
+		out.append(buf, n);
+	bool ok = !ferror(fp);
+	fclose(fp);
+	return ok;
+}
+
+static bool gzip_compress(const string &in, string &out)
+{
+	z_stream zs;
+	memset(&zs, 0, sizeof(zs));
+	//windowBits加16生成gzip格式
+	if (deflateInit2(&zs, 9, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY) != Z_OK)
+		return false;
+	out.resize(deflateBound(&zs, in.size()));
+	zs.next_in = (Bytef *)in.data();
+	zs.avail_in = in.size();
+	zs.next_out = (Bytef *)&out[0];
+	zs.avail_out = out.size();
+	int ret = deflate(&zs, Z_FINISH);
+	out.resize(zs.total_out);
+	deflateEnd(&zs);
+	return ret == Z_STREAM_END;
+}
+
+//rel为相对于根目录的路径,根目录为""
+static void walk(const string &root, const string &rel, vector<pack_file> &files)
+{
+	string dir = rel.empty() ? root : root + "/" + rel;
+	DIR *dp = opendir(dir.c_str());
+	if (!dp)
+	{
+		fprintf(stderr, "skip %s: cannot open\n", dir.c_str());
+		return;
+	}
+	struct dirent *entry;
+	while ((entry = readdir(dp)) != NULL)
+	{
+		if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+			continue;
+		string path = rel.empty() ? string(entry->d_name) : rel + "/" + entry->d_name;
+		string full = root + "/" + path;
+		struct stat lst, st;
+		if (lstat(full.c_str(), &lst) < 0)
+			continue;
+		if (S_ISDIR(lst.st_mode))
+		{
+			walk(root, path, files);
+			continue;
+		}
+		//服务器只发送其他用户可读的文件
+		if (stat(full.c_str(), &st) < 0 || !S_ISREG(st.st_mode) || !(st.st_mode & S_IROTH))
+			continue;
+		if (st.st_size > max_file)
+		{
+			fprintf(stderr, "skip %s: %lld bytes\n", path.c_str(), (long long)st.st_size);
+			continue;
+		}
+		pack_file file;
+		file.path = path;
+		file.hash = bundle_hash(path.data(), path.size());
+		if (!read_file(full, file.body))
+		{
+			fprintf(stderr, "skip %s: read fail\n", path.c_str());
+			continue;
+		}
+		if (use_gzip && !file.body.empty() && (!gzip_compress(file.body, file.gzip) || file.gzip.size() > file.body.size() * 9 / 10))
+			file.gzip.clear();
+		files.push_back(file);
+	}
+	closedir(dp);
+}
+
+static bool file_less(const pack_file &a, const pack_file &b)
+{
+	return a.hash != b.hash ? a.hash < b.hash : a.path < b.path;
+}
+
+//追加到blob,返回在包文件中的偏移
+static uint64_t append(string &blob, uint64_t base, const string &data)
+{
+	uint64_t offset = base + blob.size();
+	blob += data;
+	return offset;
+}
+
+int main(int argc, char *argv[])
+{
+	int opt;
+	while ((opt = getopt(argc, argv, "zm:")) != -1)
+	{
+		switch (opt)
+		{
+			case 'z':
+				use_gzip = true;
+				break;
+			case 'm':
+				max_file = atoll(optarg);
+				break;
+			default:
+				fprintf(stderr, "usage: %s [-z] [-m max_file_bytes] root output\n", argv[0]);
+				return 1;
+		}
+	}
+	if (argc - optind != 2)
+	{
+		fprintf(stderr, "usage: %s [-z] [-m max_file_bytes] root output\n", argv[0]);
+		return 1;
+	}
+	string root = argv[optind];
+	string output = argv[optind + 1];
+
+	vector<pack_file> files;
+	walk(root, "", files);
+	sort(files.begin(), files.end(), file_less);
+
+	//条目表之后依次是每个文件的路径,头部和内容
+	uint64_t base = sizeof(bundle_header) + files.size() * sizeof(bundle_entry);
+	vector<bundle_entry> entries(files.size());
+	string blob;
+	size_t gzip_count = 0;
+	for (size_t i = 0; i < files.size(); i++)
+	{
+		pack_file &file = files[i];
+		bundle_entry &e = entries[i];
+		memset(&e, 0, sizeof(e));
+		e.hash = file.hash;
+		e.path_offset = append(blob, base, file.path);
+		e.path_len = file.path.size();
+		snprintf(e.etag, sizeof(e.etag), "\"%016llx\"", (unsigned long long)bundle_hash(file.body.data(), file.body.size()));
+		e.has_gzip = !file.gzip.empty();
+		gzip_count += e.has_gzip;
+
+		const char *type = content_type(file.path);
+		const char *vary = e.has_gzip ? "Vary: Accept-Encoding\r\n" : "";
+		char headers[512];
+		int n = snprintf(headers, sizeof(headers), "HTTP/1.1 200 ok\r\nContent-length: %llu\r\nContent-Type: %s\r\nETag: %s\r\n%s",
+						 (unsigned long long)file.body.size(), type, e.etag, vary);
+		e.plain.headers_offset = append(blob, base, string(headers, n));
+		e.plain.headers_len = n;
+		e.plain.body_offset = append(blob, base, file.body);
+		e.plain.body_len = file.body.size();
+		if (e.has_gzip)
+		{
+			n = snprintf(headers, sizeof(headers), "HTTP/1.1 200 ok\r\nContent-length: %llu\r\nContent-Type: %s\r\nETag: %s\r\n%sContent-Encoding: gzip\r\n",
+						 (unsigned long long)file.gzip.size(), type, e.etag, vary);
+			e.gzip.headers_offset = append(blob, base, string(headers, n));
+			e.gzip.headers_len = n;
+			e.gzip.body_offset = append(blob, base, file.gzip);
+			e.gzip.body_len = file.gzip.size();
+		}
+		//释放内存,打包大目录时只保留一份内容
+		string().swap(file.body);
+		string().swap(file.gzip);
+	}
+
+	bundle_header header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, BUNDLE_MAGIC, sizeof(BUNDLE_MAGIC));
+	header.count = files.size();
+	header.size = base + blob.size();
+
+	string tmp = output + ".tmp";
+	FILE *fp = fopen(tmp.c_str(), "wb");
+	if (!fp)
+	{
+		perror(tmp.c_str());
+		return 1;
+	}
+	bool ok = fwrite(&header, sizeof(header), 1, fp) == 1 &&
+			  (entries.empty() || fwrite(&entries[0], sizeof(bundle_entry), entries.size(), fp) == entries.size()) &&
+			  fwrite(blob.data(), 1, blob.size(), fp) == blob.size();
+	ok = fclose(fp) == 0 && ok;
+	if (!ok || rename(tmp.c_str(), output.c_str()) < 0)
+	{
+		perror(output.c_str());
+		unlink(tmp.c_str());
+		return 1;
+	}
+	printf("{\"files\": %zu, \"gzip\": %zu, \"bytes\": %llu}\n", files.size(), gzip_count, (unsigned long long)header.size);
+	return 0;
+}
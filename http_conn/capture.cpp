@@ -0,0 +1,142 @@
+#include "capture.h"
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+
+int capture::m_fd = -1;
+atomic<bool> capture::m_enabled(false);
+uint64_t capture::m_max_bytes = 0;
+uint64_t capture::m_total = 0;
+uint64_t capture::m_start_us = 0;
+atomic<uint32_t> capture::m_next_conn(1);
+atomic<uint64_t> capture::m_dropped(0);
+locker capture::m_lock;
+char *capture::m_active = NULL;
+int capture::m_active_len = 0;
+char *capture::m_flush = NULL;
+
+static uint64_t monotonic_us()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+bool capture::open(const char *path, int max_mb)
+{
+	m_fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (m_fd < 0)
+		return false;
+	capture_header header;
+	memcpy(header.magic, "CAPT", 4);
+	header.record_size = sizeof(capture_record);
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	header.start_realtime_us = ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+	if (::write(m_fd, &header, sizeof(header)) != sizeof(header))
+		return false;
+
+	m_max_bytes = (uint64_t)max_mb * 1024 * 1024;
+	m_total = sizeof(header);
+	m_start_us = monotonic_us();
+	m_active = new char[BUF_SIZE];
+	m_flush = new char[BUF_SIZE];
+
+	pthread_t tid;
+	if (pthread_create(&tid, NULL, work, NULL) != 0)
+		return false;
+	pthread_detach(tid);
+	m_enabled.store(true, memory_order_relaxed);
+	return true;
+}
+
+bool capture::append(uint8_t type, uint32_t conn, uint32_t responses, const char *buf, int len)
+{
+	capture_record record;
+	record.time_us = monotonic_us() - m_start_us;
+	record.conn = conn;
+	record.responses = responses;
+	record.len = len;
+	record.type = type;
+	memset(record.pad, 0, sizeof(record.pad));
+	int size = sizeof(record) + len;
+
+	m_lock.lock();
+	if (m_max_bytes && m_total + size > m_max_bytes)
+	{
+		//达到文件大小上限,停止录制,已经打开的连接的记录不完整,重放时按连接没有关闭处理
+		m_enabled.store(false, memory_order_relaxed);
+		m_lock.unlock();
+		return false;
+	}
+	if (m_active_len + size > BUF_SIZE)
+	{
+		m_lock.unlock();
+		m_dropped.fetch_add(1, memory_order_relaxed);
+		return false;
+	}
+	memcpy(m_active + m_active_len, &record, sizeof(record));
+	if (len > 0)
+		memcpy(m_active + m_active_len + sizeof(record), buf, len);
+	m_active_len += size;
+	m_total += size;
+	m_lock.unlock();
+	return true;
+}
+
+uint32_t capture::open_conn()
+{
+	if (!enabled())
+		return 0;
+	uint32_t conn = m_next_conn.fetch_add(1, memory_order_relaxed);
+	return append(CAPTURE_OPEN, conn, 0, NULL, 0) ? conn : 0;
+}
+
+bool capture::data(uint32_t conn, uint32_t responses, const char *buf, int len)
+{
+	return enabled() && append(CAPTURE_DATA, conn, responses, buf, len);
+}
+
+void capture::close_conn(uint32_t conn, uint32_t responses)
+{
+	if (enabled())
+		append(CAPTURE_CLOSE, conn, responses, NULL, 0);
+}
+
+void *capture::work(void *)
+{
+	while (1)
+	{
+		//交换缓冲区,在锁外写文件,生产者只在拷贝数据时持有锁
+		m_lock.lock();
+		char *buf = m_active;
+		int len = m_active_len;
+		m_active = m_flush;
+		m_active_len = 0;
+		m_flush = buf;
+		m_lock.unlock();
+
+		if (len == 0)
+		{
+			usleep(10000);
+			continue;
+		}
+		for (int off = 0; off < len;)
+		{
+			ssize_t n = ::write(m_fd, buf + off, len - off);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n <= 0)
+			{
+				//写文件失败(如磁盘满),停止录制,最后一条记录可能不完整,重放时忽略
+				m_enabled.store(false, memory_order_relaxed);
+				return NULL;
+			}
+			off += n;
+		}
+	}
+	return NULL;
+}
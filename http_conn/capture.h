@@ -0,0 +1,80 @@
+#ifndef CAPTURE_H_
+#define CAPTURE_H_
+
+#include <stdint.h>
+#include <atomic>
+#include "locker.h"
+
+using namespace std;
+
+//流量录制,记录http_conn::read()收到的每个连接的字节流和相对时间,用replay工具在本地按原来的顺序和节奏重放
+//文件格式: capture_header,之后是若干条capture_record,CAPTURE_DATA记录后紧跟len字节的数据
+
+//记录类型
+enum CAPTURE_TYPE
+{
+	CAPTURE_OPEN = 1,	//接受连接
+	CAPTURE_DATA,		//一次recv读到的数据
+	CAPTURE_CLOSE		//服务器关闭连接
+};
+
+struct capture_header
+{
+	char magic[4];
+	uint32_t record_size;
+	//开始录制时的实时时钟(微秒)
+	int64_t start_realtime_us;
+};
+
+struct capture_record
+{
+	//距离开始录制的时间(微秒)
+	uint64_t time_us;
+	//连接编号,从1开始,不会重复使用(fd会被重复使用)
+	uint32_t conn;
+	//记录这条数据时该连接上已经发送完的应答数,重放时收到这么多应答后才发送这条数据,
+	//以此保持请求与应答的先后关系,同一批流水线请求的该值相同
+	uint32_t responses;
+	uint32_t len;
+	uint8_t type;
+	uint8_t pad[3];
+};
+
+class capture
+{
+public:
+	//缓冲区的大小,后台线程写文件跟不上时数据被丢弃,对应的连接停止录制
+	static const int BUF_SIZE = 4 * 1024 * 1024;
+
+	//开始录制并启动后台线程,max_mb为文件大小上限(0表示不限),达到上限后停止录制
+	static bool open(const char *path, int max_mb);
+	static bool enabled() { return m_enabled.load(memory_order_relaxed); }
+	//新连接,返回连接编号,没有录制或已经停止时返回0
+	static uint32_t open_conn();
+	//收到数据,返回false表示数据被丢弃,调用者应停止录制该连接(之后的数据重放时没有意义)
+	static bool data(uint32_t conn, uint32_t responses, const char *buf, int len);
+	static void close_conn(uint32_t conn, uint32_t responses);
+	//因缓冲区满而丢弃的记录数
+	static uint64_t dropped() { return m_dropped.load(memory_order_relaxed); }
+
+private:
+	static bool append(uint8_t type, uint32_t conn, uint32_t responses, const char *buf, int len);
+	static void *work(void *);
+
+private:
+	static int m_fd;
+	static atomic<bool> m_enabled;
+	static uint64_t m_max_bytes;
+	//已经录制的字节数,在锁内修改
+	static uint64_t m_total;
+	static uint64_t m_start_us;
+	static atomic<uint32_t> m_next_conn;
+	static atomic<uint64_t> m_dropped;
+	//生产者写入m_active,后台线程交换两个缓冲区后把m_flush写入文件
+	static locker m_lock;
+	static char *m_active;
+	static int m_active_len;
+	static char *m_flush;
+};
+
+#endif
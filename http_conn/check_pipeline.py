@@ -0,0 +1,111 @@
+#!/usr/bin/env python3
+# 检查流水线请求: 一个连接上连续发出多个请求,应答必须一个不少并且按请求的顺序返回
+# 每种运行方式(线程池,每核线程,协程,很小的发送预算)分别启动服务器,请求一次发出,或者拆成小段逐段发出;
+# 另外先请求一个大文件并延迟读取,发送缓冲区满后应答由EPOLLOUT继续发送,之后的请求在事件循环中接着处理
+# 用法: ./check_pipeline.py [-n 每批请求数] [--port 3300],全部通过时退出码为0
+import argparse
+import os
+import shutil
+import socket
+import subprocess
+import sys
+import tempfile
+import time
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+
+MODES = ['', '-s 1', '-o', '-W 64']
+
+# 路径和期望的状态码,文件内容在启动时生成
+FILES = {'/a.html': b'<p>a</p>\n', '/b.bin': os.urandom(3000), '/c.bin': os.urandom(20000), '/big.bin': os.urandom(8 << 20)}
+PATHS = ['/a.html', '/b.bin', '/missing', '/c.bin', '/a.html?x=1']
+SLOW_PATHS = ['/big.bin', '/a.html', '/missing', '/big.bin', '/b.bin']
+
+
+def read_response(f):
+    line = f.readline()
+    if not line:
+        return None
+    status = int(line.split()[1])
+    length = 0
+    while True:
+        h = f.readline()
+        if h in (b'\r\n', b''):
+            break
+        name, _, value = h.partition(b':')
+        if name.strip().lower() == b'content-length':
+            length = int(value)
+    return status, f.read(length)
+
+
+def check(port, count, chunk, paths=PATHS, delay=0):
+    paths = [paths[i % len(paths)] for i in range(count)]
+    data = b''
+    for i, path in enumerate(paths):
+        conn = 'close' if i == count - 1 else 'keep-alive'
+        data += ('GET %s HTTP/1.1\r\nHost: x\r\nConnection: %s\r\n\r\n' % (path, conn)).encode()
+    s = socket.create_connection(('127.0.0.1', port))
+    s.settimeout(3)
+    for i in range(0, len(data), chunk):
+        s.sendall(data[i:i + chunk])
+        if chunk < len(data):
+            time.sleep(0.001)
+    time.sleep(delay)
+    f = s.makefile('rb')
+    got = []
+    try:
+        while True:
+            r = read_response(f)
+            if r is None:
+                break
+            got.append(r)
+    except socket.timeout:
+        pass
+    s.close()
+    if len(got) != count:
+        return 'got %d of %d responses' % (len(got), count)
+    for path, (status, body) in zip(paths, got):
+        expect = FILES.get(path.split('?')[0])
+        if (expect is None and status != 404) or (expect is not None and (status != 200 or body != expect)):
+            return 'wrong response for %s: %d' % (path, status)
+    return None
+
+
+def main():
+    parser = argparse.ArgumentParser(description='check pipelined requests')
+    parser.add_argument('-n', '--count', type=int, default=20)
+    parser.add_argument('--port', type=int, default=3300)
+    args = parser.parse_args()
+
+    subprocess.check_call(['make', '-s', '-C', HERE, 'web'])
+    work = tempfile.mkdtemp(prefix='check_pipeline.')
+    root = os.path.join(work, 'var', 'www', 'html')
+    os.makedirs(root)
+    for path, body in FILES.items():
+        with open(root + path, 'wb') as f:
+            f.write(body)
+    failed = 0
+    try:
+        for mode in MODES:
+            cmd = [os.path.join(HERE, 'web'), '-p', str(args.port)] + mode.split()
+            server = subprocess.Popen(cmd, cwd=work, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+            try:
+                time.sleep(0.5)
+                # 一次发出全部请求;拆成17字节的小段,请求跨越多次读取
+                for chunk in (1 << 20, 17):
+                    err = check(args.port, args.count, chunk)
+                    print('%-8s chunk=%-7d %s' % (mode or 'default', chunk, err or 'ok'))
+                    failed += err is not None
+                err = check(args.port, len(SLOW_PATHS) * 2, 1 << 20, SLOW_PATHS, 0.3)
+                print('%-8s %-13s %s' % (mode or 'default', 'epollout', err or 'ok'))
+                failed += err is not None
+            finally:
+                server.terminate()
+                server.wait()
+    finally:
+        shutil.rmtree(work, ignore_errors=True)
+    sys.exit(1 if failed else 0)
+
+
+if __name__ == '__main__':
+    main()
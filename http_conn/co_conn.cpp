@@ -0,0 +1,260 @@
+#include "co_conn.h"
+#include <coroutine>
+#include <exception>
+#include "metrics.h"
+#include "capture.h"
+
+//协程帧的分配器,每个线程一组按64字节分级的空闲链表
+//帧在哪个线程释放就放回哪个线程的链表,各工作线程对称地创建和结束协程,链表长度大致平衡
+class frame_pool
+{
+public:
+	static const size_t GRANULE = 64;
+	static const int CLASSES = 32;
+	//每级最多缓存的空闲帧数,超出的直接释放
+	static const int MAX_FREE = 1024;
+
+	static void *alloc(size_t size)
+	{
+		size_t index = (size + GRANULE - 1) / GRANULE;
+		if (index >= CLASSES)
+			return ::operator new(size);
+		free_list &list = m_lists[index];
+		if (list.head)
+		{
+			node *n = list.head;
+			list.head = n->next;
+			list.count--;
+			return n;
+		}
+		return ::operator new(index * GRANULE);
+	}
+
+	static void free(void *p, size_t size)
+	{
+		size_t index = (size + GRANULE - 1) / GRANULE;
+		if (index >= CLASSES || m_lists[index].count >= MAX_FREE)
+		{
+			::operator delete(p);
+			return;
+		}
+		node *n = (node *)p;
+		n->next = m_lists[index].head;
+		m_lists[index].head = n;
+		m_lists[index].count++;
+	}
+
+private:
+	struct node
+	{
+		node *next;
+	};
+	struct free_list
+	{
+		node *head;
+		int count;
+	};
+	static thread_local free_list m_lists[CLASSES];
+};
+
+thread_local frame_pool::free_list frame_pool::m_lists[frame_pool::CLASSES];
+
+//连接协程的返回类型,创建后先挂起,由co_handler::start()保存句柄后再开始执行
+//结束时不再挂起,帧自动释放
+struct co_task
+{
+	struct promise_type
+	{
+		co_task get_return_object() { return co_task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+		std::suspend_always initial_suspend() noexcept { return std::suspend_always(); }
+		std::suspend_never final_suspend() noexcept { return std::suspend_never(); }
+		void return_void() {}
+		void unhandled_exception() { std::terminate(); }
+
+		static void *operator new(size_t size) { return frame_pool::alloc(size); }
+		static void operator delete(void *p, size_t size) { frame_pool::free(p, size); }
+	};
+
+	explicit co_task(std::coroutine_handle<promise_type> h) : handle(h) {}
+	std::coroutine_handle<promise_type> handle;
+};
+
+//读到数据为止,先直接读一次,暂时没有数据时才挂起
+struct co_read_some
+{
+	http_conn *conn;
+	int result;
+
+	bool await_ready()
+	{
+		result = co_handler::try_read(conn);
+		return result != -2;
+	}
+	void await_suspend(std::coroutine_handle<> h)
+	{
+		//注册事件之后协程可能立即在另一个线程中恢复,之后不能再访问本对象
+		co_handler::wait_event(conn, EPOLLIN, h.address());
+	}
+	int await_resume()
+	{
+		//由EPOLLIN恢复时还没有读
+		if (result == -2)
+			result = co_handler::try_read(conn);
+		return result;
+	}
+};
+
+//发送完m_iv为止
+struct co_write_all
+{
+	http_conn *conn;
+	int result;
+
+	bool await_ready()
+	{
+		result = co_handler::try_write(conn);
+		return result != 0;
+	}
+	void await_suspend(std::coroutine_handle<> h)
+	{
+		co_handler::wait_event(conn, EPOLLOUT, h.address());
+	}
+	//由EPOLLOUT恢复时返回true,由外层循环继续发送
+	bool await_resume() { return result >= 0; }
+};
+
+int co_handler::try_read(http_conn *conn)
+{
+	if (conn->m_read_index >= http_conn::READ_BUF_SIZE)
+		return -1;
+	int n = recv(conn->m_sockfd, conn->m_read_buf + conn->m_read_index, http_conn::READ_BUF_SIZE - conn->m_read_index, 0);
+	if (n < 0)
+		return (errno == EAGAIN || errno == EWOULDBLOCK) ? -2 : -1;
+	if (n > 0)
+	{
+		if (conn->m_req_start == 0)
+			conn->m_req_start = metrics::now();
+		TRACE_MARK(conn->m_trace, TP_READ);
+		if (conn->m_capture_id && !capture::data(conn->m_capture_id, conn->m_responses, conn->m_read_buf + conn->m_read_index, n))
+			conn->m_capture_id = 0;
+		conn->m_read_index += n;
+	}
+	return n;
+}
+
+int co_handler::try_write(http_conn *conn)
+{
+	metrics_timer timer(STAGE_WRITE);
+	while (conn->m_bytes_to_send > 0)
+	{
+		int n = conn->send_response(0);
+		if (n < 0)
+			return (errno == EAGAIN) ? 0 : -1;
+	}
+	return 1;
+}
+
+void co_handler::wait_event(http_conn *conn, int ev, void *handle)
+{
+	conn->m_co = handle;
+	conn->rearm(ev);
+}
+
+void co_handler::close(http_conn *conn)
+{
+	//协程正在执行,不能由close_conn()销毁
+	conn->m_co = 0;
+	conn->close_conn();
+}
+
+co_task co_handler::serve(http_conn *conn)
+{
+	//读缓冲区中是否已有流水线发来的下一个请求
+	bool pending = false;
+	while (true)
+	{
+		//读取并解析,直到得到一个完整的请求,已有数据时先解析
+		http_conn::HTTP_CODE ret = http_conn::NO_REQUEST;
+		while (ret == http_conn::NO_REQUEST)
+		{
+			if (!pending)
+			{
+				int n = co_await co_read_some{conn, 0};
+				if (n <= 0)
+				{
+					close(conn);
+					co_return;
+				}
+			}
+			pending = false;
+			uint64_t begin = metrics::now();
+			conn->m_do_request_start = 0;
+			ret = conn->process_read();
+			if (ret == http_conn::NO_REQUEST)
+				continue;
+			uint64_t parsed = metrics::now();
+			if (conn->m_do_request_start)
+			{
+				TRACE_MARK(conn->m_trace, TP_RESOLVED);
+				metrics::record(STAGE_PARSE, conn->m_do_request_start - begin);
+				metrics::record(STAGE_DO_REQUEST, parsed - conn->m_do_request_start);
+			}
+			else
+				metrics::record(STAGE_PARSE, parsed - begin);
+			conn->m_handle_us = metrics::to_ns(parsed - begin) / 1000;
+		}
+
+		//反向代理,流式应答和WebSocket交还给原来的状态机,之后该连接不再使用协程
+		if (ret == http_conn::PROXY_REQUEST)
+		{
+			conn->m_co = 0;
+			conn->start_proxy();
+			co_return;
+		}
+		if (!conn->process_write(ret))
+		{
+			close(conn);
+			co_return;
+		}
+		if (conn->m_producer || conn->m_ws)
+		{
+			conn->m_co = 0;
+			conn->rearm(EPOLLOUT);
+			co_return;
+		}
+
+		bool ok = true;
+		while (ok && conn->m_bytes_to_send > 0)
+			ok = co_await co_write_all{conn, 0};
+		conn->release_file();
+		if (!ok)
+		{
+			close(conn);
+			co_return;
+		}
+		conn->log_request();
+		if (!conn->m_linger)
+		{
+			close(conn);
+			co_return;
+		}
+		pending = conn->next_request() > 0;
+	}
+}
+
+void co_handler::start(http_conn *conn)
+{
+	co_task task = serve(conn);
+	conn->m_co = task.handle.address();
+	task.handle.resume();
+}
+
+void co_handler::resume(void *handle)
+{
+	std::coroutine_handle<>::from_address(handle).resume();
+}
+
+void co_handler::destroy(void *handle)
+{
+	std::coroutine_handle<>::from_address(handle).destroy();
+}
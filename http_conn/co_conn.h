@@ -0,0 +1,40 @@
+#ifndef CO_CONN_H_
+#define CO_CONN_H_
+
+#include "http_conn.h"
+
+//协程方式处理连接(web -o),由C++20协程实现,只有co_conn.cpp需要用-std=c++20编译
+//一个连接的读请求,解析,写应答和保持连接的循环写成顺序的代码:
+//	co_await read_some() 读到数据为止,没有数据时注册EPOLLIN并挂起
+//	co_await write_all() 发送完m_iv为止,发送缓冲区满时注册EPOLLOUT并挂起
+//事件到达后主线程把连接放入线程池,工作线程在process()中恢复协程,同一时刻只有一个线程执行一个连接的协程
+//流式应答,反向代理和WebSocket等仍由原来的状态机处理,遇到这些请求时协程结束,连接交还给原来的路径
+//协程帧从每个线程自己的空闲链表中分配,不经过malloc
+
+struct co_task;
+
+class co_handler
+{
+public:
+	//在工作线程中创建连接的协程并开始执行
+	static void start(http_conn *conn);
+	//在工作线程中恢复挂起的协程
+	static void resume(void *handle);
+	//连接被主线程关闭时销毁挂起的协程
+	static void destroy(void *handle);
+
+private:
+	friend struct co_read_some;
+	friend struct co_write_all;
+	static co_task serve(http_conn *conn);
+	//尝试读取一次,返回读到的字节数,0表示对方关闭,-1表示出错或缓冲区已满,-2表示暂时没有数据
+	static int try_read(http_conn *conn);
+	//尝试发送m_iv中的剩余数据,返回1表示发送完毕,0表示发送缓冲区满,-1表示出错
+	static int try_write(http_conn *conn);
+	//协程挂起前注册事件
+	static void wait_event(http_conn *conn, int ev, void *handle);
+	//在协程内关闭连接,协程随后结束
+	static void close(http_conn *conn);
+};
+
+#endif
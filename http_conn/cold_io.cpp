@@ -0,0 +1,150 @@
+#include "cold_io.h"
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include "http_conn.h"
+#include "metrics.h"
+
+//较早的头文件没有cachestat(Linux 6.5)和MADV_POPULATE_READ(Linux 5.14)
+#ifndef SYS_cachestat
+#define SYS_cachestat 451
+#endif
+#ifndef MADV_POPULATE_READ
+#define MADV_POPULATE_READ 22
+#endif
+
+struct cachestat_range
+{
+	uint64_t off;
+	uint64_t len;
+};
+
+struct cachestat_result
+{
+	uint64_t nr_cache;
+	uint64_t nr_dirty;
+	uint64_t nr_writeback;
+	uint64_t nr_evicted;
+	uint64_t nr_recently_evicted;
+};
+
+threadpool<cold_read> *cold_io::m_pool = NULL;
+static bool has_cachestat = true;
+
+bool cold_io::init(int threads, int queue)
+{
+	if (threads <= 0)
+		return true;
+	try
+	{
+		m_pool = new threadpool<cold_read>(threads, queue, vector<int>(), "web-io");
+	}
+	catch (...)
+	{
+		return false;
+	}
+	return true;
+}
+
+bool cold_io::resident(int fd, off_t offset, size_t len)
+{
+	long page = sysconf(_SC_PAGESIZE);
+	off_t begin = offset & ~(off_t)(page - 1);
+	if (has_cachestat)
+	{
+		struct cachestat_range range = {(uint64_t)begin, (uint64_t)(offset + len - begin)};
+		struct cachestat_result cs;
+		if (syscall(SYS_cachestat, fd, &range, &cs, 0) == 0)
+			return cs.nr_cache >= (range.len + page - 1) / page;
+		if (errno != ENOSYS)
+			return true;
+		has_cachestat = false;
+	}
+	//不支持cachestat时探测这一段的第一页和最后一页
+	char byte;
+	struct iovec iv = {&byte, 1};
+	return preadv2(fd, &iv, 1, offset, RWF_NOWAIT) >= 0 && preadv2(fd, &iv, 1, offset + len - 1, RWF_NOWAIT) >= 0;
+}
+
+bool cold_io::resident(const char *addr, size_t len)
+{
+	long page = sysconf(_SC_PAGESIZE);
+	uintptr_t begin = (uintptr_t)addr & ~(uintptr_t)(page - 1);
+	size_t pages = ((uintptr_t)addr + len - begin + page - 1) / page;
+	unsigned char vec[WINDOW / 4096 + 2];
+	if (pages > sizeof(vec))
+		pages = sizeof(vec);
+	if (mincore((void *)begin, pages * page, vec) != 0)
+		return true;
+	for (size_t i = 0; i < pages; i++)
+		if (!(vec[i] & 1))
+			return false;
+	return true;
+}
+
+bool cold_io::submit(http_conn *conn, int fd, const char *addr, off_t offset, size_t len)
+{
+	cold_read *task = new cold_read;
+	task->conn = conn;
+	task->fd = fd;
+	task->addr = addr;
+	task->offset = offset;
+	task->len = len;
+	task->submitted = metrics::now();
+	if (!m_pool->append(task))
+	{
+		delete task;
+		metrics::add(COUNTER_COLD_OVERFLOWS);
+		return false;
+	}
+	metrics::add(COUNTER_COLD_READS);
+	metrics::add(COUNTER_COLD_BYTES, len);
+	return true;
+}
+
+//每个I/O线程读入页缓存时使用的缓冲区
+static thread_local char *scratch = NULL;
+
+void cold_read::process()
+{
+	bool ok = true;
+	if (fd >= 0)
+	{
+		if (!scratch)
+			scratch = new char[cold_io::WINDOW];
+		size_t done = 0;
+		while (done < len)
+		{
+			size_t n = (len - done < cold_io::WINDOW) ? len - done : cold_io::WINDOW;
+			ssize_t got = pread(fd, scratch, n, offset + done);
+			if (got <= 0)
+			{
+				//文件被截短时由sendfile发现,读取出错时由连接关闭
+				ok = got == 0;
+				break;
+			}
+			done += got;
+		}
+	}
+	else
+	{
+		long page = sysconf(_SC_PAGESIZE);
+		uintptr_t begin = (uintptr_t)addr & ~(uintptr_t)(page - 1);
+		size_t range = (uintptr_t)addr + len - begin;
+		//不支持MADV_POPULATE_READ时逐页访问
+		if (madvise((void *)begin, range, MADV_POPULATE_READ) != 0)
+		{
+			volatile char sum = 0;
+			for (size_t i = 0; i < range; i += page)
+				sum += ((const char *)begin)[i];
+		}
+	}
+	metrics::record(STAGE_COLD_READ, metrics::now() - submitted);
+	//之后连接可能立即被事件循环处理,不能再访问本任务
+	http_conn *c = conn;
+	off_t end = offset + len;
+	delete this;
+	c->cold_read_done(ok, end);
+}
@@ -0,0 +1,51 @@
+#ifndef COLD_IO_H_
+#define COLD_IO_H_
+
+#include <sys/types.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "threadpool.h"
+
+class http_conn;
+
+//一次冷读:把文件的一段读入页缓存,完成后重新注册连接的EPOLLOUT
+class cold_read
+{
+public:
+	http_conn *conn;
+	//fd不小于0时从fd读取,否则访问addr处的共享映射
+	int fd;
+	const char *addr;
+	off_t offset;
+	size_t len;
+	uint64_t submitted;
+
+	//在I/O线程中执行
+	void process();
+};
+
+//文件不在页缓存中时,第一次读取(sendfile,访问映射或者pread)会等待磁盘,
+//事件循环和工作线程因此阻塞时,其他所有连接都要等待
+//发送文件内容之前先检查接下来的一段是否都在页缓存中:映射用mincore,文件描述符用cachestat(不支持时用preadv2(RWF_NOWAIT)探测),
+//不在页缓存中时交给专门的I/O线程池读入页缓存,读完后连接重新注册EPOLLOUT,由事件循环继续发送,这时数据都在内存中
+//I/O线程池的队列满时退回到原来的阻塞读取。协程方式(-o)仍然阻塞读取
+class cold_io
+{
+public:
+	//每次检查和读取的字节数
+	static const size_t WINDOW = 256 * 1024;
+
+	//创建I/O线程池,threads为0时不启用;I/O线程大部分时间在等待磁盘,不绑定CPU
+	static bool init(int threads, int queue);
+	static bool enabled() { return m_pool != NULL; }
+	//[offset, offset+len)是否都在页缓存中
+	static bool resident(int fd, off_t offset, size_t len);
+	static bool resident(const char *addr, size_t len);
+	//交给I/O线程,返回false表示队列已满,由调用者阻塞读取
+	static bool submit(http_conn *conn, int fd, const char *addr, off_t offset, size_t len);
+
+private:
+	static threadpool<cold_read> *m_pool;
+};
+
+#endif
@@ -0,0 +1,64 @@
+#include "completion.h"
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include "metrics.h"
+
+extern void addfd(int epollfd, int fd, bool one_shot);
+extern void modfd(int epollfd, int fd, int ev);
+
+int completion_queue::m_eventfd = -1;
+thread_local bool completion_queue::m_reactor = false;
+locker completion_queue::m_lock;
+vector<completion_queue::item> completion_queue::m_pending;
+
+bool completion_queue::init(int epollfd)
+{
+	m_eventfd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (m_eventfd < 0)
+		return false;
+	addfd(epollfd, m_eventfd, false);
+	m_reactor = true;
+	return true;
+}
+
+void completion_queue::rearm(int epollfd, int fd, int ev)
+{
+	if (m_reactor || m_eventfd < 0)
+	{
+		modfd(epollfd, fd, ev);
+		return;
+	}
+	item it;
+	it.epollfd = epollfd;
+	it.fd = fd;
+	it.ev = ev;
+	m_lock.lock();
+	//主线程取走队列之前的多次完成只唤醒一次
+	bool signal = m_pending.empty();
+	m_pending.push_back(it);
+	m_lock.unlock();
+	if (signal)
+	{
+		uint64_t one = 1;
+		::write(m_eventfd, &one, sizeof(one));
+		metrics::add(COUNTER_COMPLETION_WAKEUPS);
+	}
+}
+
+void completion_queue::drain()
+{
+	uint64_t count;
+	while (read(m_eventfd, &count, sizeof(count)) > 0)
+		;
+
+	//只在主线程中使用,两个缓冲区交替使用,稳定后不再分配内存
+	static vector<item> batch;
+	m_lock.lock();
+	batch.swap(m_pending);
+	m_lock.unlock();
+
+	for (size_t i = 0; i < batch.size(); i++)
+		modfd(batch[i].epollfd, batch[i].fd, batch[i].ev);
+	metrics::add(COUNTER_COMPLETIONS, batch.size());
+	batch.clear();
+}
@@ -0,0 +1,43 @@
+#ifndef COMPLETION_H_
+#define COMPLETION_H_
+
+#include <stdint.h>
+#include <vector>
+#include "locker.h"
+
+using namespace std;
+
+//工作线程处理完请求后不直接调用epoll_ctl重新注册连接的事件,而是放入完成队列,
+//队列由空变为非空时才写一次eventfd唤醒主线程,主线程一次取出所有连接并修改它们的事件
+//这样epoll_ctl都在主线程中调用,不与epoll_wait争用epoll内部的锁,多个请求的完成只唤醒主线程一次
+//epoll没有批量修改的接口,每个连接仍然需要一次epoll_ctl
+//web -q时启用,否则rearm直接调用modfd
+class completion_queue
+{
+public:
+	//创建eventfd并注册到主线程的epoll中,必须在主线程中调用,之后由主线程调用的rearm直接修改事件
+	static bool init(int epollfd);
+	static bool enabled() { return m_eventfd >= 0; }
+	static int eventfd() { return m_eventfd; }
+	//重新注册连接的事件(EPOLLONESHOT),在主线程中直接调用modfd,在其他线程中放入队列
+	static void rearm(int epollfd, int fd, int ev);
+	//主线程中eventfd可读时调用
+	static void drain();
+
+private:
+	struct item
+	{
+		int epollfd;
+		int fd;
+		int ev;
+	};
+
+private:
+	static int m_eventfd;
+	//是否是主线程
+	static thread_local bool m_reactor;
+	static locker m_lock;
+	static vector<item> m_pending;
+};
+
+#endif
@@ -0,0 +1,339 @@
+//连接风暴测试,测量服务器每秒能接受的连接数以及内核因监听队列满丢弃的SYN
+//用法: ./conn_storm [-a host] [-p port] [-c concurrency] [-t threads] [-d seconds] [-u path] [-k]
+//  -c 每个线程同时进行的连接数,每个连接完成后立即发起新的连接
+//  -u 每个连接发送一个短连接请求并读完应答;-k只建立连接后立即关闭,只测量接受连接
+//客户端以RST关闭连接,不在本机留下TIME_WAIT,避免本地端口耗尽
+//SYN被丢弃时内核1秒后重传,建立连接用时超过SYN_RETRANS_MS的计为一次SYN重传
+//同时输出/proc/net/netstat中监听队列相关计数器在测试期间的增量(同一台机器上测试时有效)
+//结果以JSON输出到标准输出
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+using namespace std;
+
+static const long long SYN_RETRANS_MS = 900;
+//一个连接多久没有完成认为失败
+static const long long TIMEOUT_NS = 10 * 1000000000LL;
+
+static const char *host = "127.0.0.1";
+static int port = 3000;
+static int conn_num = 200;
+static int thread_num = 1;
+static int duration = 5;
+static string request = "GET /index.html HTTP/1.1\r\nConnection: close\r\n\r\n";
+static bool connect_only = false;
+
+static atomic<bool> stop(false);
+
+static long long now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+struct storm_conn
+{
+	int fd;
+	long long start;
+	//连接建立的时间,0表示正在连接
+	long long connected;
+	size_t sent;
+};
+
+struct storm_stats
+{
+	long long done;
+	long long errors;
+	long long timeouts;
+	long long syn_retrans;
+	//建立连接的用时(微秒)
+	vector<double> connect_us;
+};
+
+//监听队列相关的计数器
+static const char *netstat_names[] = {"ListenOverflows", "ListenDrops", "TCPReqQFullDrop", "TCPReqQFullDoCookies", "SyncookiesSent"};
+static const int NETSTAT_COUNT = sizeof(netstat_names) / sizeof(netstat_names[0]);
+
+//读取/proc/net/netstat的TcpExt行,第一行为字段名,第二行为值
+static void read_netstat(long long *values)
+{
+	memset(values, 0, sizeof(long long) * NETSTAT_COUNT);
+	FILE *fp = fopen("/proc/net/netstat", "r");
+	if (!fp)
+		return;
+	char names[8192], nums[8192];
+	while (fgets(names, sizeof(names), fp) && fgets(nums, sizeof(nums), fp))
+	{
+		if (strncmp(names, "TcpExt:", 7) != 0)
+			continue;
+		char *save1, *save2;
+		char *name = strtok_r(names, " \n", &save1);
+		char *num = strtok_r(nums, " \n", &save2);
+		while (name && num)
+		{
+			for (int i = 0; i < NETSTAT_COUNT; i++)
+				if (strcmp(name, netstat_names[i]) == 0)
+					values[i] = atoll(num);
+			name = strtok_r(NULL, " \n", &save1);
+			num = strtok_r(NULL, " \n", &save2);
+		}
+	}
+	fclose(fp);
+}
+
+static void close_rst(int fd)
+{
+	struct linger lg = {1, 0};
+	setsockopt(fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+	close(fd);
+}
+
+static bool open_conn(int epollfd, storm_conn &c, int index, const struct sockaddr_in &addr)
+{
+	c.fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	c.start = now_ns();
+	if (c.fd < 0)
+		return false;
+	c.connected = 0;
+	c.sent = 0;
+	if (connect(c.fd, (const struct sockaddr *)&addr, sizeof(addr)) < 0 && errno != EINPROGRESS)
+	{
+		close(c.fd);
+		c.fd = -1;
+		return false;
+	}
+	epoll_event ev;
+	ev.events = EPOLLOUT;
+	ev.data.u32 = index;
+	epoll_ctl(epollfd, EPOLL_CTL_ADD, c.fd, &ev);
+	return true;
+}
+
+static void *work(void *arg)
+{
+	storm_stats *stats = (storm_stats *)arg;
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	inet_pton(AF_INET, host, &addr.sin_addr);
+
+	int epollfd = epoll_create1(0);
+	vector<storm_conn> conns(conn_num);
+	for (int i = 0; i < conn_num; i++)
+		if (!open_conn(epollfd, conns[i], i, addr))
+			stats->errors++;
+
+	vector<epoll_event> events(conn_num);
+	char buf[65536];
+	long long last_check = now_ns();
+	while (!stop.load(memory_order_relaxed))
+	{
+		int num = epoll_wait(epollfd, &events[0], conn_num, 100);
+		for (int i = 0; i < num; i++)
+		{
+			int index = events[i].data.u32;
+			storm_conn &c = conns[index];
+			bool finished = false, failed = false;
+			if (c.connected == 0)
+			{
+				int err = 0;
+				socklen_t len = sizeof(err);
+				getsockopt(c.fd, SOL_SOCKET, SO_ERROR, &err, &len);
+				if (err != 0 || (events[i].events & (EPOLLERR | EPOLLHUP)))
+					failed = true;
+				else
+				{
+					c.connected = now_ns();
+					double us = (c.connected - c.start) / 1000.0;
+					stats->connect_us.push_back(us);
+					if (us / 1000 >= SYN_RETRANS_MS)
+						stats->syn_retrans++;
+					if (connect_only)
+						finished = true;
+				}
+			}
+			if (!finished && !failed && c.connected)
+			{
+				while (c.sent < request.size())
+				{
+					int n = send(c.fd, request.data() + c.sent, request.size() - c.sent, MSG_NOSIGNAL);
+					if (n < 0)
+					{
+						failed = errno != EAGAIN;
+						break;
+					}
+					c.sent += n;
+				}
+				//请求发送完后读到对方关闭为止
+				while (!failed && c.sent == request.size())
+				{
+					int n = recv(c.fd, buf, sizeof(buf), 0);
+					if (n == 0)
+					{
+						finished = true;
+						break;
+					}
+					if (n < 0)
+					{
+						failed = errno != EAGAIN;
+						break;
+					}
+				}
+				if (!finished && !failed)
+				{
+					epoll_event ev;
+					ev.events = (c.sent < request.size()) ? EPOLLOUT : EPOLLIN;
+					ev.data.u32 = index;
+					epoll_ctl(epollfd, EPOLL_CTL_MOD, c.fd, &ev);
+				}
+			}
+			if (finished || failed)
+			{
+				if (finished)
+					stats->done++;
+				else
+					stats->errors++;
+				close_rst(c.fd);
+				if (!open_conn(epollfd, c, index, addr))
+					stats->errors++;
+			}
+		}
+
+		//超时的连接重新发起
+		long long now = now_ns();
+		if (now - last_check > 1000000000LL)
+		{
+			last_check = now;
+			for (int i = 0; i < conn_num; i++)
+			{
+				storm_conn &c = conns[i];
+				if (c.fd < 0 || now - c.start > TIMEOUT_NS)
+				{
+					//之前创建socket失败的连接也在这里重试
+					if (c.fd >= 0)
+					{
+						stats->timeouts++;
+						close_rst(c.fd);
+					}
+					if (!open_conn(epollfd, c, i, addr))
+						stats->errors++;
+				}
+			}
+		}
+	}
+	for (int i = 0; i < conn_num; i++)
+		if (conns[i].fd >= 0)
+			close_rst(conns[i].fd);
+	close(epollfd);
+	return NULL;
+}
+
+static double percentile(const vector<double> &sorted, double p)
+{
+	if (sorted.empty())
+		return 0;
+	size_t index = (size_t)(p / 100 * (sorted.size() - 1) + 0.5);
+	return sorted[min(index, sorted.size() - 1)];
+}
+
+int main(int argc, char *argv[])
+{
+	int opt;
+	while ((opt = getopt(argc, argv, "a:p:c:t:d:u:k")) != -1)
+	{
+		switch (opt)
+		{
+			case 'a':
+				host = optarg;
+				break;
+			case 'p':
+				port = atoi(optarg);
+				break;
+			case 'c':
+				conn_num = atoi(optarg);
+				break;
+			case 't':
+				thread_num = atoi(optarg);
+				break;
+			case 'd':
+				duration = atoi(optarg);
+				break;
+			case 'u':
+				request = string("GET ") + optarg + " HTTP/1.1\r\nConnection: close\r\n\r\n";
+				break;
+			case 'k':
+				connect_only = true;
+				break;
+			default:
+				fprintf(stderr, "usage: %s [-a host] [-p port] [-c concurrency] [-t threads] [-d seconds] [-u path] [-k]\n", argv[0]);
+				return 1;
+		}
+	}
+	if (conn_num <= 0 || thread_num <= 0 || duration <= 0)
+	{
+		fprintf(stderr, "bad arguments\n");
+		return 1;
+	}
+	struct rlimit rl;
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max)
+	{
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+
+	long long before[NETSTAT_COUNT], after[NETSTAT_COUNT];
+	read_netstat(before);
+	vector<storm_stats> stats(thread_num);
+	vector<pthread_t> threads(thread_num);
+	long long begin = now_ns();
+	for (int i = 0; i < thread_num; i++)
+	{
+		stats[i].done = stats[i].errors = stats[i].timeouts = stats[i].syn_retrans = 0;
+		pthread_create(&threads[i], NULL, work, &stats[i]);
+	}
+	sleep(duration);
+	stop.store(true);
+	for (int i = 0; i < thread_num; i++)
+		pthread_join(threads[i], NULL);
+	double seconds = (now_ns() - begin) / 1e9;
+	read_netstat(after);
+
+	storm_stats total;
+	total.done = total.errors = total.timeouts = total.syn_retrans = 0;
+	for (int i = 0; i < thread_num; i++)
+	{
+		total.done += stats[i].done;
+		total.errors += stats[i].errors;
+		total.timeouts += stats[i].timeouts;
+		total.syn_retrans += stats[i].syn_retrans;
+		total.connect_us.insert(total.connect_us.end(), stats[i].connect_us.begin(), stats[i].connect_us.end());
+	}
+	sort(total.connect_us.begin(), total.connect_us.end());
+
+	printf("{\"mode\": \"%s\", \"concurrency\": %d, \"threads\": %d, \"duration_s\": %.3f, "
+		   "\"connections\": %lld, \"conn_per_s\": %.1f, \"errors\": %lld, \"timeouts\": %lld, \"syn_retrans\": %lld, "
+		   "\"connect_us\": {\"p50\": %.1f, \"p99\": %.1f, \"p99.9\": %.1f, \"max\": %.1f}, \"netstat\": {",
+		   connect_only ? "connect" : "request", conn_num, thread_num, seconds,
+		   total.done, total.done / seconds, total.errors, total.timeouts, total.syn_retrans,
+		   percentile(total.connect_us, 50), percentile(total.connect_us, 99), percentile(total.connect_us, 99.9),
+		   total.connect_us.empty() ? 0 : total.connect_us.back());
+	for (int i = 0; i < NETSTAT_COUNT; i++)
+		printf("%s\"%s\": %lld", i ? ", " : "", netstat_names[i], after[i] - before[i]);
+	printf("}}\n");
+	return 0;
+}
@@ -0,0 +1,155 @@
+#include "dir_list.h"
+#include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "doc_tree.h"
+
+//百分号编码,只保留RFC 3986中的非保留字符和'/',结果可以直接放在双引号中的属性值里
+static void url_encode(const char *in, char *out, int size)
+{
+	static const char hex[] = "0123456789ABCDEF";
+	int len = 0;
+	for (const unsigned char *p = (const unsigned char *)in; *p && len + 4 <= size; p++)
+	{
+		if (isalnum(*p) || strchr("-._~/", *p))
+			out[len++] = *p;
+		else
+		{
+			out[len++] = '%';
+			out[len++] = hex[*p >> 4];
+			out[len++] = hex[*p & 15];
+		}
+	}
+	out[len] = '\0';
+}
+
+//HTML转义,用于元素内容和属性值
+static void html_escape(const char *in, char *out, int size)
+{
+	int len = 0;
+	for (const char *p = in; *p && len + 7 <= size; p++)
+	{
+		const char *rep = NULL;
+		switch (*p)
+		{
+			case '&': rep = "&amp;"; break;
+			case '<': rep = "&lt;"; break;
+			case '>': rep = "&gt;"; break;
+			case '"': rep = "&quot;"; break;
+			case '\'': rep = "&#39;"; break;
+		}
+		if (rep)
+			len += sprintf(out + len, "%s", rep);
+		else
+			out[len++] = *p;
+	}
+	out[len] = '\0';
+}
+
+dir_list_producer *dir_list_producer::create(const char *path)
+{
+	int fd = doc_tree::open(path, O_RDONLY | O_DIRECTORY);
+	if (fd < 0)
+		return NULL;
+	DIR *dir = fdopendir(fd);
+	if (!dir)
+	{
+		close(fd);
+		return NULL;
+	}
+	return new dir_list_producer(dir, path);
+}
+
+dir_list_producer::dir_list_producer(DIR *dir, const char *path)
+	: m_dir(dir),
+	  m_line_len(0),
+	  m_batch_len(0),
+	  m_header_sent(false)
+{
+	//规范化的路径不以'/'开头,根目录为""
+	int len = snprintf(m_dir_path, sizeof(m_dir_path), "/%s", path);
+	if (len > (int)sizeof(m_dir_path) - 2)
+		len = sizeof(m_dir_path) - 2;
+	if (m_dir_path[len - 1] != '/')
+	{
+		m_dir_path[len++] = '/';
+		m_dir_path[len] = '\0';
+	}
+}
+
+dir_list_producer::~dir_list_producer()
+{
+	if (m_dir)
+		closedir(m_dir);
+}
+
+void dir_list_producer::format_line(const char *format, ...)
+{
+	va_list arg;
+	va_start(arg, format);
+	m_line_len = vsnprintf(m_line, LINE_SIZE, format, arg);
+	va_end(arg);
+	if (m_line_len >= LINE_SIZE)
+		m_line_len = LINE_SIZE - 1;
+}
+
+//多个目录项合并成一个chunk发送,减少帧开销
+bool dir_list_producer::produce(http_conn *conn)
+{
+	if (!m_header_sent)
+	{
+		char title[sizeof(m_dir_path) * 6];
+		html_escape(m_dir_path, title, sizeof(title));
+		format_line("<html><head><title>Index of %s</title></head><body><h1>Index of %s</h1>\n", title, title);
+		m_header_sent = true;
+	}
+
+	int limit = conn->chunk_room();
+	if (limit > BATCH_SIZE)
+		limit = BATCH_SIZE;
+	while (1)
+	{
+		if (m_line_len > 0)
+		{
+			if (m_batch_len + m_line_len <= limit)
+			{
+				memcpy(m_batch + m_batch_len, m_line, m_line_len);
+				m_batch_len += m_line_len;
+				m_line_len = 0;
+			}
+			else
+			{
+				//缓冲区满了,已经攒下的数据先写入,剩下的等下一次回调
+				if (m_batch_len > 0)
+					conn->push_chunk(m_batch, m_batch_len);
+				m_batch_len = 0;
+				return false;
+			}
+		}
+		if (!m_dir)
+			break;
+
+		struct dirent *entry = readdir(m_dir);
+		if (!entry)
+		{
+			closedir(m_dir);
+			m_dir = NULL;
+			format_line("</body></html>\n");
+			continue;
+		}
+		if (strcmp(entry->d_name, ".") == 0)
+			continue;
+		char target[sizeof(m_dir_path) + sizeof(entry->d_name)];
+		char href[sizeof(target) * 3];
+		char text[sizeof(entry->d_name) * 6];
+		snprintf(target, sizeof(target), "%s%s", m_dir_path, entry->d_name);
+		url_encode(target, href, sizeof(href));
+		html_escape(entry->d_name, text, sizeof(text));
+		format_line("<a href=\"%s\">%s</a><br>\n", href, text);
+	}
+
+	if (m_batch_len > 0)
+		conn->push_chunk(m_batch, m_batch_len);
+	m_batch_len = 0;
+	return true;
+}
@@ -0,0 +1,39 @@
+#ifndef DIR_LIST_H_
+#define DIR_LIST_H_
+
+#include <dirent.h>
+#include "http_conn.h"
+
+//以流式应答返回目录列表,目录项逐个读取,缓冲区满时暂停,连接再次可写时继续
+//文件名可能含有任意字符,链接地址百分号编码,显示的文本HTML转义
+class dir_list_producer : public stream_producer
+{
+public:
+	//path为相对于根目录的规范化路径(见doc_tree),打开目录失败时返回NULL
+	static dir_list_producer *create(const char *path);
+	~dir_list_producer();
+	bool produce(http_conn *conn);
+
+private:
+	dir_list_producer(DIR *dir, const char *path);
+	//把一行格式化到m_line中,等待写入
+	void format_line(const char *format, ...);
+
+private:
+	//一行最长为编码后的路径和文件名加上转义后的文件名,约3KB
+	static const int LINE_SIZE = 4096;
+	static const int BATCH_SIZE = 8192;
+
+	DIR *m_dir;
+	//目录的路径,以'/'开头和结尾,没有编码
+	char m_dir_path[http_conn::MAXFILENAME_LEN + 2];
+	//上一次没有写入的行
+	char m_line[LINE_SIZE];
+	int m_line_len;
+	//合并后等待写入的多个目录项
+	char m_batch[BATCH_SIZE];
+	int m_batch_len;
+	//是否已经写入页面头部
+	bool m_header_sent;
+};
+#endif
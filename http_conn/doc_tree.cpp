@@ -0,0 +1,255 @@
+#include "doc_tree.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/openat2.h>
+
+int doc_tree::m_root_fd = -1;
+bool doc_tree::m_has_openat2 = true;
+thread_local unordered_map<string, doc_tree::dir_entry> *doc_tree::m_dirs = NULL;
+
+static uint64_t coarse_ms()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+static int hex_value(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+bool doc_tree::init(const char *root)
+{
+	m_root_fd = ::open(root, O_PATH | O_DIRECTORY | O_CLOEXEC);
+	if (m_root_fd < 0)
+		return false;
+	//在启动其他线程之前探测一次,之后m_has_openat2只读
+	struct open_how how;
+	memset(&how, 0, sizeof(how));
+	how.flags = O_PATH | O_CLOEXEC;
+	how.resolve = RESOLVE_BENEATH;
+	int fd = syscall(SYS_openat2, m_root_fd, ".", &how, sizeof(how));
+	if (fd >= 0)
+		close(fd);
+	else if (errno == ENOSYS)
+		m_has_openat2 = false;
+	return true;
+}
+
+bool doc_tree::normalize(const char *url, char *path, int size)
+{
+	int out = 0;
+	const char *p = url;
+	while (*p == '/')
+		p++;
+	while (*p && *p != '?' && *p != '#')
+	{
+		//复制并解码一段
+		int seg = out;
+		while (*p && *p != '/' && *p != '?' && *p != '#')
+		{
+			char c = *p++;
+			if (c == '%')
+			{
+				int high = hex_value(p[0]);
+				int low = (high < 0) ? -1 : hex_value(p[1]);
+				if (low < 0)
+					return false;
+				c = high * 16 + low;
+				p += 2;
+				if (c == '\0' || c == '/')
+					return false;
+			}
+			if (out >= size - 1)
+				return false;
+			path[out++] = c;
+		}
+		//解码之后再判断"."和"..",编码的点同样处理
+		int len = out - seg;
+		bool slash = *p == '/';
+		while (*p == '/')
+			p++;
+		if (len == 1 && path[seg] == '.')
+			out = seg;
+		else if (len == 2 && path[seg] == '.' && path[seg + 1] == '.')
+		{
+			//去掉本段和上一段(连同上一段后面的'/')
+			out = seg;
+			if (out > 0)
+			{
+				out--;
+				while (out > 0 && path[out - 1] != '/')
+					out--;
+			}
+		}
+		else if (slash)
+		{
+			if (out >= size - 1)
+				return false;
+			path[out++] = '/';
+		}
+	}
+	path[out] = '\0';
+	return true;
+}
+
+int doc_tree::open_beneath(int dirfd, const char *path, int flags)
+{
+	if (!m_has_openat2)
+		return open_nofollow(dirfd, path, flags);
+	struct open_how how;
+	memset(&how, 0, sizeof(how));
+	how.flags = flags | O_CLOEXEC;
+	how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+	return syscall(SYS_openat2, dirfd, path, &how, sizeof(how));
+}
+
+int doc_tree::open_nofollow(int dirfd, const char *path, int flags)
+{
+	int fd = dirfd;
+	const char *p = path;
+	while (true)
+	{
+		int len = strcspn(p, "/");
+		bool last = p[len] == '\0';
+		char name[NAME_MAX + 1];
+		int next = -1;
+		if (len > NAME_MAX)
+			errno = ENAMETOOLONG;
+		else if (len == 2 && p[0] == '.' && p[1] == '.')
+			errno = EXDEV;
+		else
+		{
+			memcpy(name, p, len);
+			name[len] = '\0';
+			//中间的段必须是目录;O_NOFOLLOW时符号链接不是目录,打开失败,最后一段是符号链接时返回ELOOP
+			int how = last ? flags : O_PATH | O_DIRECTORY;
+			next = openat(fd, len ? name : ".", how | O_NOFOLLOW | O_CLOEXEC);
+			//但O_PATH | O_NOFOLLOW打开的是符号链接本身
+			struct stat st;
+			if (next >= 0 && (how & O_PATH) && fstat(next, &st) == 0 && S_ISLNK(st.st_mode))
+			{
+				close(next);
+				next = -1;
+				errno = ELOOP;
+			}
+		}
+		if (fd != dirfd)
+		{
+			int saved = errno;
+			close(fd);
+			errno = saved;
+		}
+		if (next < 0 || last)
+			return next;
+		fd = next;
+		p += len + 1;
+	}
+}
+
+int doc_tree::parent(const char *path, const char **name)
+{
+	const char *slash = strrchr(path, '/');
+	if (!slash)
+	{
+		*name = path;
+		return m_root_fd;
+	}
+	*name = slash + 1;
+	if (!m_dirs)
+		m_dirs = new unordered_map<string, dir_entry>;
+	uint64_t now = coarse_ms();
+	string dir(path, slash - path);
+	unordered_map<string, dir_entry>::iterator it = m_dirs->find(dir);
+	if (it != m_dirs->end() && now - it->second.checked_ms < TTL_MS)
+		return it->second.fd;
+	int fd = open_beneath(m_root_fd, dir.c_str(), O_PATH | O_DIRECTORY);
+	if (it != m_dirs->end())
+	{
+		close(it->second.fd);
+		m_dirs->erase(it);
+	}
+	if (fd < 0)
+		return -1;
+	if ((int)m_dirs->size() >= MAX_DIRS)
+	{
+		for (it = m_dirs->begin(); it != m_dirs->end(); ++it)
+			close(it->second.fd);
+		m_dirs->clear();
+	}
+	dir_entry &entry = (*m_dirs)[dir];
+	entry.fd = fd;
+	entry.checked_ms = now;
+	return fd;
+}
+
+int doc_tree::stat(const char *path, struct stat *st)
+{
+	//去掉结尾的'/',之后要求是目录
+	char buf[PATH_MAX];
+	int len = strlen(path);
+	bool want_dir = len > 0 && path[len - 1] == '/';
+	if (want_dir)
+	{
+		if (len > (int)sizeof(buf))
+		{
+			errno = ENAMETOOLONG;
+			return -1;
+		}
+		memcpy(buf, path, len - 1);
+		buf[len - 1] = '\0';
+		path = buf;
+	}
+	const char *name;
+	int dirfd = parent(path, &name);
+	if (dirfd < 0)
+		return -1;
+	if (*name == '\0')
+		return fstat(dirfd, st);
+	if (fstatat(dirfd, name, st, AT_SYMLINK_NOFOLLOW) < 0)
+		return -1;
+	if (S_ISLNK(st->st_mode))
+	{
+		//符号链接可能指向上级目录,从根目录解析
+		int fd = open_beneath(m_root_fd, path, O_PATH);
+		if (fd < 0)
+			return -1;
+		int ret = fstat(fd, st);
+		close(fd);
+		if (ret < 0)
+			return -1;
+	}
+	if (want_dir && !S_ISDIR(st->st_mode))
+	{
+		errno = ENOTDIR;
+		return -1;
+	}
+	return 0;
+}
+
+int doc_tree::open(const char *path, int flags)
+{
+	const char *name;
+	int dirfd = parent(path, &name);
+	if (dirfd < 0)
+		return -1;
+	if (*name == '\0')
+		return open_beneath(dirfd, ".", flags);
+	int fd = open_beneath(dirfd, name, flags);
+	//最后一段是指向所在目录之外的符号链接,从根目录解析
+	if (fd < 0 && errno == EXDEV)
+		fd = open_beneath(m_root_fd, path, flags);
+	return fd;
+}
@@ -0,0 +1,56 @@
+#ifndef DOC_TREE_H_
+#define DOC_TREE_H_
+
+#include <sys/stat.h>
+#include <stdint.h>
+#include <string>
+#include <unordered_map>
+
+using namespace std;
+
+//文档根目录下的路径解析:
+//	URL先规范化为相对于根目录的路径,不含"."和"..",不会超出根目录
+//	每个线程缓存最近用到的目录的O_PATH描述符,stat和open相对于所在目录进行(fstatat/openat2),
+//	内核只需查找最后一段,不必每次从根目录逐段查找
+//	符号链接从根目录以openat2(RESOLVE_BENEATH)解析,指向根目录之外(包括绝对路径)的链接视为不存在
+//	内核不支持openat2(5.6之前)时退回到逐段openat(O_NOFOLLOW),这时拒绝所有符号链接
+class doc_tree
+{
+public:
+	//每个线程缓存的目录数,超过时整体清空
+	static const int MAX_DIRS = 256;
+	//缓存的目录描述符超过TTL_MS后重新打开,目录被替换或移走后最多这么久才能发现
+	static const uint64_t TTL_MS = 1000;
+
+	//打开根目录并探测openat2,启动时调用一次
+	static bool init(const char *root);
+	//在一遍扫描中规范化URL的路径部分:去掉查询和片段,百分号解码,合并连续的'/',去掉"."段,
+	//".."段回退一段(在根目录时忽略);结果不以'/'开头,根目录为"",以'/'结尾时要求是目录
+	//编码的'/'和'\0',非法的编码以及结果超过size时返回false
+	static bool normalize(const char *url, char *path, int size);
+	//与stat相同,path为normalize的结果,成功返回0,失败时设置errno
+	static int stat(const char *path, struct stat *st);
+	//与open相同,flags中不必包含O_CLOEXEC
+	static int open(const char *path, int flags);
+
+private:
+	//返回path所在目录的描述符,name指向最后一段;path不能以'/'结尾
+	static int parent(const char *path, const char **name);
+	//openat2(RESOLVE_BENEATH),不支持时open_nofollow
+	static int open_beneath(int dirfd, const char *path, int flags);
+	//逐段openat,每段都带O_NOFOLLOW,遇到符号链接返回ELOOP,遇到".."返回EXDEV
+	static int open_nofollow(int dirfd, const char *path, int flags);
+
+private:
+	struct dir_entry
+	{
+		int fd;
+		uint64_t checked_ms;
+	};
+	static int m_root_fd;
+	//只在init()中写入,之后只读
+	static bool m_has_openat2;
+	static thread_local unordered_map<string, dir_entry> *m_dirs;
+};
+
+#endif
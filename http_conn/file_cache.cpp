@@ -0,0 +1,130 @@
+#include "file_cache.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "metrics.h"
+#include "doc_tree.h"
+
+size_t file_cache::m_capacity = 256 * 1024 * 1024;
+locker file_cache::m_lock;
+unordered_map<string, mapped_file *> file_cache::m_files;
+list<mapped_file *> file_cache::m_lru;
+size_t file_cache::m_mapped = 0;
+
+bool file_cache::same_file(const mapped_file *file, const struct stat &st)
+{
+	return file->dev == st.st_dev && file->ino == st.st_ino && file->size == st.st_size &&
+		   file->mtime.tv_sec == st.st_mtim.tv_sec && file->mtime.tv_nsec == st.st_mtim.tv_nsec;
+}
+
+void file_cache::destroy(mapped_file *file)
+{
+	munmap(file->addr, file->size);
+	m_mapped -= file->size;
+	delete file;
+}
+
+void file_cache::remove(mapped_file *file)
+{
+	m_files.erase(file->path);
+	m_lru.erase(file->lru);
+	file->stale = true;
+	if (file->refs == 0)
+		destroy(file);
+}
+
+mapped_file *file_cache::acquire(const char *path, const struct stat &st)
+{
+	if (st.st_size <= 0 || (size_t)st.st_size > m_capacity)
+		return NULL;
+	m_lock.lock();
+	unordered_map<string, mapped_file *>::iterator it = m_files.find(path);
+	if (it != m_files.end())
+	{
+		mapped_file *file = it->second;
+		if (same_file(file, st))
+		{
+			file->refs++;
+			m_lru.splice(m_lru.begin(), m_lru, file->lru);
+			m_lock.unlock();
+			return file;
+		}
+		remove(file);
+	}
+
+	//从最久没有使用的开始淘汰,正在使用的跳过
+	list<mapped_file *>::iterator victim = m_lru.end();
+	while (m_mapped + st.st_size > m_capacity && victim != m_lru.begin())
+	{
+		--victim;
+		if ((*victim)->refs > 0)
+			continue;
+		mapped_file *old = *victim;
+		victim = m_lru.erase(victim);
+		m_files.erase(old->path);
+		destroy(old);
+	}
+	if (m_mapped + st.st_size > m_capacity)
+	{
+		m_lock.unlock();
+		return NULL;
+	}
+
+	//在锁内映射,避免多个线程同时映射同一个文件;中等大小的文件mmap本身很快
+	int fd = doc_tree::open(path, O_RDONLY);
+	if (fd < 0)
+	{
+		m_lock.unlock();
+		return NULL;
+	}
+	void *addr = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (addr == MAP_FAILED)
+	{
+		m_lock.unlock();
+		return NULL;
+	}
+	//这些页马上就要发送,让内核提前读入
+	madvise(addr, st.st_size, MADV_WILLNEED);
+	metrics::add(COUNTER_FILE_CACHE_MAPS);
+
+	mapped_file *file = new mapped_file;
+	file->path = path;
+	file->addr = (char *)addr;
+	file->size = st.st_size;
+	file->dev = st.st_dev;
+	file->ino = st.st_ino;
+	file->mtime = st.st_mtim;
+	file->refs = 1;
+	file->stale = false;
+	m_lru.push_front(file);
+	file->lru = m_lru.begin();
+	m_files[file->path] = file;
+	m_mapped += file->size;
+	m_lock.unlock();
+	return file;
+}
+
+void file_cache::release(mapped_file *file)
+{
+	m_lock.lock();
+	if (--file->refs == 0 && file->stale)
+		destroy(file);
+	m_lock.unlock();
+}
+
+size_t file_cache::mapped_bytes()
+{
+	m_lock.lock();
+	size_t bytes = m_mapped;
+	m_lock.unlock();
+	return bytes;
+}
+
+size_t file_cache::entries()
+{
+	m_lock.lock();
+	size_t count = m_files.size();
+	m_lock.unlock();
+	return count;
+}
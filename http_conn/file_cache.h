@@ -0,0 +1,60 @@
+#ifndef FILE_CACHE_H_
+#define FILE_CACHE_H_
+
+#include <sys/stat.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <list>
+#include <string>
+#include <unordered_map>
+#include "locker.h"
+
+using namespace std;
+
+//一个文件的只读映射,被多个请求共享,引用计数为0且被替换或淘汰时才munmap
+struct mapped_file
+{
+	string path;
+	char *addr;
+	off_t size;
+	dev_t dev;
+	ino_t ino;
+	struct timespec mtime;
+	int refs;
+	//文件已经被修改,映射不再留在缓存中,最后一个请求结束时释放
+	bool stale;
+	list<mapped_file *>::iterator lru;
+};
+
+//中等大小文件的映射缓存,所有线程共享:
+//同一个文件只mmap一次,请求之间复用,省去每个请求的mmap/munmap(多线程进程中munmap需要刷新其他CPU的TLB)
+//stat的结果(设备,inode,大小,修改时间)与缓存的不一致时重新映射;映射的总字节数超过m_capacity时淘汰最久没有使用的
+class file_cache
+{
+public:
+	//映射的总字节数上限
+	static size_t m_capacity;
+
+	//返回path(相对于根目录的规范化路径,见doc_tree)的映射,引用计数加一;st为请求中刚取得的文件状态;
+	//失败或者缓存已满(都在使用中)时返回NULL
+	static mapped_file *acquire(const char *path, const struct stat &st);
+	static void release(mapped_file *file);
+	//用于/metrics
+	static size_t mapped_bytes();
+	static size_t entries();
+
+private:
+	static bool same_file(const mapped_file *file, const struct stat &st);
+	//从缓存中移除,没有请求在使用时立即释放
+	static void remove(mapped_file *file);
+	static void destroy(mapped_file *file);
+
+private:
+	static locker m_lock;
+	static unordered_map<string, mapped_file *> m_files;
+	//最近使用的在前面
+	static list<mapped_file *> m_lru;
+	static size_t m_mapped;
+};
+
+#endif
@@ -1,4 +1,22 @@
 #include "http_conn.h"
+#include "dir_list.h"
+#include "proxy.h"
+#include "ws.h"
+#include "sse.h"
+#include "access_log.h"
+#include "metrics.h"
+#include "capture.h"
+#include "co_conn.h"
+#include "shard.h"
+#include "completion.h"
+#include "ready_queue.h"
+#include "file_cache.h"
+#include "cold_io.h"
+#include "neg_cache.h"
+#include "doc_tree.h"
+#include "asset_bundle.h"
+#include "threadpool.h"
+#include <sys/sendfile.h>
 
 //定义HTTP相应的一些状态信息
 const char *ok_200_title = "ok";
@@ -10,9 +28,25 @@ const char *error_404_title = "not found";
 const char *error_404_form = "the requested file was not found on this server.\n";
 const char *error_500_title = "internal error";
 const char *error_500_form = "there was an unuaual problem serving the request file.\n";
+const char *error_502_title = "Bad Gateway";
+const char *error_502_form = "the upstream server is unavailable.\n";
+//每个chunk的帧开销: 最多8位十六进制长度+\r\n+数据后的\r\n
+const int CHUNK_OVERHEAD = 12;
+//结束块"0\r\n\r\n"的长度
+const int CHUNK_TRAILER = 5;
 //网站的根目录
 const char *doc_root = "var/www/html";
 
+//预先生成的404应答,按是否保持连接分为两份
+static string build_404(bool linger)
+{
+	char buf[256];
+	snprintf(buf, sizeof(buf), "HTTP/1.1 404 %s\r\nContent-length: %d\r\nConnection: %s\r\n\r\n%s",
+			 error_404_title, (int)strlen(error_404_form), linger ? "keep-alive" : "close", error_404_form);
+	return buf;
+}
+static const string response_404[2] = {build_404(false), build_404(true)};
+
 int setnonblocking(int fd)
 {
 	int old_option = fcntl(fd, F_GETFL);
@@ -21,6 +55,7 @@ int setnonblocking(int fd)
 	return old_option;
 }
 
+//fd必须已经是非阻塞的(accept4和socket时指定SOCK_NONBLOCK,eventfd指定EFD_NONBLOCK)
 void addfd(int epollfd, int fd, bool enable)
 {
 	epoll_event event;
@@ -29,7 +64,6 @@ void addfd(int epollfd, int fd, bool enable)
 	if (enable)
 		event.events |= EPOLLONESHOT;
 	epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &event);
-	setnonblocking(fd);
 }
 
 void removefd(int epollfd, int fd)
@@ -47,35 +81,79 @@ void modfd(int epollfd, int fd, int ev)
 	epoll_ctl(epollfd, EPOLL_CTL_MOD, fd, &event);
 }
 
-int http_conn::m_user_count = 0;
+//工作线程中经过完成队列交给主线程修改
+void http_conn::rearm(int ev)
+{
+	completion_queue::rearm(m_loop_fd, m_sockfd, ev);
+}
+
+atomic<int> http_conn::m_user_count(0);
+bool http_conn::m_coroutine = false;
+int http_conn::m_write_budget = 256 * 1024;
+int http_conn::m_inline_max = 4096;
+off_t http_conn::m_sendfile_min = 1024 * 1024;
 int http_conn::m_epollfd = -1;
+threadpool<http_conn> *http_conn::m_pool = NULL;
 
 void http_conn::close_conn(bool real_close)
 {
 	if (real_close && (m_sockfd != -1))
 	{
-		removefd(m_epollfd, m_sockfd);
+		release_file();
+		release_stream();
+		if (m_upstream)
+		{
+			upstream_conn *upstream = m_upstream;
+			m_upstream = 0;
+			upstream->abort();
+		}
+		if (m_ws)
+		{
+			delete m_ws;
+			m_ws = 0;
+		}
+		if (m_co)
+		{
+			co_handler::destroy(m_co);
+			m_co = 0;
+		}
+		m_co_start = false;
+		//就绪队列中的项在轮到时发现代数不同而跳过,必须在关闭文件描述符(可能被重用)之前
+		m_generation.fetch_add(1, memory_order_release);
+		if (m_capture_id)
+		{
+			capture::close_conn(m_capture_id, m_responses);
+			m_capture_id = 0;
+		}
+		log_request();
+		metrics::add(COUNTER_CLOSES);
+		//最后才关闭文件描述符,工作线程关闭连接时主线程可能立即accept到同一个fd并重新初始化本对象
+		int sockfd = m_sockfd;
 		m_sockfd = -1;
 		m_user_count--; //关闭一个连接时,将客户总量减一
+		removefd(m_loop_fd, sockfd);
 	}
 }
 
-void http_conn::init(int sockfd, const sockaddr_in &addr)
+void http_conn::init(int sockfd, const sockaddr_storage &addr, int epollfd)
 {
 	m_sockfd = sockfd;
+	m_loop_fd = epollfd;
+	m_ready = false;
+	m_deferred = false;
 	m_address = addr;
 	m_user_count++;
+	addfd(m_loop_fd, sockfd, true);
 
-	//以下部分为了避免TIME_WAIT状态,仅为了调试,实际使用中应该去掉
-	int reuse = 1;
-	setsockopt(m_sockfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
-	addfd(m_epollfd, sockfd, true);
-	//
-
+	m_capture_id = capture::open_conn();
+	m_responses = 0;
+	m_co = 0;
+	m_co_start = m_coroutine;
 	init();
+	TRACE_MARK(m_trace, TP_ACCEPT);
 }
 
-void http_conn::init()
+void http_conn::init(int pending)
 {
 	m_check_state = CHECK_STATE_REQUESTLINE;
 	m_linger = false;
@@ -86,11 +164,83 @@ void http_conn::init()
 	m_host = 0;
 	m_check_index = 0;
 	m_start_line = 0;
-	m_read_index = 0;
+	m_read_index = pending;
 	m_write_index = 0;
-	memset(m_read_buf, '\0', READ_BUF_SIZE);
+	m_bytes_to_send = 0;
+	m_iv_count = 0;
+	m_file_tier = TIER_INLINE;
+	m_mapped = 0;
+	m_bundle = 0;
+	m_bundle_entry = 0;
+	m_body_addr = 0;
+	m_file_fd = -1;
+	m_file_offset = 0;
+	m_warm_end = 0;
+	m_cold_wait = false;
+	m_cold_failed = false;
+	m_producer = 0;
+	m_stream_buf = 0;
+	m_stream_len = 0;
+	m_stream_sent = 0;
+	m_stream_done = false;
+	m_headers_begin = 0;
+	m_body_begin = 0;
+	m_proxy_pool = 0;
+	m_upstream = 0;
+	m_accept_gzip = false;
+	m_if_none_match = 0;
+	m_last_event_id = 0;
+	m_ws_upgrade = false;
+	m_ws_key = 0;
+	m_ws = 0;
+	m_req_start = 0;
+	m_queued = 0;
+	m_do_request_start = 0;
+	m_handle_us = 0;
+	m_status = 0;
+	m_bytes_sent = 0;
+	TRACE_RESET(m_trace);
+	//保留的数据已经读入,下一个请求从现在开始计时
+	if (pending > 0)
+		m_req_start = m_queued = metrics::now();
+	memset(m_read_buf + pending, '\0', READ_BUF_SIZE - pending);
 	memset(m_write_buf, '\0', WRITE_BUF_SIZE);
-	memset(m_real_file, '\0', MAXFILENAME_LEN);
+	memset(m_path, '\0', MAXFILENAME_LEN);
+}
+
+int http_conn::next_request()
+{
+	//请求之后的数据从请求头部(或消息体)结束处开始
+	int begin = m_check_index + ((m_check_state == CHECK_STATE_CONTENT) ? m_content_length : 0);
+	int pending = (m_read_index > begin) ? m_read_index - begin : 0;
+	if (pending > 0)
+		memmove(m_read_buf, m_read_buf + begin, pending);
+	init(pending);
+	return pending;
+}
+
+void http_conn::serve_next()
+{
+	//先重置再注册事件,注册之后主线程可能立即读取
+	//流水线发来的请求已经从socket读出,不会再有EPOLLIN,不能等事件
+	if (next_request() == 0)
+		rearm(EPOLLIN);
+	else if (!ready_queue::active())
+		process();
+	else
+		defer_request();
+}
+
+void http_conn::defer_request()
+{
+	//交给线程池之后本线程不能再访问本对象
+	if (m_pool && m_pool->append(this))
+		return;
+	m_deferred = true;
+	if (m_ready)
+		return;
+	ready_queue::push(this);
+	m_ready = true;
 }
 
 //从状态机
@@ -117,7 +267,7 @@ http_conn::LINE_STATUS http_conn::parse_line()
 		{
 			if (m_check_index > 1 && (m_read_buf[m_check_index - 1] == '\r'))
 			{
-				m_read_buf[m_check_index - 1] == '\0';
+				m_read_buf[m_check_index - 1] = '\0';
 				m_read_buf[m_check_index++] = '\0';
 				return LINE_OK;
 			}
@@ -130,11 +280,13 @@ http_conn::LINE_STATUS http_conn::parse_line()
 //循环读取客户数据,直到无数据可读或者对方关闭连接
 bool http_conn::read()
 {
-	//读缓冲区已满
-	if (m_read_index > READ_BUF_SIZE)
+	uint64_t begin = metrics::now();
+	//读缓冲区已满,其中还没有一个完整的请求
+	if (m_read_index >= READ_BUF_SIZE)
 		return false;
 	int bytes_read = 0;
-	while (true)
+	//缓冲区满时先处理已读入的请求(流水线),剩下的数据留在socket中,处理完后再读
+	for (int calls = 0; calls < READ_BUDGET_CALLS && m_read_index < READ_BUF_SIZE; calls++)
 	{
 		//每次读取读缓冲区剩余字节数量
 		bytes_read = recv(m_sockfd, m_read_buf + m_read_index, READ_BUF_SIZE - m_read_index, 0);
@@ -146,15 +298,23 @@ bool http_conn::read()
 		}
 		else if (bytes_read == 0)
 			return false;
+		if (m_req_start == 0)
+			m_req_start = begin;
+		TRACE_MARK(m_trace, TP_READ);
+		if (m_capture_id && !capture::data(m_capture_id, m_responses, m_read_buf + m_read_index, bytes_read))
+			m_capture_id = 0;
 		m_read_index += bytes_read;
 	}
+	TRACE_MARK(m_trace, TP_ENQUEUE);
+	m_queued = metrics::now();
+	metrics::record(STAGE_READ, m_queued - begin);
 	return true;
 }
 
 //解析HTTP请求行,获得请求方法,目标URL,以及HTTP版本号
 http_conn::HTTP_CODE http_conn::parse_request_line(char *text)
 {
-	m_url = strpbrk(text, "\t");
+	m_url = strpbrk(text, " \t");
 	if (!m_url)
 		return BAD_REQUEST;
 	*m_url++ = '\0';
@@ -165,12 +325,12 @@ http_conn::HTTP_CODE http_conn::parse_request_line(char *text)
 	else
 		return BAD_REQUEST;
 	
-	m_url += strspn(m_url, "\t");
-	m_version += strspn(m_url, "\t");
+	m_url += strspn(m_url, " \t");
+	m_version = strpbrk(m_url, " \t");
 	if (!m_version)
 		return BAD_REQUEST;
-	*m_version += '\0';
-	m_version += strspn(m_version, "\t");
+	*m_version++ = '\0';
+	m_version += strspn(m_version, " \t");
 	if (strcasecmp(m_version, "HTTP/1.1") != 0)
 		return BAD_REQUEST;
 	if (strncasecmp(m_url, "http://", 7) == 0)
@@ -205,7 +365,7 @@ http_conn::HTTP_CODE http_conn::parse_headers(char *text)
 	else if (strncasecmp(text, "Connection:", 11) == 0)
 	{
 		text += 11;
-		text += strspn(text, "\t");
+		text += strspn(text, " \t");
 	
 		if (strcasecmp(text, "keep-alive") == 0) 
 			m_linger = true;
@@ -215,29 +375,59 @@ http_conn::HTTP_CODE http_conn::parse_headers(char *text)
 	else if (strncasecmp(text, "Content-Length:", 15) == 0) 
 	{
 		text += 15;
-		text += strspn(text, "\t");
+		text += strspn(text, " \t");
 		m_content_length = atol(text);
 	}
 	//处理HOST头部字段
 	else if (strncasecmp(text, "Host:", 5) == 0)
 	{
 		text += 5;
-		text += strspn(text, "\t");
+		text += strspn(text, " \t");
 		m_host = text;
 	}
-	else
-		cout << "oop unknow host:" << text << endl;
+	//处理WebSocket握手的头部字段
+	else if (strncasecmp(text, "Upgrade:", 8) == 0)
+	{
+		text += 8;
+		text += strspn(text, " \t");
+		if (strcasecmp(text, "websocket") == 0)
+			m_ws_upgrade = true;
+	}
+	else if (strncasecmp(text, "Sec-WebSocket-Key:", 18) == 0)
+	{
+		text += 18;
+		text += strspn(text, " \t");
+		m_ws_key = text;
+	}
+	//只需要知道是否接受gzip,"gzip;q=0"表示不接受
+	else if (strncasecmp(text, "Accept-Encoding:", 16) == 0)
+	{
+		text += 16;
+		const char *gzip = strcasestr(text, "gzip");
+		m_accept_gzip = gzip && (strncmp(gzip + 4, ";q=", 3) != 0 || atof(gzip + 7) > 0);
+	}
+	else if (strncasecmp(text, "If-None-Match:", 14) == 0)
+	{
+		text += 14;
+		text += strspn(text, " \t");
+		m_if_none_match = text;
+	}
+	else if (strncasecmp(text, "Last-Event-ID:", 14) == 0)
+	{
+		text += 14;
+		text += strspn(text, " \t");
+		m_last_event_id = strtoull(text, NULL, 10);
+	}
+	//其他头部字段忽略
 	return NO_REQUEST;
 }
 
 //我们没有真正解析HTTP请求的消息体,只是判断他是否被完整的读入了
-http_conn::HTTP_CODE http_conn::parse_content(char *text)
+http_conn::HTTP_CODE http_conn::parse_content()
 {
+	//消息体按长度使用,不写入结尾的'\0',之后可能是流水线发来的下一个请求
 	if (m_read_index >= (m_check_index + m_content_length))
-	{
-		text[m_content_length] = '\0';
 		return GET_REQUEST;
-	}
 	return NO_REQUEST;
 }
 
@@ -256,8 +446,7 @@ http_conn::HTTP_CODE http_conn::process_read()
 		//text指向读缓冲区该解析的位置
 		text = get_line();
 		//m_check_index在从状态机已经更新到行尾
-		m_start_line == m_check_index;
-		cout << "get 1 http line:" << text << endl;
+		m_start_line = m_check_index;
 
 		switch (m_check_state)
 		{
@@ -266,11 +455,13 @@ http_conn::HTTP_CODE http_conn::process_read()
 				ret = parse_request_line(text);
 				if (ret == BAD_REQUEST)
 					return BAD_REQUEST;
+				m_headers_begin = m_start_line;
 				break;
 			}
 			case CHECK_STATE_HEADER:
 			{
 				ret = parse_headers(text);
+				m_body_begin = m_start_line;
 				if (ret == BAD_REQUEST)
 					return BAD_REQUEST;
 				else if (ret == GET_REQUEST)
@@ -279,7 +470,7 @@ http_conn::HTTP_CODE http_conn::process_read()
 			}
 			case CHECK_STATE_CONTENT:
 			{
-				ret = parse_content(text);
+				ret = parse_content();
 				if (ret == GET_REQUEST)
 					return do_request();
 				line_status = LINE_OPEN;
@@ -294,85 +485,548 @@ http_conn::HTTP_CODE http_conn::process_read()
 }
 
 //当得到一个完整的,正确HTPP请求时,我们就分析目标文件的属性,如果目标文件存在,对所有用户可读
-//且不是目录,则使用mmap将其映射到内存地址m_file_address处,并告诉调用者获取文件成功
+//且不是目录,则按文件大小选择发送方式(open_file),并告诉调用者获取文件成功
 http_conn::HTTP_CODE http_conn::do_request()
 {
-	strcpy(m_real_file, doc_root);
-	int len = strlen(doc_root);
-	strncpy(m_real_file, m_url, MAXFILENAME_LEN - len - 1);
-	if (stat(m_real_file, &m_file_stat) < 0)
+	m_do_request_start = metrics::now();
+	TRACE_MARK(m_trace, TP_PARSED);
+	//WebSocket和事件流需要在线程之间广播,每核一个线程时不支持
+	if (m_ws_upgrade)
+		return (m_ws_key && !shard::enabled()) ? WS_UPGRADE : BAD_REQUEST;
+	if (!shard::enabled() && sse_hub::match(m_url))
+		return EVENT_STREAM;
+	if (strcmp(m_url, "/metrics") == 0)
+		return METRICS_REQUEST;
+
+	//匹配反向代理路由的请求转发给后端
+	m_proxy_pool = proxy_match(m_url);
+	if (m_proxy_pool)
+		return PROXY_REQUEST;
+
+	//规范化之后不含"."和"..",同一个文件只有一种写法,既是各个缓存的键,也用于相对于根目录的查找
+	if (!doc_tree::normalize(m_url, m_path, MAXFILENAME_LEN))
+		return BAD_REQUEST;
+
+	//打包的文件直接从包文件应答,不访问文件系统
+	if (asset_bundle::enabled())
+	{
+		m_bundle_entry = asset_bundle::acquire(m_path, &m_bundle);
+		if (m_bundle_entry)
+		{
+			metrics::add(COUNTER_BUNDLE_HITS);
+			return BUNDLE_REQUEST;
+		}
+	}
+
+	//最近确认不存在的路径不再查找
+	uint64_t neg_tag = 0;
+	if (neg_cache::enabled() && neg_cache::lookup(m_path, &neg_tag))
+	{
+		metrics::add(COUNTER_NEG_HITS);
+		return NO_RESOURCE;
+	}
+
+	stat_cache *cache = shard::cache();
+	if ((cache ? cache->lookup(m_path, &m_file_stat) : doc_tree::stat(m_path, &m_file_stat)) < 0)
+	{
+		//权限等其他错误以及指向根目录之外的符号链接(EXDEV)不缓存
+		if (neg_tag && (errno == ENOENT || errno == ENOTDIR))
+			neg_cache::insert(m_path, neg_tag);
 		return NO_RESOURCE;
+	}
 
 	if (!(m_file_stat.st_mode & S_IROTH))
 		return FORBIDDEN_REQUEST;
 
+	//目录的内容长度未知,以流式应答返回目录列表
 	if (S_ISDIR(m_file_stat.st_mode))
-		return BAD_REQUEST;
+		return STREAM_REQUEST;
 
-	int fd = open(m_real_file, O_RDONLY);
-	m_file_address = (char *)mmap(0, m_file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-	close(fd);
+	return open_file();
+}
+
+http_conn::HTTP_CODE http_conn::open_file()
+{
+	off_t size = m_file_stat.st_size;
+	if (size == 0)
+		return FILE_REQUEST;
+	if (size <= m_inline_max && size <= INLINE_FILE_MAX)
+		m_file_tier = TIER_INLINE;
+	else
+	{
+		m_file_tier = TIER_SENDFILE;
+		if (size < m_sendfile_min)
+		{
+			m_mapped = file_cache::acquire(m_path, m_file_stat);
+			if (m_mapped)
+			{
+				m_file_tier = TIER_MAPPED;
+				return FILE_REQUEST;
+			}
+			//映射缓存已满(都在使用中)时用sendfile发送
+		}
+	}
+
+	m_file_fd = doc_tree::open(m_path, O_RDONLY);
+	if (m_file_fd < 0)
+		return NO_RESOURCE;
+	if (m_file_tier == TIER_SENDFILE)
+	{
+		//大文件从头到尾读一遍,加大预读窗口,并提前读入开头的一段
+		posix_fadvise(m_file_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+		posix_fadvise(m_file_fd, 0, (size < SENDFILE_READAHEAD) ? size : SENDFILE_READAHEAD, POSIX_FADV_WILLNEED);
+	}
 	return FILE_REQUEST;
 }
 
-//对内存映射区域执行munmap操作
-void http_conn::unmap()
+void http_conn::release_file()
 {
-	if (m_file_address)
+	if (m_mapped)
 	{
-		munmap(m_file_address, m_file_stat.st_size);
-		m_file_address = 0;
+		file_cache::release(m_mapped);
+		m_mapped = 0;
+	}
+	if (m_bundle)
+	{
+		asset_bundle::release(m_bundle);
+		m_bundle = 0;
+		m_bundle_entry = 0;
+	}
+	if (m_file_fd >= 0)
+	{
+		close(m_file_fd);
+		m_file_fd = -1;
+	}
+}
+
+//writev可能只发送了部分数据,将已发送的部分从m_iv中去掉
+void http_conn::consume_iv(int bytes)
+{
+	for (int i = 0; i < m_iv_count && bytes > 0; i++)
+	{
+		int n = (bytes < (int)m_iv[i].iov_len) ? bytes : (int)m_iv[i].iov_len;
+		m_iv[i].iov_base = (char *)m_iv[i].iov_base + n;
+		m_iv[i].iov_len -= n;
+		bytes -= n;
 	}
 }
 
 //写HTTP相应
 bool http_conn::write()
 {
+	metrics_timer timer(STAGE_WRITE);
+	if (m_producer)
+		return write_stream();
+	if (m_upstream)
+	{
+		//应答由后端连接转发,转发结束时由它处理客户连接
+		m_upstream->client_writable();
+		return true;
+	}
+	if (m_ws && m_ws->is_open())
+		return m_ws->on_writable();
+	//I/O线程读完文件后重新注册的EPOLLOUT
+	m_cold_wait = false;
+	if (m_cold_failed)
+	{
+		release_file();
+		return false;
+	}
+
 	int temp = 0;
-	int bytes_have_send = 0;
-	int bytes_to_send = m_write_index;
-	if (bytes_to_send == 0)
+	if (m_bytes_to_send == 0)
 	{
-		modfd(m_epollfd, m_sockfd, EPOLLIN);
+		//先重置再注册事件,注册之后主线程可能立即读取
 		init();
+		rearm(EPOLLIN);
 		return true;
 	}
 
+	int sent = 0;
 	while (1)
 	{
-		temp = writev(m_sockfd, m_iv, m_iv_count);
+		if (m_write_budget > 0 && sent >= m_write_budget)
+		{
+			yield_write();
+			return true;
+		}
+		if (cold_pending())
+			return true;
+		temp = send_response(m_write_budget > 0 ? m_write_budget - sent : 0);
 		if (temp <= -1)
 		{
 			//如果TCP写缓冲没有空间,则等待下一轮EPOLLOUT时间,虽然在此期间,
 			//服务器无法立即接受到同一客户的下一个请求,但这可以保证连接的完整性
 			if (errno == EAGAIN)
 			{
-				modfd(m_epollfd, m_sockfd, EPOLLOUT);
+				rearm(EPOLLOUT);
 				return true;
 			}
-			unmap();
+			release_file();
 			return false;
 		}
 
-		bytes_to_send -= temp;
-		bytes_have_send += temp;
-		if (bytes_to_send < bytes_have_send)
+		sent += temp;
+		if (m_bytes_to_send <= 0)
 		{
 			//发送HTTP响应成功,根据HTTP请求中的Connection字段决定是否立即关闭连接
-			unmap();
-			if (m_linger)
+			release_file();
+			log_request();
+			if (m_ws)
 			{
+				//握手应答发送完毕,之后按WebSocket协议在主线程中收发
+				ws_session *ws = m_ws;
 				init();
-				modfd(m_epollfd, m_sockfd, EPOLLIN);
+				m_ws = ws;
+				m_ws->open();
+				rearm(EPOLLIN);
 				return true;
 			}
-			else
+			if (m_linger)
 			{
-				modfd(m_epollfd, m_sockfd, EPOLLIN);
-				return false;
+				serve_next();
+				return true;
+			}
+			//由调用者关闭连接,不能再注册事件,否则在工作线程中发送时主线程可能同时关闭该连接
+			return false;
+		}
+	}
+}
+
+int http_conn::writev_budget(int budget)
+{
+	if (budget <= 0)
+		return writev(m_sockfd, m_iv, m_iv_count);
+	struct iovec iv[2];
+	int count = 0;
+	for (int i = 0; i < m_iv_count && budget > 0; i++)
+	{
+		int len = ((int)m_iv[i].iov_len < budget) ? (int)m_iv[i].iov_len : budget;
+		iv[count].iov_base = m_iv[i].iov_base;
+		iv[count].iov_len = len;
+		budget -= len;
+		count++;
+	}
+	return writev(m_sockfd, iv, count);
+}
+
+bool http_conn::read_inline()
+{
+	int size = m_file_stat.st_size;
+	int n = pread(m_file_fd, m_write_buf + m_write_index, size, 0);
+	close(m_file_fd);
+	m_file_fd = -1;
+	if (n != size)
+		return false;
+	m_iv[0].iov_len = m_write_index + size;
+	return true;
+}
+
+bool http_conn::cold_pending()
+{
+	if (!cold_io::enabled())
+		return false;
+	off_t pos, left;
+	const char *addr = NULL;
+	if ((m_file_tier == TIER_MAPPED || m_file_tier == TIER_BUNDLE) && m_body_addr && m_iv_count == 2)
+	{
+		addr = (const char *)m_iv[1].iov_base;
+		pos = addr - m_body_addr;
+		left = m_iv[1].iov_len;
+	}
+	else if (m_file_fd >= 0)
+	{
+		pos = (m_file_tier == TIER_SENDFILE) ? m_file_offset : 0;
+		left = m_file_stat.st_size - pos;
+	}
+	else
+		return false;
+	if (pos < m_warm_end || left <= 0)
+		return false;
+	size_t len = (left < (off_t)cold_io::WINDOW) ? left : cold_io::WINDOW;
+	bool warm = addr ? cold_io::resident(addr, len) : cold_io::resident(m_file_fd, pos, len);
+	if (!warm)
+	{
+		//先设置m_cold_wait,提交之后I/O线程可能立即完成并由事件循环继续发送
+		m_cold_wait = true;
+		if (cold_io::submit(this, addr ? -1 : m_file_fd, addr, pos, len))
+			return true;
+		//队列已满,在当前线程中阻塞读取
+		m_cold_wait = false;
+	}
+	m_warm_end = pos + len;
+	return false;
+}
+
+void http_conn::cold_read_done(bool ok, off_t end)
+{
+	if (ok)
+		m_warm_end = end;
+	else
+		m_cold_failed = true;
+	rearm(EPOLLOUT);
+}
+
+int http_conn::send_response(int budget)
+{
+	int n;
+	if (m_file_tier == TIER_INLINE && m_file_fd >= 0 && !read_inline())
+	{
+		errno = EIO;
+		return -1;
+	}
+	if (m_file_fd < 0)
+		n = writev_budget(budget);
+	else if (m_iv[0].iov_len > 0)
+	{
+		//MSG_MORE使应答头部与文件的第一段合并成一个报文
+		size_t len = m_iv[0].iov_len;
+		if (budget > 0 && (int)len > budget)
+			len = budget;
+		n = send(m_sockfd, m_iv[0].iov_base, len, MSG_MORE);
+	}
+	else
+	{
+		long long count = (m_bytes_to_send < SENDFILE_CHUNK) ? m_bytes_to_send : SENDFILE_CHUNK;
+		if (budget > 0 && count > budget)
+			count = budget;
+		n = sendfile(m_sockfd, m_file_fd, &m_file_offset, count);
+		//文件在发送过程中被截短
+		if (n == 0)
+		{
+			errno = EIO;
+			return -1;
+		}
+		if (n > 0)
+		{
+			m_bytes_to_send -= n;
+			add_bytes_sent(n);
+		}
+		return n;
+	}
+	if (n > 0)
+	{
+		m_bytes_to_send -= n;
+		add_bytes_sent(n);
+		consume_iv(n);
+	}
+	return n;
+}
+
+void http_conn::yield_write()
+{
+	metrics::add(COUNTER_WRITE_YIELDS);
+	//工作线程中重新注册EPOLLOUT,socket仍然可写,事件循环下一轮就会收到;工作线程不访问m_ready
+	if (!ready_queue::active())
+	{
+		rearm(EPOLLOUT);
+		return;
+	}
+	if (m_ready)
+		return;
+	ready_queue::push(this);
+	m_ready = true;
+}
+
+void http_conn::resume_write()
+{
+	if (!m_ready)
+		return;
+	m_ready = false;
+	if (m_deferred)
+	{
+		m_deferred = false;
+		if (m_pool)
+			defer_request();
+		else
+			process();
+		return;
+	}
+	if (!write())
+		close_conn();
+}
+
+//发送流式应答:先发送m_write_buf中的应答头,再发送m_stream_buf中chunk编码的数据
+//只有缓冲区有空间时才回调生产者,客户端消费得慢时生产者随之变慢,内存占用不超过STREAM_BUF_SIZE
+bool http_conn::write_stream()
+{
+	int sent = 0;
+	while (1)
+	{
+		if (m_write_budget > 0 && sent >= m_write_budget)
+		{
+			yield_write();
+			return true;
+		}
+		if (!m_stream_done && chunk_room() > 0)
+		{
+			//已发送的数据不再需要,将剩余数据移到缓冲区头部
+			if (m_stream_sent > 0)
+			{
+				memmove(m_stream_buf, m_stream_buf + m_stream_sent, m_stream_len - m_stream_sent);
+				m_stream_len -= m_stream_sent;
+				m_stream_sent = 0;
 			}
+			if (m_producer->produce(this))
+				end_stream();
 		}
+
+		m_iv_count = 0;
+		if (m_bytes_to_send > 0)
+		{
+			m_iv[m_iv_count].iov_base = m_write_buf + m_write_index - m_bytes_to_send;
+			m_iv[m_iv_count].iov_len = m_bytes_to_send;
+			m_iv_count++;
+		}
+		if (m_stream_len > m_stream_sent)
+		{
+			m_iv[m_iv_count].iov_base = m_stream_buf + m_stream_sent;
+			m_iv[m_iv_count].iov_len = m_stream_len - m_stream_sent;
+			m_iv_count++;
+		}
+
+		if (m_iv_count == 0)
+		{
+			if (!m_stream_done)
+			{
+				//生产者暂时没有数据,等待其调用wake_stream(),等待期间不占用缓冲区
+				if (m_stream_buf)
+				{
+					delete[] m_stream_buf;
+					m_stream_buf = 0;
+					m_stream_len = 0;
+					m_stream_sent = 0;
+				}
+				return true;
+			}
+			//流式应答发送完毕
+			release_stream();
+			log_request();
+			if (m_linger)
+			{
+				serve_next();
+				return true;
+			}
+			//由调用者关闭连接,与write()相同,不能再注册事件
+			return false;
+		}
+
+		int temp = writev_budget(m_write_budget > 0 ? m_write_budget - sent : 0);
+		if (temp <= -1)
+		{
+			if (errno == EAGAIN)
+			{
+				rearm(EPOLLOUT);
+				return true;
+			}
+			release_stream();
+			return false;
+		}
+		sent += temp;
+		add_bytes_sent(temp);
+		int header = (temp < m_bytes_to_send) ? temp : m_bytes_to_send;
+		m_bytes_to_send -= header;
+		m_stream_sent += temp - header;
+	}
+}
+
+bool http_conn::begin_stream(int status, const char *title, const char *content_type, stream_producer *producer)
+{
+	//数据块分多次写出,关闭Nagle算法,否则最后的小块要等客户的延迟确认(约40毫秒)才能发出
+	int nodelay = 1;
+	if (m_address.ss_family == AF_INET)
+		setsockopt(m_sockfd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+	//缓冲区在第一次写入数据时才分配
+	m_stream_buf = 0;
+	m_stream_len = 0;
+	m_stream_sent = 0;
+	m_stream_done = false;
+	m_producer = producer;
+
+	if (!add_status(status, title))
+		return false;
+	if (!add_response("Content-Type: %s\r\n", content_type))
+		return false;
+	if (!add_response("Transfer-Encoding: chunked\r\n"))
+		return false;
+	if (!add_linger())
+		return false;
+	if (!add_blank_line())
+		return false;
+	m_bytes_to_send = m_write_index;
+	return true;
+}
+
+int http_conn::chunk_room() const
+{
+	int room = STREAM_BUF_SIZE - (m_stream_len - m_stream_sent) - CHUNK_OVERHEAD - CHUNK_TRAILER;
+	return (room > 0) ? room : 0;
+}
+
+bool http_conn::push_chunk(const char *data, int len)
+{
+	if (m_stream_done)
+		return false;
+	//长度为0的chunk表示结束,不能用于普通数据
+	if (len <= 0)
+		return true;
+	if (len > chunk_room())
+		return false;
+	if (!m_stream_buf)
+		m_stream_buf = new char[STREAM_BUF_SIZE];
+	if (m_stream_sent > 0 && STREAM_BUF_SIZE - m_stream_len < len + CHUNK_OVERHEAD + CHUNK_TRAILER)
+	{
+		memmove(m_stream_buf, m_stream_buf + m_stream_sent, m_stream_len - m_stream_sent);
+		m_stream_len -= m_stream_sent;
+		m_stream_sent = 0;
 	}
+	m_stream_len += sprintf(m_stream_buf + m_stream_len, "%x\r\n", len);
+	memcpy(m_stream_buf + m_stream_len, data, len);
+	m_stream_len += len;
+	m_stream_buf[m_stream_len++] = '\r';
+	m_stream_buf[m_stream_len++] = '\n';
+	return true;
+}
+
+bool http_conn::end_stream()
+{
+	if (m_stream_done)
+		return true;
+	//chunk_room()始终为结束块预留了空间
+	if (!m_stream_buf)
+		m_stream_buf = new char[STREAM_BUF_SIZE];
+	memcpy(m_stream_buf + m_stream_len, "0\r\n\r\n", CHUNK_TRAILER);
+	m_stream_len += CHUNK_TRAILER;
+	m_stream_done = true;
+	return true;
+}
+
+void http_conn::wake_stream()
+{
+	rearm(EPOLLOUT);
+}
+
+void http_conn::park_stream()
+{
+	//只监听对方关闭连接,不监听读写事件
+	rearm(0);
+}
+
+void http_conn::release_stream()
+{
+	if (m_producer)
+	{
+		delete m_producer;
+		m_producer = 0;
+	}
+	if (m_stream_buf)
+	{
+		delete[] m_stream_buf;
+		m_stream_buf = 0;
+	}
+	m_stream_len = 0;
+	m_stream_sent = 0;
+	m_stream_done = false;
 }
 
 //往写缓冲区中写入待发送的数据
@@ -392,10 +1046,11 @@ bool http_conn::add_response(const char *format, ...)
 
 bool http_conn::add_status(int status, const char *title)
 {
+	m_status = status;
 	return add_response("%s %d %s\r\n", "HTTP/1.1", status, title);
 }
 
-bool http_conn::add_headers(int content_len)
+bool http_conn::add_headers(off_t content_len)
 {
 	add_content_length(content_len);
 	add_linger();
@@ -403,14 +1058,14 @@ bool http_conn::add_headers(int content_len)
 	return true;
 }
 
-bool http_conn::add_content_length(int content_len)
+bool http_conn::add_content_length(off_t content_len)
 {
-	return add_response("Content-length: %d\r\n", content_len);
+	return add_response("Content-length: %lld\r\n", (long long)content_len);
 }
 
 bool http_conn::add_linger()
 {
-	return add_response("connection :%s\r\n", (m_linger == true) ? "keep-alive" : "close");
+	return add_response("Connection: %s\r\n", (m_linger == true) ? "keep-alive" : "close");
 }
 
 bool http_conn::add_blank_line()
@@ -428,6 +1083,25 @@ bool http_conn::process_write(HTTP_CODE ret)
 {
 	switch (ret)
 	{
+		case WS_UPGRADE:
+		{
+			char accept[32];
+			ws_accept_key(m_ws_key, accept);
+			//URL为/ws/<topic>时自动订阅该主题
+			m_ws = new ws_session(this, (strncmp(m_url, "/ws/", 4) == 0) ? m_url + 4 : "");
+			add_status(101, "Switching Protocols");
+			if (!add_response("Upgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Accept: %s\r\n\r\n", accept))
+				return false;
+			break;
+		}
+		case BAD_GATEWAY:
+		{
+			add_status(502, error_502_title);
+			add_headers(strlen(error_502_form));
+			if (!add_content(error_502_form))
+				return false;
+			break;
+		}
 		case INTERNAL_ERROR:
 		{
 			add_status(500, error_500_title);
@@ -446,10 +1120,13 @@ bool http_conn::process_write(HTTP_CODE ret)
 		}
 		case NO_RESOURCE:
 		{
-			add_status(404, error_404_title);
-			add_headers(strlen(error_404_form));
-			if (!add_content(error_404_form))
+			//与add_status,add_headers和add_content的结果相同,扫描大量不存在的路径时不必逐个格式化
+			const string &response = response_404[m_linger ? 1 : 0];
+			if (m_write_index + (int)response.size() > WRITE_BUF_SIZE)
 				return false;
+			m_status = 404;
+			memcpy(m_write_buf + m_write_index, response.data(), response.size());
+			m_write_index += response.size();
 			break;
 		}
 		case FORBIDDEN_REQUEST:
@@ -468,9 +1145,26 @@ bool http_conn::process_write(HTTP_CODE ret)
 				add_headers(m_file_stat.st_size);
 				m_iv[0].iov_base = m_write_buf;
 				m_iv[0].iov_len = m_write_index;
-				m_iv[1].iov_base = m_file_address;
-				m_iv[1].iov_len = m_file_stat.st_size;
-				m_iv_count = 2;
+				m_iv_count = 1;
+				m_bytes_to_send = m_write_index + m_file_stat.st_size;
+				if (m_file_tier == TIER_INLINE)
+				{
+					//文件内容紧跟在应答头部之后,整个应答一次发送,由read_inline()在发送前读入
+					metrics::add(COUNTER_TIER_INLINE);
+				}
+				else if (m_file_tier == TIER_MAPPED)
+				{
+					metrics::add(COUNTER_TIER_MAPPED);
+					m_body_addr = m_mapped->addr;
+					m_iv[1].iov_base = m_mapped->addr;
+					m_iv[1].iov_len = m_file_stat.st_size;
+					m_iv_count = 2;
+				}
+				else
+				{
+					metrics::add(COUNTER_TIER_SENDFILE);
+					m_file_offset = 0;
+				}
 				return true;
 			}
 			else
@@ -480,30 +1174,238 @@ bool http_conn::process_write(HTTP_CODE ret)
 				if (!add_content(okstring))
 					return false;
 			}
+			break;
+		}
+		case BUNDLE_REQUEST:
+		{
+			const bundle_entry *e = m_bundle_entry;
+			//内容没有变化,只返回304
+			if (m_if_none_match && (strcmp(m_if_none_match, "*") == 0 || strstr(m_if_none_match, e->etag)))
+			{
+				m_status = 304;
+				if (!add_response("HTTP/1.1 304 Not Modified\r\nETag: %s\r\n", e->etag) || !add_linger() || !add_blank_line())
+					return false;
+				release_file();
+				break;
+			}
+			const bundle_variant &v = (m_accept_gzip && e->has_gzip) ? e->gzip : e->plain;
+			//预先生成的状态行和头部字段,只补上Connection和空行
+			if (m_write_index + (int)v.headers_len >= WRITE_BUF_SIZE)
+				return false;
+			const char *base = m_bundle->addr;
+			memcpy(m_write_buf + m_write_index, base + v.headers_offset, v.headers_len);
+			m_write_index += v.headers_len;
+			m_status = 200;
+			if (!add_linger() || !add_blank_line())
+				return false;
+			m_file_tier = TIER_BUNDLE;
+			m_body_addr = base + v.body_offset;
+			m_iv[0].iov_base = m_write_buf;
+			m_iv[0].iov_len = m_write_index;
+			m_iv[1].iov_base = (void *)m_body_addr;
+			m_iv[1].iov_len = v.body_len;
+			m_iv_count = v.body_len ? 2 : 1;
+			m_bytes_to_send = m_write_index + v.body_len;
+			return true;
+		}
+		case STREAM_REQUEST:
+		{
+			stream_producer *producer = dir_list_producer::create(m_path);
+			if (!producer)
+				return false;
+			//begin_stream失败时producer已归连接所有,由close_conn释放
+			return begin_stream(200, ok_200_title, "text/html", producer);
+		}
+		case EVENT_STREAM:
+		{
+			stream_producer *producer = sse_hub::subscribe(m_url, m_last_event_id);
+			if (!producer)
+				return false;
+			return begin_stream(200, ok_200_title, "text/event-stream", producer);
 		}
+		case METRICS_REQUEST:
+			return begin_stream(200, ok_200_title, "text/plain; version=0.0.4", new metrics_producer);
 		default:
 			return false;
 	}
 	m_iv[0].iov_base = m_write_buf;
 	m_iv[0].iov_len = m_write_index;
 	m_iv_count = 1;
+	m_bytes_to_send = m_write_index;
 	return true;
 }
 
 //由线程池中的工作线程调用,这是处理HTPP请求的入口函数
 void http_conn::process()
 {
-cout << "here is process" << endl;
+	if (m_co_start)
+	{
+		m_co_start = false;
+		co_handler::start(this);
+		return;
+	}
+	//协程恢复后可能挂起并在另一个线程中继续执行,之后不能再访问本对象
+	if (m_co)
+	{
+		co_handler::resume(m_co);
+		return;
+	}
+	uint64_t begin = metrics::now();
+	TRACE_MARK(m_trace, TP_DEQUEUE);
+	metrics::record(STAGE_QUEUE, begin - m_queued);
+	m_do_request_start = 0;
 	//解析HTTP请求
 	HTTP_CODE read_ret = process_read();
 	if (read_ret == NO_REQUEST)
 	{
 		//什么都没有请求,重新添加到epoll读事件
-		modfd(m_epollfd, m_sockfd, EPOLLIN);
+		rearm(EPOLLIN);
+		return;
+	}
+	//do_request()开始前为解析阶段,请求有语法错误时没有调用do_request()
+	uint64_t parsed = metrics::now();
+	if (m_do_request_start)
+	{
+		TRACE_MARK(m_trace, TP_RESOLVED);
+		metrics::record(STAGE_PARSE, m_do_request_start - begin);
+		metrics::record(STAGE_DO_REQUEST, parsed - m_do_request_start);
+	}
+	else
+		metrics::record(STAGE_PARSE, parsed - begin);
+	m_handle_us = metrics::to_ns(parsed - begin) / 1000;
+	if (read_ret == PROXY_REQUEST)
+	{
+		start_proxy();
+		return;
+	}
+	if (!process_write(read_ret))
+	{
+		close_conn();
+		return;
+	}
+	//流式应答和WebSocket握手之后的收发都在主线程中进行,交给主线程发送
+	if (m_producer || m_ws)
+	{
+		rearm(EPOLLOUT);
 		return;
 	}
-	bool write_ret = process_write(read_ret);
-	if (!(write_ret))
+	//普通应答直接在工作线程中发送,发送缓冲区满时write()才注册EPOLLOUT,
+	//省去一次epoll_ctl和主线程的一轮epoll_wait
+	if (!write())
 		close_conn();
-	modfd(m_epollfd, m_sockfd, EPOLLOUT);
+}
+
+void http_conn::log_request()
+{
+	if (m_req_start == 0)
+		return;
+	uint64_t total = metrics::now() - m_req_start;
+	metrics::request_done(m_status, m_bytes_sent, total);
+	TRACE_MARK(m_trace, TP_LAST_BYTE);
+	TRACE_FINISH(m_trace, m_sockfd, m_status, m_url ? m_url : "-", total);
+	if (access_log::enabled())
+	{
+		access_record record;
+		record.total_us = metrics::to_ns(total) / 1000;
+		record.start_us = access_log::now_us() - record.total_us;
+		record.handle_us = m_handle_us;
+		record.bytes = m_bytes_sent;
+		//AF_UNIX连接没有对方地址,记为0.0.0.0:0
+		record.client_ip = 0;
+		record.client_port = 0;
+		if (m_address.ss_family == AF_INET)
+		{
+			const sockaddr_in *addr = (const sockaddr_in *)&m_address;
+			record.client_ip = addr->sin_addr.s_addr;
+			record.client_port = addr->sin_port;
+		}
+		record.status = m_status;
+		record.method = m_method;
+		strncpy(record.url, m_url ? m_url : "-", sizeof(record.url));
+		access_log::write(record);
+	}
+	//同一个请求只记录一次
+	m_req_start = 0;
+	m_responses++;
+}
+
+int http_conn::build_proxy_request(char *buf, int size)
+{
+	int len = snprintf(buf, size, "GET %s HTTP/1.1\r\n", m_url);
+	if (len >= size)
+		return -1;
+
+	//parse_line已经把每行结尾的\r\n替换成了两个\0
+	char *line = m_read_buf + m_headers_begin;
+	char *end = m_read_buf + m_body_begin;
+	while (line < end && *line)
+	{
+		int line_len = strlen(line);
+		//Connection等逐跳字段不转发,与后端之间始终保持长连接
+		if (strncasecmp(line, "Connection:", 11) != 0 &&
+			strncasecmp(line, "Keep-Alive:", 11) != 0 &&
+			strncasecmp(line, "Proxy-Connection:", 17) != 0)
+		{
+			if (len + line_len + 2 >= size)
+				return -1;
+			memcpy(buf + len, line, line_len);
+			len += line_len;
+			buf[len++] = '\r';
+			buf[len++] = '\n';
+		}
+		line += line_len + 2;
+	}
+
+	const char *tail = "Connection: keep-alive\r\n\r\n";
+	int tail_len = strlen(tail);
+	if (len + tail_len >= size)
+		return -1;
+	memcpy(buf + len, tail, tail_len);
+	return len + tail_len;
+}
+
+//由工作线程调用,之后该连接的所有I/O都由主线程完成,工作线程不会阻塞在后端上
+void http_conn::start_proxy()
+{
+	upstream_conn *upstream = m_proxy_pool->acquire();
+	if (!upstream)
+	{
+		process_write(BAD_GATEWAY);
+		rearm(EPOLLOUT);
+		return;
+	}
+	int len = build_proxy_request(upstream->request_buf(), upstream_conn::REQ_SIZE);
+	if (len < 0)
+	{
+		upstream->abort();
+		process_write(BAD_REQUEST);
+		rearm(EPOLLOUT);
+		return;
+	}
+	upstream->set_request_len(len);
+	m_upstream = upstream;
+	upstream->start(this, m_read_buf + m_body_begin, m_content_length, m_linger);
+}
+
+bool http_conn::finish_proxy(bool keep_alive)
+{
+	m_upstream = 0;
+	log_request();
+	if (!keep_alive)
+		return false;
+	serve_next();
+	return true;
+}
+
+void http_conn::proxy_failed()
+{
+	m_upstream = 0;
+	process_write(BAD_GATEWAY);
+	if (!write())
+		close_conn();
+}
+
+ws_session *http_conn::websocket() const
+{
+	return (m_ws && m_ws->is_open()) ? m_ws : 0;
 }
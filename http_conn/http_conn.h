@@ -11,6 +11,7 @@
 #include <errno.h>
 #include <string.h>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/mman.h>
@@ -19,10 +20,23 @@
 #include <sys/epoll.h>
 #include <sys/uio.h>
 #include <sys/stat.h>
+#include <stdint.h>
+#include <atomic>
 #include "locker.h"
+#include "trace.h"
 
 using namespace std;
 
+class stream_producer;
+class upstream_pool;
+class upstream_conn;
+class ws_session;
+struct mapped_file;
+struct bundle_map;
+struct bundle_entry;
+template <typename T>
+class threadpool;
+
 class http_conn
 {
 public:
@@ -32,6 +46,23 @@ public:
 	static const int WRITE_BUF_SIZE = 1024;
 	//读缓冲区的大小
 	static const int READ_BUF_SIZE = 2048;
+	//流式应答(chunked)缓冲区的大小,缓冲区满时生产者暂停,等待客户端消费
+	static const int STREAM_BUF_SIZE = 16384;
+	//小于等于该大小的文件可以直接复制到应答头部之后(见m_inline_max),写缓冲区为此多留出这么多空间
+	static const int INLINE_FILE_MAX = 16384;
+	//sendfile方式在打开文件时提示内核预读的字节数,以及一次sendfile最多发送的字节数
+	static const off_t SENDFILE_READAHEAD = 2 * 1024 * 1024;
+	static const long long SENDFILE_CHUNK = 1 << 30;
+	//一次read()最多调用recv的次数,读缓冲区只有READ_BUF_SIZE,超过后剩下的数据等重新注册EPOLLIN后再读
+	static const int READ_BUDGET_CALLS = 8;
+	//静态文件的发送方式,按文件大小选择
+	enum FILE_TIER
+	{
+		TIER_INLINE = 0,	//复制到写缓冲区,与应答头部一起一次发送
+		TIER_MAPPED,		//共享的长期映射(file_cache),writev发送
+		TIER_SENDFILE,		//sendfile,并提示内核顺序预读
+		TIER_BUNDLE			//包文件(asset_bundle)中的内容,writev发送
+	};
 	//HTTP请求方法,但改代=代码仅支持GET
 	enum METHOD
 	{
@@ -61,7 +92,14 @@ public:
 		NO_RESOURCE,
 		FORBIDDEN_REQUEST,
 		FILE_REQUEST,
+		STREAM_REQUEST,
+		PROXY_REQUEST,
+		WS_UPGRADE,
+		EVENT_STREAM,
+		METRICS_REQUEST,
+		BUNDLE_REQUEST,
 		INTERNAL_ERROR,
+		BAD_GATEWAY,
 		CLOSED_CONNECTION
 	};
 	//行的读取状态
@@ -73,8 +111,8 @@ public:
 	};
 
 public:
-	//初始化新接受的连接
-	void init(int sockfd, const sockaddr_in &addr);
+	//初始化新接受的连接,epollfd为连接所属的事件循环
+	void init(int sockfd, const sockaddr_storage &addr, int epollfd = m_epollfd);
 	//关闭连接
 	void close_conn(bool real_close = true);
 	//处理客户请求
@@ -84,9 +122,69 @@ public:
 	//非阻塞写操作
 	bool write();
 
+	//下面这一组函数用于流式应答,以Transfer-Encoding: chunked发送长度未知的内容
+	//开始流式应答,producer的所有权转移给连接,在连接可写时被回调
+	bool begin_stream(int status, const char *title, const char *content_type, stream_producer *producer);
+	//推入一个数据块,缓冲区空间不足时返回false,生产者应等待下一次回调
+	bool push_chunk(const char *data, int len);
+	//缓冲区还能容纳的数据字节数(已扣除chunk的帧开销)
+	int chunk_room() const;
+	//写入结束块,流式应答结束
+	bool end_stream();
+	//应答头部或已写入的数据是否还没有发送完
+	bool stream_pending() const { return m_bytes_to_send > 0 || m_stream_len > m_stream_sent; }
+	//生产者暂时没有数据时连接不再监听任何事件,数据就绪后由生产者调用该函数重新注册EPOLLOUT
+	void wake_stream();
+	//生产者长时间没有数据时调用,连接只监听EPOLLRDHUP,不占用任何线程,对方关闭时由主线程释放
+	void park_stream();
+
+	//下面这一组函数由反向代理(upstream_conn)在主线程中调用
+	int get_sockfd() const { return m_sockfd; }
+	void set_upstream(upstream_conn *upstream) { m_upstream = upstream; }
+	//转发结束,keep_alive为true时继续读取下一个请求并返回true,否则返回false,由调用者关闭连接
+	bool finish_proxy(bool keep_alive);
+	//后端不可用,返回502
+	void proxy_failed();
+
+	//已经完成WebSocket握手时返回对应的会话,否则返回NULL
+	ws_session *websocket() const;
+	//连接由协程处理,事件到达时直接放入线程池,由工作线程读写
+	bool coroutine() const { return m_co || m_co_start; }
+	//放入就绪队列后轮到本连接时由事件循环调用,继续发送下一份预算,或处理缓冲区中的下一个请求
+	void resume_write();
+	//连接的代数,每次关闭时加一,就绪队列据此跳过已经关闭的连接
+	uint32_t generation() const { return m_generation.load(memory_order_acquire); }
+	//process()之后是否有应答等待发送,每核一个线程时据此在同一线程中立即调用write()
+	//等待I/O线程读取文件时没有,读完后由I/O线程重新注册EPOLLOUT
+	bool response_pending() const { return m_sockfd != -1 && !m_cold_wait && (m_bytes_to_send > 0 || m_producer); }
+	//由I/O线程调用,文件内容已读入页缓存,到end为止不必再检查;ok为false表示读取出错
+	void cold_read_done(bool ok, off_t end);
+
+	//由反向代理调用,记录后端应答的状态码和转发给客户的字节数,用于访问日志
+	void set_status(int status) { m_status = status; }
+	void add_bytes_sent(int bytes)
+	{
+		if (m_bytes_sent == 0)
+			TRACE_MARK(m_trace, TP_FIRST_BYTE);
+		m_bytes_sent += bytes;
+	}
+
 private:
-	//初始化连接
-	void init();
+	//微基准测试直接调用解析和填充应答的私有函数
+	friend class micro_bench;
+	//协程方式处理连接时直接使用解析和发送的私有函数
+	friend class co_handler;
+
+	//初始化连接,pending为读缓冲区头部保留的未解析的字节数(流水线发来的后续请求)
+	void init(int pending = 0);
+	//保持连接时重置状态,已读入但没有解析的数据移到读缓冲区头部,返回其字节数
+	int next_request();
+	//应答结束并保持连接时调用,缓冲区中已有下一个请求时处理它,否则重新注册EPOLLIN
+	//工作线程中直接处理;事件循环线程中见defer_request()
+	void serve_next();
+	//事件循环线程中缓冲区里已有下一个请求:交给线程池,每核一个线程(或线程池队列满)时放入就绪队列,
+	//本轮事件处理完后再处理,不在write()的调用中解析和处理请求,也不会随流水线请求逐个递归
+	void defer_request();
 	//解析HTTP请求
 	HTTP_CODE process_read();
 	//填充HTTP应答
@@ -95,31 +193,79 @@ private:
 	//下面这一组函数被process_read调用以分析HTTP请求
 	HTTP_CODE parse_request_line(char *text);
 	HTTP_CODE parse_headers(char *text);
-	HTTP_CODE parse_content(char *text);
+	HTTP_CODE parse_content();
 	HTTP_CODE do_request();
 	char *get_line() { return m_read_buf + m_start_line; }
 	LINE_STATUS parse_line();
 
 	//下面这一组函数被process_write调用以填充HTTP应答
-	void unmap();
+	//释放应答文件的映射或文件描述符
+	void release_file();
+	//按文件大小打开或映射m_real_file,返回FILE_REQUEST或错误
+	HTTP_CODE open_file();
 	bool add_response(const char *format, ...);
 	bool add_content(const char *content);
 	bool add_status(int status, const char *title);
-	bool add_headers(int content_length);
-	bool add_content_length(int content_length);
+	bool add_headers(off_t content_length);
+	bool add_content_length(off_t content_length);
 	bool add_linger();
 	bool add_blank_line();
+	//writev部分发送后调整m_iv
+	void consume_iv(int bytes);
+	//发送流式应答,在缓冲区有空间时回调生产者
+	bool write_stream();
+	void release_stream();
+	//把请求转发给匹配的后端
+	void start_proxy();
+	//生成发往后端的请求头部,去掉逐跳的头部字段,返回长度,缓冲区不足时返回-1
+	int build_proxy_request(char *buf, int size);
+	//请求结束(应答发送完毕或连接关闭)时写一条访问日志
+	void log_request();
+	//重新注册本连接的事件(EPOLLONESHOT)
+	void rearm(int ev);
+	//用完本次发送预算但还有数据时调用,放入就绪队列或者重新注册EPOLLOUT
+	void yield_write();
+	//writev,一次最多发送budget字节(m_iv本身不变),budget为0时不限制
+	int writev_budget(int budget);
+	//发送普通应答的一部分(一次系统调用),更新m_bytes_to_send和m_iv,返回发送的字节数,出错时返回-1
+	//sendfile方式时先以MSG_MORE发送应答头部,再sendfile文件内容
+	//复制方式的文件内容在第一次发送时才读入写缓冲区
+	int send_response(int budget);
+	//复制方式时把文件内容读到应答头部之后并关闭文件
+	bool read_inline();
+	//接下来要发送的文件内容不在页缓存中时交给I/O线程读取,返回true表示等待I/O线程,之后不能再访问本对象
+	bool cold_pending();
 
 public:
 	//所有socket上的事件被注册到同一个epoll内核事件表,所以将epoll文件描述符设置为静态
+	//每核一个线程(web -s)时不使用,各线程有自己的epoll,见m_loop_fd
 	static int m_epollfd;
-	//统计用户数量
-	static int m_user_count;
+	//主线程的事件循环交给哪个线程池处理请求,每核一个线程时为NULL
+	static threadpool<http_conn> *m_pool;
+	//统计用户数量,主线程和工作线程都会修改
+	static atomic<int> m_user_count;
+	//新连接是否用协程处理(web -o)
+	static bool m_coroutine;
+	//一次write()最多发送的字节数(web -W),0为不限制
+	static int m_write_budget;
+	//不超过m_inline_max的文件复制到写缓冲区(不超过INLINE_FILE_MAX),不小于m_sendfile_min的文件用sendfile,
+	//之间的用共享映射(web -T inline_max:sendfile_min)
+	static int m_inline_max;
+	static off_t m_sendfile_min;
 
 private:
 	//该HTTP连接的socket和对方的socket地址
 	int m_sockfd;
-	sockaddr_in m_address;
+	//连接注册在哪个epoll上,主线程的事件循环为m_epollfd,每核一个线程时为该线程的epoll
+	int m_loop_fd;
+	//是否在事件循环的就绪队列中,只由事件循环线程访问(关闭时不修改,由代数使队列中的项失效)
+	bool m_ready;
+	//在就绪队列中等待的是缓冲区里的下一个请求,而不是继续发送,见defer_request()
+	bool m_deferred;
+	//见generation(),关闭连接的线程和事件循环线程都会访问
+	atomic<uint32_t> m_generation;
+	//TCP连接为sockaddr_in,AF_UNIX连接只有地址族
+	sockaddr_storage m_address;
 
 	//读缓冲区
 	char m_read_buf[READ_BUF_SIZE];
@@ -129,8 +275,12 @@ private:
 	int m_start_line;
 	//当前正在分析的字符在读缓冲区中的位置
 	int m_check_index;
+	//请求头部和消息体在读缓冲区中的起始位置,转发请求时使用
+	int m_headers_begin;
+	int m_body_begin;
 	//写缓冲区
-	char m_write_buf[WRITE_BUF_SIZE];
+	//应答头部最多WRITE_BUF_SIZE,复制方式发送的文件内容紧跟在头部之后
+	char m_write_buf[WRITE_BUF_SIZE + INLINE_FILE_MAX];
 	//写缓冲区中待发送的字节数
 	int m_write_index;
 
@@ -139,8 +289,8 @@ private:
 	//请求方法
 	METHOD m_method;
 
-	//客户请求的目标文件的完整路径,其内容等于doc_root+m_url, doc_root是网站根目录
-	char m_real_file[MAXFILENAME_LEN];
+	//客户请求的目标文件相对于网站根目录(doc_root)的路径,由m_url规范化得到,见doc_tree
+	char m_path[MAXFILENAME_LEN];
 	//客户请求的目标文件的文件名
 	char *m_url;
 	//HTTP的协议版本号, 我们仅支持HTTP/1.1
@@ -152,12 +302,93 @@ private:
 	//HTTP请求是否要求保持连接
 	bool m_linger;
 
-	//客户请求的目标文件被mmap到内存的起始位置
-	char *m_file_address;
+	//目标文件的发送方式
+	FILE_TIER m_file_tier;
+	//共享映射方式时目标文件的映射
+	mapped_file *m_mapped;
+	//包文件方式时引用的包和命中的条目
+	bundle_map *m_bundle;
+	const bundle_entry *m_bundle_entry;
+	//映射方式(共享映射和包文件)时内容在内存中的起始位置,m_iv[1]为剩下未发送的部分
+	const char *m_body_addr;
+	//sendfile方式时打开的目标文件和下一次发送的位置
+	int m_file_fd;
+	off_t m_file_offset;
+	//文件中已确认在页缓存中的部分的结束位置
+	off_t m_warm_end;
+	//是否在等待I/O线程读取文件,以及I/O线程是否读取出错
+	bool m_cold_wait;
+	bool m_cold_failed;
 	//目标文件的状态,通过它我们可以判断文件是否存在,是否为目录,是否可读,并获取文件大小等信息
 	struct stat m_file_stat;
 	//采用writev来执行写操作,所以定义下面两个成员,其中m_iv_count表示被写在内存块的数量
 	struct iovec m_iv[2];
 	int m_iv_count;
+	//本次应答还需要发送的字节数,sendfile发送的文件可能超过2GB
+	long long m_bytes_to_send;
+
+	//流式应答的生产者,为NULL表示普通应答
+	stream_producer *m_producer;
+	//chunk编码后待发送的数据,开始流式应答时才分配
+	char *m_stream_buf;
+	//m_stream_buf中已写入的字节数和已发送的字节数
+	int m_stream_len;
+	int m_stream_sent;
+	//生产者是否已经写入结束块
+	bool m_stream_done;
+
+	//客户端是否接受gzip编码(Accept-Encoding),以及If-None-Match字段,包文件应答时使用
+	bool m_accept_gzip;
+	char *m_if_none_match;
+
+	//Last-Event-ID字段,事件流断线重连时使用
+	unsigned long long m_last_event_id;
+
+	//请求是否要求升级为WebSocket,以及Sec-WebSocket-Key字段
+	bool m_ws_upgrade;
+	char *m_ws_key;
+	//WebSocket会话,握手应答发送完毕后开始使用
+	ws_session *m_ws;
+
+	//匹配的反向代理路由和正在使用的后端连接
+	upstream_pool *m_proxy_pool;
+	upstream_conn *m_upstream;
+
+	//下面这一组成员用于访问日志和运行时统计
+	//以下时间均为metrics::now()的返回值
+	//收到请求第一个字节的时间,0表示当前没有请求
+	uint64_t m_req_start;
+	//请求读完放入线程池队列的时间
+	uint64_t m_queued;
+	//开始执行do_request()的时间
+	uint64_t m_do_request_start;
+	//工作线程处理请求的用时(微秒)
+	uint32_t m_handle_us;
+	//应答的状态码
+	int m_status;
+	//本次应答已发送的字节数
+	uint64_t m_bytes_sent;
+	//挂起的协程句柄,协程正在执行时也不为NULL;以及是否在第一次事件时创建协程
+	void *m_co;
+	bool m_co_start;
+
+	//流量录制的连接编号,0表示不录制该连接
+	uint32_t m_capture_id;
+	//该连接上已经结束的请求数,录制时记录在每段数据中
+	uint32_t m_responses;
+#ifdef WEB_TRACE
+	//本次请求的跟踪埋点
+	request_trace m_trace;
+#endif
+};
+
+//流式应答的数据生产者
+class stream_producer
+{
+public:
+	virtual ~stream_producer() {}
+	//在连接可写且缓冲区有空间时被调用,通过conn->push_chunk()写入数据
+	//返回true表示数据已经全部产生;暂时没有数据可以不写入任何内容,之后调用conn->wake_stream()
+	virtual bool produce(http_conn *conn) = 0;
 };
 #endif
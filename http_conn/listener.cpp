@@ -0,0 +1,112 @@
+#include "listener.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "poller.h"
+#include "metrics.h"
+
+int listener::m_backlog = 1024;
+int listener::m_defer_secs = 0;
+int listener::m_fastopen_qlen = 0;
+thread_local int listener::m_reserve_fd = -1;
+
+int listener::open(int port, bool reuseport)
+{
+	int listenfd = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (listenfd < 0)
+		return -1;
+	//不能设置SO_LINGER为{1, 0},否则close时发送RST,内核缓冲区中尚未发送的应答会被丢弃
+	int reuse = 1;
+	setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+	if (reuseport)
+		setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse));
+	if (m_defer_secs > 0)
+		setsockopt(listenfd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &m_defer_secs, sizeof(m_defer_secs));
+	if (m_fastopen_qlen > 0)
+		setsockopt(listenfd, IPPROTO_TCP, TCP_FASTOPEN, &m_fastopen_qlen, sizeof(m_fastopen_qlen));
+	poller::setup_socket(listenfd);
+
+	struct sockaddr_in ser;
+	bzero(&ser, sizeof(ser));
+	ser.sin_family = AF_INET;
+	ser.sin_addr.s_addr = htonl(INADDR_ANY);
+	ser.sin_port = htons(port);
+	if (bind(listenfd, (struct sockaddr *)&ser, sizeof(ser)) < 0 || listen(listenfd, m_backlog) < 0)
+	{
+		close(listenfd);
+		return -1;
+	}
+	return listenfd;
+}
+
+int listener::open_unix(const char *path)
+{
+	struct sockaddr_un addr;
+	if (strlen(path) >= sizeof(addr.sun_path))
+	{
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	struct stat st;
+	if (lstat(path, &st) == 0)
+	{
+		if (!S_ISSOCK(st.st_mode))
+		{
+			errno = EEXIST;
+			return -1;
+		}
+		unlink(path);
+	}
+	int listenfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (listenfd < 0)
+		return -1;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	if (bind(listenfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(listenfd, m_backlog) < 0)
+	{
+		close(listenfd);
+		return -1;
+	}
+	return listenfd;
+}
+
+int listener::accept(int listenfd, struct sockaddr_storage *addr, int max_fd)
+{
+	if (m_reserve_fd < 0)
+		m_reserve_fd = ::open("/dev/null", O_RDONLY | O_CLOEXEC);
+	while (true)
+	{
+		socklen_t len = sizeof(*addr);
+		int connfd = accept4(listenfd, (struct sockaddr *)addr, &len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (connfd >= 0)
+		{
+			if (connfd < max_fd)
+				return connfd;
+			close(connfd);
+			metrics::add(COUNTER_ACCEPT_REJECTED);
+			continue;
+		}
+		if ((errno == EMFILE || errno == ENFILE) && m_reserve_fd >= 0)
+		{
+			close(m_reserve_fd);
+			connfd = accept4(listenfd, NULL, NULL, SOCK_CLOEXEC);
+			if (connfd >= 0)
+				close(connfd);
+			m_reserve_fd = ::open("/dev/null", O_RDONLY | O_CLOEXEC);
+			if (connfd < 0)
+				return -1;
+			metrics::add(COUNTER_ACCEPT_REJECTED);
+			continue;
+		}
+		//握手完成前对方已经重置的连接,跳过继续接受
+		if (errno == ECONNABORTED || errno == EINTR)
+			continue;
+		return -1;
+	}
+}
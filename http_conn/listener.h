@@ -0,0 +1,32 @@
+#ifndef LISTENER_H_
+#define LISTENER_H_
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+//监听socket的创建和接受连接
+//监听socket以边沿触发注册到epoll,每次EPOLLIN必须接受到EAGAIN为止,否则突发的连接会滞留在队列中
+class listener
+{
+public:
+	//listen的队列长度,内核会限制在net.core.somaxconn以内
+	static int m_backlog;
+	//TCP_DEFER_ACCEPT的秒数,0表示不设置:客户发来第一段数据后连接才可以被接受
+	static int m_defer_secs;
+	//TCP_FASTOPEN的队列长度,0表示不启用
+	static int m_fastopen_qlen;
+
+	//创建非阻塞的监听socket,reuseport为true时设置SO_REUSEPORT,失败返回-1
+	static int open(int port, bool reuseport);
+	//创建非阻塞的AF_UNIX监听socket,path上已有的socket文件(上次运行留下的)先删除,不是socket时失败
+	static int open_unix(const char *path);
+	//接受一个连接,返回的fd已经是非阻塞和close-on-exec的,没有等待的连接或出错时返回-1
+	//连接的fd不小于max_fd或者进程的fd用完时,接受后立即关闭,避免连接一直留在队列中反复触发EPOLLIN
+	static int accept(int listenfd, struct sockaddr_storage *addr, int max_fd);
+
+private:
+	//fd用完时先关闭预留的fd,腾出一个fd接受并关闭连接,之后再重新打开,每个线程一个
+	static thread_local int m_reserve_fd;
+};
+
+#endif
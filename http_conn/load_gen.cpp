@@ -0,0 +1,725 @@
+//HTTP压力测试工具,与web一起构建,用于在同一台机器上通过回环地址比较不同版本的吞吐量和延迟
+//用法: ./load_gen [-a host] [-p port] [-c connections] [-t threads] [-d seconds] [-R rate] [-P depth] [-n] [-u path] [-f mix_file]
+//  -R 0为闭环模式:每个连接始终保持depth个未完成的请求,收到应答后立即发送下一个
+//  -R N为开环模式:总共每秒N个请求按固定间隔分配到各连接,延迟从计划发送的时间算起,
+//       服务器变慢时请求在客户端排队,排队时间也计入延迟,避免协调遗漏(coordinated omission)
+//  -P 流水线深度,每个连接最多同时发出的请求数
+//  -n 短连接,每个请求新建一个连接(此时忽略-P)
+//  -f 请求组合文件,每行为"[权重] 路径",如"3 /index.html",按权重随机选择
+//  -a unix:/tmp/web.sock 通过AF_UNIX socket连接(web -U),与回环TCP比较延迟
+//延迟记录在每个线程的对数线性直方图中(与metrics_histogram相同的分桶方式,相对误差约3%),结束时合并,
+//内存和结束时的开销与测试时长无关
+//结束时不再发出请求,最多等待1秒收完已发出的请求的应答,仍然没有应答的(如被服务器丢弃的流水线请求)记为unanswered,同时计入errors
+//结果以JSON输出到标准输出
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+using namespace std;
+
+//每个连接最多排队的请求数,开环模式下服务器跟不上时超出的请求记为溢出
+static const int QUEUE_SIZE = 4096;
+static const int READ_BUF_SIZE = 65536;
+//一个应答多久没有完成认为连接卡住
+static const long long STALL_NS = 5 * 1000000000LL;
+//测试结束后等待已发出的请求的应答的最长时间
+static const long long DRAIN_NS = 1000000000LL;
+
+static const char *host = "127.0.0.1";
+static int port = 3000;
+static int conn_num = 50;
+static int thread_num = 2;
+static int duration = 10;
+static double rate = 0;
+static int depth = 1;
+static bool keep_alive = true;
+
+//请求组合
+struct request_entry
+{
+	string data;
+	int weight;
+};
+static vector<request_entry> mix;
+static int total_weight = 0;
+
+static atomic<bool> stop(false);
+
+static long long now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+//应答解析的状态
+enum PARSE_STATE
+{
+	PARSE_HEAD = 0,
+	PARSE_BODY,
+	PARSE_CHUNK_SIZE,
+	PARSE_CHUNK_DATA,
+	PARSE_TRAILER
+};
+
+struct lg_conn
+{
+	int fd;
+	bool connecting;
+	//计划发送时间的环形队列: [tail, sent)已发出, [sent, head)等待发送
+	long long *intended;
+	unsigned head;
+	unsigned sent;
+	unsigned tail;
+	//开环模式下下一个请求的计划时间
+	long long next_send;
+	//最近一次有进展的时间,用于发现卡住的连接
+	long long last_progress;
+
+	string out;
+	size_t out_off;
+
+	char *buf;
+	int len;
+	PARSE_STATE state;
+	long long remaining;
+	//当前应答要求关闭连接
+	bool close_after;
+};
+
+//延迟直方图(纳秒),每个2的幂区间分为SUB个桶
+struct lg_histogram
+{
+	static const int SUB = 32;
+	static const int SUB_BITS = 5;
+	//覆盖到2^40纳秒(约18分钟)
+	static const int BUCKETS = (40 - SUB_BITS + 1) * SUB;
+
+	long long counts[BUCKETS];
+	long long count;
+	long long sum;
+	long long max;
+
+	static int bucket(long long ns)
+	{
+		if (ns < SUB)
+			return (ns > 0) ? ns : 0;
+		int msb = 63 - __builtin_clzll(ns);
+		int index = (msb - SUB_BITS + 1) * SUB + ((ns >> (msb - SUB_BITS)) & (SUB - 1));
+		return (index < BUCKETS) ? index : BUCKETS - 1;
+	}
+	//桶的中点
+	static double middle(int index)
+	{
+		if (index < SUB)
+			return index;
+		int shift = index / SUB - 1;
+		return (double)((long long)(SUB + index % SUB) << shift) + (double)(1LL << shift) / 2;
+	}
+	void record(long long ns)
+	{
+		counts[bucket(ns)]++;
+		count++;
+		sum += ns;
+		if (ns > max)
+			max = ns;
+	}
+	void merge(const lg_histogram &other)
+	{
+		for (int i = 0; i < BUCKETS; i++)
+			counts[i] += other.counts[i];
+		count += other.count;
+		sum += other.sum;
+		if (other.max > max)
+			max = other.max;
+	}
+	//微秒
+	double percentile(double p) const
+	{
+		if (count == 0)
+			return 0;
+		long long rank = (long long)(p * (count - 1));
+		long long seen = 0;
+		for (int i = 0; i < BUCKETS; i++)
+		{
+			seen += counts[i];
+			if (seen > rank)
+				return min(middle(i), (double)max) / 1000.0;
+		}
+		return max / 1000.0;
+	}
+};
+
+struct lg_stats
+{
+	lg_histogram latency;
+	long long requests;
+	long long errors;
+	//测试结束时已发出但没有收到应答的请求数(已计入errors)
+	long long unanswered;
+	long long overflows;
+	long long bytes;
+	long long status[6];
+};
+
+struct lg_worker
+{
+	int first;
+	int count;
+	pthread_t tid;
+	lg_stats stats;
+};
+
+static bool load_mix(const char *path)
+{
+	FILE *fp = fopen(path, "r");
+	if (!fp)
+		return false;
+	char line[1024];
+	while (fgets(line, sizeof(line), fp))
+	{
+		char *p = line + strspn(line, " \t");
+		p[strcspn(p, "\r\n")] = '\0';
+		if (*p == '\0' || *p == '#')
+			continue;
+		int weight = 1;
+		if (*p != '/')
+		{
+			weight = atoi(p);
+			p += strcspn(p, " \t");
+			p += strspn(p, " \t");
+		}
+		if (*p != '/' || weight <= 0)
+			continue;
+		request_entry entry;
+		entry.data = p;
+		entry.weight = weight;
+		mix.push_back(entry);
+	}
+	fclose(fp);
+	return !mix.empty();
+}
+
+static void build_requests()
+{
+	if (mix.empty())
+	{
+		request_entry entry;
+		entry.data = "/index.html";
+		entry.weight = 1;
+		mix.push_back(entry);
+	}
+	for (size_t i = 0; i < mix.size(); i++)
+	{
+		string path = mix[i].data;
+		mix[i].data = "GET " + path + " HTTP/1.1\r\nHost: " + (strncmp(host, "unix:", 5) == 0 ? "localhost" : host) +
+					  (keep_alive ? "\r\nConnection: keep-alive\r\n\r\n" : "\r\nConnection: close\r\n\r\n");
+		total_weight += mix[i].weight;
+	}
+}
+
+static const string &pick_request(unsigned int *seed)
+{
+	if (mix.size() == 1)
+		return mix[0].data;
+	int r = rand_r(seed) % total_weight;
+	for (size_t i = 0; i < mix.size(); i++)
+	{
+		r -= mix[i].weight;
+		if (r < 0)
+			return mix[i].data;
+	}
+	return mix.back().data;
+}
+
+static bool open_conn(int epollfd, lg_conn &c, int index)
+{
+	struct sockaddr_storage addr;
+	socklen_t addr_len;
+	memset(&addr, 0, sizeof(addr));
+	if (strncmp(host, "unix:", 5) == 0)
+	{
+		struct sockaddr_un *un = (struct sockaddr_un *)&addr;
+		un->sun_family = AF_UNIX;
+		strncpy(un->sun_path, host + 5, sizeof(un->sun_path) - 1);
+		addr_len = sizeof(*un);
+	}
+	else
+	{
+		struct sockaddr_in *in = (struct sockaddr_in *)&addr;
+		in->sin_family = AF_INET;
+		in->sin_port = htons(port);
+		inet_pton(AF_INET, host, &in->sin_addr);
+		addr_len = sizeof(*in);
+	}
+	c.fd = socket(addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if (c.fd < 0)
+		return false;
+	int one = 1;
+	if (addr.ss_family == AF_INET)
+		setsockopt(c.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	if (connect(c.fd, (struct sockaddr *)&addr, addr_len) < 0 && errno != EINPROGRESS)
+	{
+		close(c.fd);
+		c.fd = -1;
+		return false;
+	}
+	c.connecting = true;
+	c.len = 0;
+	c.state = PARSE_HEAD;
+	c.close_after = false;
+	c.out.clear();
+	c.out_off = 0;
+	c.last_progress = now_ns();
+	epoll_event ev;
+	ev.events = EPOLLIN | EPOLLOUT;
+	ev.data.u32 = index;
+	epoll_ctl(epollfd, EPOLL_CTL_ADD, c.fd, &ev);
+	return true;
+}
+
+//关闭连接,已发出但没有收到应答的请求记为错误,等待发送的请求保留
+static void close_conn(int epollfd, lg_conn &c, lg_stats &stats, bool error)
+{
+	if (c.fd >= 0)
+	{
+		epoll_ctl(epollfd, EPOLL_CTL_DEL, c.fd, 0);
+		close(c.fd);
+		c.fd = -1;
+	}
+	if (error)
+		stats.errors += c.sent - c.tail;
+	c.tail = c.sent;
+}
+
+static void update_events(int epollfd, lg_conn &c, int index)
+{
+	epoll_event ev;
+	ev.events = EPOLLIN | ((c.connecting || c.out_off < c.out.size()) ? (uint32_t)EPOLLOUT : 0);
+	ev.data.u32 = index;
+	epoll_ctl(epollfd, EPOLL_CTL_MOD, c.fd, &ev);
+}
+
+//把等待发送的请求写入发送缓冲区并尽量发出,返回false表示连接出错
+static bool flush(lg_conn &c, unsigned int *seed)
+{
+	if (c.connecting)
+		return true;
+	int window = keep_alive ? depth : 1;
+	while (c.sent != c.head && (int)(c.sent - c.tail) < window)
+	{
+		c.out += pick_request(seed);
+		c.sent++;
+	}
+	while (c.out_off < c.out.size())
+	{
+		int n = send(c.fd, c.out.data() + c.out_off, c.out.size() - c.out_off, MSG_NOSIGNAL);
+		if (n < 0)
+			return errno == EAGAIN;
+		c.out_off += n;
+	}
+	c.out.clear();
+	c.out_off = 0;
+	return true;
+}
+
+//处理收到的数据,每完成一个应答记录一次延迟,返回false表示需要关闭连接
+static bool on_data(lg_conn &c, lg_stats &stats)
+{
+	int pos = 0;
+	while (pos < c.len)
+	{
+		char *data = c.buf + pos;
+		int avail = c.len - pos;
+		bool done = false;
+		if (c.state == PARSE_HEAD)
+		{
+			char *end = (char *)memmem(data, avail, "\r\n\r\n", 4);
+			if (!end)
+			{
+				if (avail >= READ_BUF_SIZE)
+					return false;
+				break;
+			}
+			int head_len = end + 4 - data;
+			int status = 0;
+			if (sscanf(data, "HTTP/1.%*d %d", &status) != 1)
+				return false;
+			stats.status[(status >= 100 && status < 600) ? status / 100 : 0]++;
+			c.remaining = 0;
+			c.close_after = !keep_alive;
+			bool chunked = false;
+			for (char *line = data; line < end;)
+			{
+				char *next = (char *)memmem(line, end + 2 - line, "\r\n", 2);
+				if (!next)
+					break;
+				*next = '\0';
+				if (strncasecmp(line, "Content-Length:", 15) == 0)
+					c.remaining = atoll(line + 15);
+				else if (strncasecmp(line, "Transfer-Encoding:", 18) == 0 && strstr(line, "chunked"))
+					chunked = true;
+				else if (strncasecmp(line, "Connection:", 11) == 0 && strstr(line, "close"))
+					c.close_after = true;
+				*next = '\r';
+				line = next + 2;
+			}
+			stats.bytes += head_len;
+			pos += head_len;
+			if (chunked)
+				c.state = PARSE_CHUNK_SIZE;
+			else if (c.remaining > 0)
+				c.state = PARSE_BODY;
+			else
+				done = true;
+		}
+		else if (c.state == PARSE_BODY || c.state == PARSE_CHUNK_DATA)
+		{
+			int n = (avail < c.remaining) ? avail : c.remaining;
+			c.remaining -= n;
+			stats.bytes += n;
+			pos += n;
+			if (c.remaining > 0)
+				break;
+			if (c.state == PARSE_BODY)
+				done = true;
+			else
+			{
+				//跳过chunk数据后的\r\n
+				c.remaining = -2;
+				c.state = PARSE_CHUNK_SIZE;
+			}
+		}
+		else if (c.remaining < 0)
+		{
+			int n = (avail < -c.remaining) ? avail : -c.remaining;
+			c.remaining += n;
+			pos += n;
+		}
+		else
+		{
+			char *end = (char *)memmem(data, avail, "\r\n", 2);
+			if (!end)
+				break;
+			pos += end + 2 - data;
+			if (c.state == PARSE_TRAILER)
+				//结束块之后的空行表示应答结束
+				done = (end == data);
+			else
+			{
+				c.remaining = strtoll(data, NULL, 16);
+				c.state = (c.remaining > 0) ? PARSE_CHUNK_DATA : PARSE_TRAILER;
+			}
+		}
+		if (!done)
+			continue;
+
+		//一个应答完成
+		if (c.tail == c.sent)
+			return false;
+		long long now = now_ns();
+		stats.latency.record(now - c.intended[c.tail % QUEUE_SIZE]);
+		stats.requests++;
+		c.tail++;
+		c.state = PARSE_HEAD;
+		c.last_progress = now;
+		if (c.close_after)
+		{
+			c.len = 0;
+			return false;
+		}
+	}
+	memmove(c.buf, c.buf + pos, c.len - pos);
+	c.len -= pos;
+	return true;
+}
+
+static void *run_worker(void *arg)
+{
+	lg_worker *w = (lg_worker *)arg;
+	lg_stats &stats = w->stats;
+	unsigned int seed = w->first + 1;
+	vector<lg_conn> conns(w->count);
+	int epollfd = epoll_create1(0);
+	epoll_event events[1024];
+	//开环模式下每个连接的发送间隔
+	long long interval = (rate > 0) ? (long long)(1e9 * conn_num / rate) : 0;
+	long long start = now_ns();
+
+	for (int i = 0; i < w->count; i++)
+	{
+		lg_conn &c = conns[i];
+		c.intended = new long long[QUEUE_SIZE];
+		c.head = c.sent = c.tail = 0;
+		c.buf = new char[READ_BUF_SIZE];
+		c.fd = -1;
+		//各连接的发送时间错开,避免同时发出
+		c.next_send = start + (interval ? interval * (w->first + i) / conn_num : 0);
+		if (keep_alive && !open_conn(epollfd, c, i))
+			stats.errors++;
+	}
+
+	long long drain_until = 0;
+	while (true)
+	{
+		long long now = now_ns();
+		long long wake = now + 100000000LL;
+		//结束后只接收应答,全部收到或超时时退出
+		if (stop)
+		{
+			if (drain_until == 0)
+				drain_until = now + DRAIN_NS;
+			bool idle = true;
+			for (int i = 0; i < w->count && idle; i++)
+				idle = conns[i].fd < 0 || conns[i].tail == conns[i].sent;
+			if (idle || now >= drain_until)
+				break;
+			if (drain_until < wake)
+				wake = drain_until;
+		}
+		for (int i = 0; i < w->count && !drain_until; i++)
+		{
+			lg_conn &c = conns[i];
+			//产生到期的请求
+			if (interval)
+			{
+				while (c.next_send <= now)
+				{
+					if (c.head - c.tail >= (unsigned)QUEUE_SIZE)
+						stats.overflows++;
+					else
+						c.intended[c.head++ % QUEUE_SIZE] = c.next_send;
+					c.next_send += interval;
+				}
+				if (c.next_send < wake)
+					wake = c.next_send;
+			}
+			else
+			{
+				int window = keep_alive ? depth : 1;
+				while ((int)(c.head - c.tail) < window)
+					c.intended[c.head++ % QUEUE_SIZE] = now;
+			}
+			if (c.fd < 0 && c.head != c.sent)
+			{
+				if (!open_conn(epollfd, c, i))
+				{
+					stats.errors++;
+					continue;
+				}
+			}
+			if (c.fd < 0)
+				continue;
+			if (c.tail != c.sent && now - c.last_progress > STALL_NS)
+			{
+				close_conn(epollfd, c, stats, true);
+				continue;
+			}
+			if (c.tail == c.sent)
+				c.last_progress = now;
+			if (!flush(c, &seed))
+				close_conn(epollfd, c, stats, true);
+			else
+				update_events(epollfd, c, i);
+		}
+
+		int timeout = (wake - now) / 1000000;
+		int num = epoll_wait(epollfd, events, 1024, (timeout > 0) ? timeout : 0);
+		for (int i = 0; i < num; i++)
+		{
+			int index = events[i].data.u32;
+			lg_conn &c = conns[index];
+			if (c.fd < 0)
+				continue;
+			if (c.connecting)
+			{
+				int err = 0;
+				socklen_t len = sizeof(err);
+				getsockopt(c.fd, SOL_SOCKET, SO_ERROR, &err, &len);
+				if (err != 0 || (events[i].events & (EPOLLERR | EPOLLHUP)))
+				{
+					close_conn(epollfd, c, stats, true);
+					stats.errors++;
+					continue;
+				}
+				c.connecting = false;
+			}
+			if (events[i].events & EPOLLIN)
+			{
+				bool ok = true;
+				bool eof = false;
+				while (ok)
+				{
+					int n = recv(c.fd, c.buf + c.len, READ_BUF_SIZE - c.len, 0);
+					if (n < 0)
+					{
+						ok = (errno == EAGAIN);
+						break;
+					}
+					if (n == 0)
+					{
+						eof = true;
+						break;
+					}
+					c.len += n;
+					c.last_progress = now_ns();
+					ok = on_data(c, stats);
+				}
+				if (!ok || eof)
+				{
+					//应答要求关闭连接时不算错误
+					close_conn(epollfd, c, stats, c.tail != c.sent);
+					continue;
+				}
+			}
+		}
+	}
+
+	for (int i = 0; i < w->count; i++)
+	{
+		//服务器丢弃的流水线请求也在这里计入
+		stats.unanswered += conns[i].sent - conns[i].tail;
+		stats.errors += conns[i].sent - conns[i].tail;
+		if (conns[i].fd >= 0)
+			close(conns[i].fd);
+		delete[] conns[i].intended;
+		delete[] conns[i].buf;
+	}
+	close(epollfd);
+	return NULL;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "usage: %s [-a host] [-p port] [-c connections] [-t threads] [-d seconds] [-R rate] [-P depth] [-n] [-u path] [-f mix_file]\n", name);
+}
+
+int main(int argc, char *argv[])
+{
+	int opt;
+	while ((opt = getopt(argc, argv, "a:p:c:t:d:R:P:nu:f:")) != -1)
+	{
+		switch (opt)
+		{
+			case 'a':
+				host = optarg;
+				break;
+			case 'p':
+				port = atoi(optarg);
+				break;
+			case 'c':
+				conn_num = atoi(optarg);
+				break;
+			case 't':
+				thread_num = atoi(optarg);
+				break;
+			case 'd':
+				duration = atoi(optarg);
+				break;
+			case 'R':
+				rate = atof(optarg);
+				break;
+			case 'P':
+				depth = atoi(optarg);
+				break;
+			case 'n':
+				keep_alive = false;
+				break;
+			case 'u':
+			{
+				request_entry entry;
+				entry.data = optarg;
+				entry.weight = 1;
+				mix.push_back(entry);
+				break;
+			}
+			case 'f':
+				if (!load_mix(optarg))
+				{
+					fprintf(stderr, "bad mix file: %s\n", optarg);
+					return 1;
+				}
+				break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+	if (conn_num <= 0 || thread_num <= 0 || depth <= 0 || depth > QUEUE_SIZE || duration <= 0)
+	{
+		usage(argv[0]);
+		return 1;
+	}
+	if (thread_num > conn_num)
+		thread_num = conn_num;
+	build_requests();
+
+	struct rlimit limit;
+	getrlimit(RLIMIT_NOFILE, &limit);
+	limit.rlim_cur = limit.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &limit);
+
+	vector<lg_worker> workers(thread_num);
+	int per = conn_num / thread_num;
+	long long begin = now_ns();
+	for (int i = 0; i < thread_num; i++)
+	{
+		workers[i].first = i * per;
+		workers[i].count = (i == thread_num - 1) ? conn_num - i * per : per;
+		lg_stats &s = workers[i].stats;
+		memset(&s.latency, 0, sizeof(s.latency));
+		s.requests = s.errors = s.unanswered = s.overflows = s.bytes = 0;
+		memset(s.status, 0, sizeof(s.status));
+		pthread_create(&workers[i].tid, NULL, run_worker, &workers[i]);
+	}
+	sleep(duration);
+	stop = true;
+	//结束后收到的应答对应的请求都是在测试期间发出的
+	double elapsed = (now_ns() - begin) / 1e9;
+
+	lg_histogram *all = new lg_histogram;
+	memset(all, 0, sizeof(*all));
+	long long requests = 0, errors = 0, unanswered = 0, overflows = 0, bytes = 0;
+	long long status[6] = {0};
+	for (int i = 0; i < thread_num; i++)
+	{
+		pthread_join(workers[i].tid, NULL);
+		lg_stats &s = workers[i].stats;
+		all->merge(s.latency);
+		requests += s.requests;
+		errors += s.errors;
+		unanswered += s.unanswered;
+		overflows += s.overflows;
+		bytes += s.bytes;
+		for (int j = 0; j < 6; j++)
+			status[j] += s.status[j];
+	}
+	double mean = all->count ? (double)all->sum / all->count / 1000.0 : 0;
+
+	printf("{\"mode\": \"%s\", \"connections\": %d, \"threads\": %d, \"depth\": %d, \"keep_alive\": %s, \"rate\": %.0f, "
+		   "\"duration_s\": %.3f, \"requests\": %lld, \"errors\": %lld, \"unanswered\": %lld, \"overflows\": %lld, \"bytes\": %lld, "
+		   "\"rps\": %.1f, \"mbps\": %.2f, "
+		   "\"status\": {\"1xx\": %lld, \"2xx\": %lld, \"3xx\": %lld, \"4xx\": %lld, \"5xx\": %lld, \"other\": %lld}, "
+		   "\"latency_us\": {\"mean\": %.1f, \"p50\": %.1f, \"p75\": %.1f, \"p90\": %.1f, \"p99\": %.1f, \"p99.9\": %.1f, \"p99.99\": %.1f, \"max\": %.1f}}\n",
+		   (rate > 0) ? "open" : "closed", conn_num, thread_num, depth, keep_alive ? "true" : "false", rate,
+		   elapsed, requests, errors, unanswered, overflows, bytes, requests / elapsed, bytes * 8 / elapsed / 1e6,
+		   status[1], status[2], status[3], status[4], status[5], status[0],
+		   mean, all->percentile(0.5), all->percentile(0.75), all->percentile(0.9), all->percentile(0.99),
+		   all->percentile(0.999), all->percentile(0.9999), all->max / 1000.0);
+	delete all;
+	return 0;
+}
@@ -0,0 +1,37 @@
+//把二进制格式的访问日志(web -l path -b)转换为文本
+//用法: ./log_decode access.bin
+#include <stdio.h>
+#include <string.h>
+#include "access_log.h"
+
+int main(int argc, char *argv[])
+{
+	if (argc != 2)
+	{
+		fprintf(stderr, "usage: %s access_log_file\n", argv[0]);
+		return 1;
+	}
+	FILE *fp = fopen(argv[1], "rb");
+	if (!fp)
+	{
+		perror(argv[1]);
+		return 1;
+	}
+	access_log_header header;
+	if (fread(&header, sizeof(header), 1, fp) != 1 || memcmp(header.magic, "ALOG", 4) != 0 ||
+		header.record_size != sizeof(access_record))
+	{
+		fprintf(stderr, "%s: not an access log or record size mismatch\n", argv[1]);
+		return 1;
+	}
+
+	access_record record;
+	char line[512];
+	while (fread(&record, sizeof(record), 1, fp) == 1)
+	{
+		int len = access_log::format(record, header.realtime_offset, line, sizeof(line));
+		fwrite(line, 1, len, stdout);
+	}
+	fclose(fp);
+	return 0;
+}
@@ -1,13 +1,34 @@
 #include <signal.h>
 #include <sys/epoll.h>
+#include <algorithm>
 #include "locker.h"
 #include "threadpool.h"
 #include "http_conn.h"
+#include "proxy.h"
+#include "ws.h"
+#include "sse.h"
+#include "access_log.h"
+#include "metrics.h"
+#include "trace.h"
+#include "capture.h"
+#include "co_conn.h"
+#include "shard.h"
+#include "affinity.h"
+#include "completion.h"
+#include "listener.h"
+#include "ready_queue.h"
+#include "poller.h"
+#include "file_cache.h"
+#include "cold_io.h"
+#include "neg_cache.h"
+#include "doc_tree.h"
+#include "asset_bundle.h"
 #define MAX_FD 65536
 #define MAX_EVENT_NUMBER 10000
 
 extern int addfd(int epollfd, int fd, bool one_shot);
 extern int removefd(int epollfd, int fd);
+extern const char *doc_root;
 
 void addsig(int sig, void(handler)(int), bool restart = true)
 {
@@ -22,28 +43,256 @@ void addsig(int sig, void(handler)(int), bool restart = true)
 	assert(sigaction(sig, &sa, NULL) != -1);
 }
 
-void show_error(int connfd, const char *text)
+int main(int argc, char* argv[])
 {
-	cout << text << endl;
-	send(connfd, text, strlen(text), 0);
-	close(connfd);
-}
-
-int main(int argc, char* arhv[])
-{
-	//if(argc<=2)
-	//	 cout<<"usage: "<<argv[0]<<" ip address port_number";
 	// const char *ip = "127.0.0.1";
 	int port = 3000;
 
+	int opt;
+	const char *log_path = NULL;
+	bool log_binary = false;
+	const char *trace_spec = NULL;
+	const char *capture_spec = NULL;
+	bool has_route = false;
+	int shards = -1;
+	//主线程和工作线程(或每核线程)绑定的CPU,为空时不绑定
+	vector<int> reactor_cpus, worker_cpus;
+	bool use_completion = false;
+	//AF_UNIX监听socket的路径,可以有多个
+	vector<const char *> unix_paths;
+	//读取不在页缓存中的文件的I/O线程数和队列长度
+	int io_threads = 2, io_queue = 256;
+	//不存在的路径的缓存的槽数
+	int neg_slots = 65536;
+	//包文件,如 -R site.bundle:populate
+	const char *bundle_spec = NULL;
+	affinity::init();
+	while ((opt = getopt(argc, argv, "p:r:w:l:bt:C:os:a:A:qB:D:F:W:P:U:T:I:N:R:")) != -1)
+	{
+		switch (opt)
+		{
+			case 'p':
+				//-p 0时不监听TCP端口,只使用-U
+				port = atoi(optarg);
+				break;
+			case 'U':
+				//同机的前端代理通过AF_UNIX socket连接,不经过TCP协议栈
+				unix_paths.push_back(optarg);
+				break;
+			case 'r':
+				//反向代理路由,如 -r /api=unix:/tmp/api.sock,127.0.0.1:8080
+				if (!proxy_add_route(optarg))
+				{
+					cout << "bad route: " << optarg << endl;
+					return 1;
+				}
+				has_route = true;
+				break;
+			case 'w':
+			{
+				//WebSocket写队列上限和慢连接策略,如 -w 256:close
+				const char *policy = strchr(optarg, ':');
+				ws_hub::set_limit(atoi(optarg), (policy && strcmp(policy + 1, "close") == 0) ? WS_CLOSE_SLOW : WS_DROP_NEWEST);
+				break;
+			}
+			case 'l':
+				//访问日志文件,"-"表示标准输出
+				log_path = optarg;
+				break;
+			case 'b':
+				//访问日志使用二进制格式
+				log_binary = true;
+				break;
+			case 't':
+				//请求跟踪,如 -t 100:50 每100个请求采样一个,并记录所有超过50毫秒的请求
+				trace_spec = optarg;
+				break;
+			case 'o':
+				//用协程处理连接
+				http_conn::m_coroutine = true;
+				break;
+			case 's':
+				//每核一个线程,如 -s 0 每个在线CPU一个线程
+				shards = atoi(optarg);
+				break;
+			case 'a':
+			case 'A':
+				//如 -a 0 -A 1-7,或 -A irq:eth0 按网卡中断所在的CPU绑定工作线程
+				if (!affinity::parse(optarg, opt == 'a' ? reactor_cpus : worker_cpus))
+				{
+					cout << "bad cpu list: " << optarg << endl;
+					return 1;
+				}
+				break;
+			case 'q':
+				//工作线程经过完成队列交给主线程重新注册事件
+				use_completion = true;
+				break;
+			case 'B':
+				//listen的队列长度
+				listener::m_backlog = atoi(optarg);
+				break;
+			case 'D':
+				//TCP_DEFER_ACCEPT的秒数,客户发来请求后才接受连接
+				listener::m_defer_secs = atoi(optarg);
+				break;
+			case 'F':
+				//TCP_FASTOPEN的队列长度
+				listener::m_fastopen_qlen = atoi(optarg);
+				break;
+			case 'P':
+				//低延迟模式,阻塞之前先自旋spin_us微秒,忙轮询的时间默认与自旋相同
+				poller::m_spin_us = atoi(optarg);
+				poller::m_busy_poll_us = strchr(optarg, ':') ? atoi(strchr(optarg, ':') + 1) : poller::m_spin_us;
+				break;
+			case 'T':
+			{
+				//静态文件按大小选择发送方式的两个界限,以及共享映射缓存的大小
+				char *end;
+				http_conn::m_inline_max = strtol(optarg, &end, 10);
+				if (*end == ':')
+					http_conn::m_sendfile_min = strtoll(end + 1, &end, 10);
+				if (*end == ':')
+					file_cache::m_capacity = (size_t)strtol(end + 1, &end, 10) * 1024 * 1024;
+				if (http_conn::m_inline_max > http_conn::INLINE_FILE_MAX)
+				{
+					cout << "inline_max is at most " << http_conn::INLINE_FILE_MAX << endl;
+					return 1;
+				}
+				break;
+			}
+			case 'I':
+				//-I 0时不检查页缓存,发送时直接阻塞读取
+				io_threads = atoi(optarg);
+				if (strchr(optarg, ':'))
+					io_queue = atoi(strchr(optarg, ':') + 1);
+				break;
+			case 'N':
+				//-N 0时不缓存不存在的路径
+				neg_slots = atoi(optarg);
+				break;
+			case 'R':
+				//由bundle_pack生成的包文件,populate为启动时读入全部内容,huge为使用透明大页
+				bundle_spec = optarg;
+				break;
+			case 'W':
+				//一次write()最多发送的字节数,0为不限制
+				http_conn::m_write_budget = atoi(optarg);
+				break;
+			case 'C':
+				//流量录制,如 -C web.cap:512 录制到web.cap,文件达到512MB时停止
+				capture_spec = optarg;
+				break;
+			default:
+				cout << "usage: " << argv[0] << " [-p port] [-U unix_path]... [-r /prefix=unix:/path,host:port] [-w max_queue[:drop|close]] [-l access_log [-b]] [-t sample_every[:slow_ms]] [-C capture_file[:max_mb]] [-o | -s shards] [-a reactor_cpus] [-A worker_cpus|irq:ifname] [-q] [-B backlog] [-D defer_secs] [-F fastopen_qlen] [-W write_budget] [-P spin_us[:busy_poll_us]] [-T inline_max:sendfile_min[:cache_mb]] [-I io_threads[:queue]] [-N negative_cache_slots] [-R bundle[:populate][:huge]]" << endl;
+				return 1;
+		}
+	}
+
 	//忽略SIGPIPE的信号
-	// addsig(SIGPIPE, SIG_IGN);
+	addsig(SIGPIPE, SIG_IGN);
+	metrics::init();
+	if (trace_spec)
+	{
+#ifdef WEB_TRACE
+		const char *slow = strchr(trace_spec, ':');
+		if (!tracer::open("web.trace", atoi(trace_spec), slow ? atoi(slow + 1) : 0))
+		{
+			cout << "open web.trace fail" << endl;
+			return 1;
+		}
+#else
+		cout << "tracing is not compiled in, rebuild with make FLAGS=-DWEB_TRACE" << endl;
+		return 1;
+#endif
+	}
+
+	if (log_path && !access_log::open(log_path, log_binary))
+	{
+		cout << "open access log fail: " << log_path << endl;
+		return 1;
+	}
+
+	if (capture_spec)
+	{
+		string path(capture_spec);
+		int max_mb = 0;
+		size_t colon = path.rfind(':');
+		if (colon != string::npos)
+		{
+			max_mb = atoi(path.c_str() + colon + 1);
+			path.erase(colon);
+		}
+		if (!capture::open(path.c_str(), max_mb))
+		{
+			cout << "open capture file fail: " << path << endl;
+			return 1;
+		}
+	}
+
+	if (!cold_io::init(io_threads, io_queue))
+	{
+		cout << "create io threads fail" << endl;
+		return 1;
+	}
+
+	if (!doc_tree::init(doc_root))
+	{
+		cout << "open " << doc_root << " fail: " << strerror(errno) << endl;
+		return 1;
+	}
+	//监视失败时只是不缓存,不影响服务
+	if (!neg_cache::init(doc_root, neg_slots))
+		cout << "inotify fail, negative cache disabled" << endl;
+	if (bundle_spec && !asset_bundle::init(bundle_spec))
+	{
+		cout << "load bundle " << bundle_spec << " fail" << endl;
+		return 1;
+	}
+
+	vector<int> unix_fds;
+	for (size_t i = 0; i < unix_paths.size(); i++)
+	{
+		int fd = listener::open_unix(unix_paths[i]);
+		if (fd < 0)
+		{
+			cout << "listen on " << unix_paths[i] << " fail: " << strerror(errno) << endl;
+			return 1;
+		}
+		unix_fds.push_back(fd);
+	}
+	if (port <= 0 && unix_fds.empty())
+	{
+		cout << "no listener, use -p port or -U path" << endl;
+		return 1;
+	}
+
+	if (shards >= 0)
+	{
+		if (has_route || http_conn::m_coroutine)
+		{
+			cout << "-s cannot be used with -r or -o" << endl;
+			return 1;
+		}
+		//-s 0时每个在线CPU一个线程,指定了-A时每个CPU一个线程
+		if (shards == 0)
+			shards = worker_cpus.empty() ? sysconf(_SC_NPROCESSORS_ONLN) : worker_cpus.size();
+		http_conn *user = new http_conn[MAX_FD];
+		affinity::bind_memory(user, sizeof(http_conn) * MAX_FD, worker_cpus);
+		return shard::run(port, unix_fds, shards > 0 ? shards : 1, worker_cpus, user, MAX_FD);
+	}
+
+	if (!reactor_cpus.empty() && !affinity::pin(pthread_self(), reactor_cpus))
+	{
+		cout << "pin reactor fail" << endl;
+		return 1;
+	}
 
 	//创建线程池
 	threadpool<http_conn> *pool = NULL;
 	try
 	{
-		pool = new threadpool<http_conn>;
+		pool = new threadpool<http_conn>(8, 1000, worker_cpus);
 	}
 	catch (...)
 	{
@@ -51,73 +300,109 @@ int main(int argc, char* arhv[])
 	}
 
 	//预先为每个可能的客户连接分配一个http_conn对象
+	//连接对象在主线程中初始化,在工作线程中处理,物理页按这些线程所在的NUMA节点分配
 	http_conn *user = new http_conn[MAX_FD];
 	assert(user);
+	http_conn::m_pool = pool;
+	vector<int> conn_cpus(reactor_cpus);
+	conn_cpus.insert(conn_cpus.end(), worker_cpus.begin(), worker_cpus.end());
+	affinity::bind_memory(user, sizeof(http_conn) * MAX_FD, conn_cpus);
 	int user_count = 0;
 
-	int listenfd = socket(PF_INET, SOCK_STREAM, 0);
-	assert(listenfd >= 0);
-	struct linger tmp = {1, 0};
-	setsockopt(listenfd, SOL_SOCKET, SO_LINGER, &tmp, sizeof(tmp));
-
-	int ret = 0;
-	struct sockaddr_in ser;
-	bzero(&ser, sizeof(ser));
-	ser.sin_family = AF_INET;
-	ser.sin_addr.s_addr = htonl(INADDR_ANY); 
-	// inet_pton(AF_INET, ip, &ser.sin_addr);
-	ser.sin_port = htons(port);
-
-	ret = bind(listenfd, (struct sockaddr *)&ser, sizeof(ser));
-	assert(ret >= 0);
-
-	ret = listen(listenfd, 5);
-	assert(ret >= 0);
+	//TCP和AF_UNIX的监听socket,接受的连接在http_conn中按同样的方式处理
+	vector<int> listenfds(unix_fds);
+	if (port > 0)
+	{
+		int listenfd = listener::open(port, false);
+		if (listenfd < 0)
+		{
+			cout << "listen fail: " << strerror(errno) << endl;
+			return 1;
+		}
+		listenfds.push_back(listenfd);
+	}
 
-	epoll_event events[MAX_EVENT_NUMBER];
 	int epollfd = epoll_create(5);
 	assert(epollfd != -1);
-	addfd(epollfd, listenfd, false);
+	for (size_t i = 0; i < listenfds.size(); i++)
+		addfd(epollfd, listenfds[i], false);
 	http_conn::m_epollfd = epollfd;
+	if (!sse_hub::init(epollfd) || (use_completion && !completion_queue::init(epollfd)))
+	{
+		cout << "eventfd fail" << endl;
+		return 1;
+	}
+	ready_queue::init();
+	poller loop(epollfd, MAX_EVENT_NUMBER);
+	epoll_event *events = loop.events();
 
 	while (true)
 	{
-		int num = epoll_wait(epollfd, events, MAX_EVENT_NUMBER, -1);
+		//就绪队列中还有连接等待发送时不阻塞
+		int num = loop.wait(!ready_queue::empty());
 		if (num < 0 && errno != EINTR)
 		{
 			cout << "epoll_wait fail" << endl;
 			break;
 		}
+		uint64_t loop_begin = metrics::now();
 		for (int i = 0; i < num; i++)
 		{
 			int sockfd = events[i].data.fd;
-			if (sockfd == listenfd)
+			upstream_conn *upstream = NULL;
+			if (find(listenfds.begin(), listenfds.end(), sockfd) != listenfds.end())
 			{
-				struct sockaddr_in cli;
-				socklen_t len = sizeof(cli);
-				int connfd = accept(listenfd, (struct sockaddr *)&cli, &len);
-				if (connfd < 0)
-				{
-					cout << "connect failed" << endl;
-					continue;
-				}
-				if (http_conn::m_user_count >= MAX_FD)
+				//监听socket是边沿触发,接受所有等待的连接
+				struct sockaddr_storage cli;
+				int connfd;
+				while ((connfd = listener::accept(sockfd, &cli, MAX_FD)) >= 0)
 				{
-					show_error(connfd, "internet busy");
-					continue;
+					metrics::add(COUNTER_ACCEPTS);
+					//初始化客户连接,添加到用户数组
+					user[connfd].init(connfd, cli);
 				}
-				//初始化客户连接,添加到用户数组
-				user[connfd].init(connfd, cli);
+			}
+			else if (sockfd == completion_queue::eventfd())
+			{
+				//工作线程处理完的连接,重新注册它们的事件
+				completion_queue::drain();
+			}
+			else if (sockfd == sse_hub::eventfd())
+			{
+				//有频道发布了新事件
+				sse_hub::dispatch();
+			}
+			else if (sockfd == sse_hub::timerfd())
+			{
+				//结束到期的长轮询
+				sse_hub::expire();
+			}
+			else if ((upstream = upstream_conn::find(sockfd)) != NULL)
+			{
+				//反向代理中到后端的连接
+				upstream->handle_event(events[i].events);
 			}
 			else if (events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR))
 			{
 				//如果有异常,直接关闭客户连接
 				user[sockfd].close_conn();
 			}
+			else if (user[sockfd].coroutine())
+			{
+				//协程在工作线程中自己读写,主线程只负责唤醒
+				pool->append(user + sockfd);
+			}
 			else if (events[i].events & EPOLLIN)
 			{
+				//WebSocket连接的帧直接在主线程中处理
+				ws_session *ws = user[sockfd].websocket();
+				if (ws)
+				{
+					if (!ws->on_readable())
+						user[sockfd].close_conn();
+				}
 				//根据读的结果,决定是否将任务添加到线程池,还是关闭连接
-				if (user[sockfd].read())
+				else if (user[sockfd].read())
 					pool->append(user + sockfd);//sockfd同时是下标,这里就是计算sockfd个偏移
 				else
 					user[sockfd].close_conn();
@@ -131,9 +416,13 @@ int main(int argc, char* arhv[])
 			else
 			{}
 		}
+		//本轮的事件处理完后,就绪队列中的连接依次再发送一份预算
+		ready_queue::run();
+		metrics::record(STAGE_LOOP, metrics::now() - loop_begin);
 	}
 	close(epollfd);
-	close(listenfd);
+	for (size_t i = 0; i < listenfds.size(); i++)
+		close(listenfds[i]);
 	delete[] user;
 	delete[] pool;
 	return 0;
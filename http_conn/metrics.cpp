@@ -0,0 +1,205 @@
+#include "metrics.h"
+#include "access_log.h"
+#include "file_cache.h"
+#include "asset_bundle.h"
+#include <pthread.h>
+#include <unistd.h>
+
+static const char *stage_names[STAGE_COUNT] = {"loop", "read", "queue", "parse", "do_request", "write", "request", "cold_read"};
+
+//导出时使用的桶边界(纳秒),细分的桶按上界换算成纳秒后归入不小于它的第一个边界
+static const uint64_t export_bounds[] = {
+	1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000,
+	1000000, 2500000, 5000000, 10000000, 25000000, 50000000, 100000000, 250000000, 500000000,
+	1000000000, 2500000000ULL, 5000000000ULL, 10000000000ULL};
+
+metrics_shard *metrics::m_shards[MAX_SHARDS];
+atomic<int> metrics::m_shard_count(0);
+double metrics::m_ns_per_tick = 1.0;
+
+static uint64_t monotonic_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void metrics::init()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	//用20毫秒的间隔校准TSC频率,相对误差在十万分之一量级
+	uint64_t ns0 = monotonic_ns();
+	uint64_t tsc0 = now();
+	usleep(20000);
+	uint64_t ns1 = monotonic_ns();
+	uint64_t tsc1 = now();
+	if (tsc1 > tsc0)
+		m_ns_per_tick = (double)(ns1 - ns0) / (tsc1 - tsc0);
+#endif
+}
+
+metrics_shard *metrics::new_shard()
+{
+	//每个线程只分配一次
+	static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+	pthread_mutex_lock(&lock);
+	metrics_shard *shard = NULL;
+	int count = m_shard_count.load(memory_order_relaxed);
+	if (count < MAX_SHARDS)
+	{
+		shard = new metrics_shard();
+		shard->thread = pthread_self();
+		//最后一个分片从一开始就按共用处理,之后的线程都写入它
+		shard->shared = count == MAX_SHARDS - 1;
+		m_shards[count] = shard;
+		m_shard_count.store(count + 1, memory_order_release);
+	}
+	else
+		shard = m_shards[MAX_SHARDS - 1];
+	pthread_mutex_unlock(&lock);
+	return shard;
+}
+
+void metrics::request_done(int status, uint64_t bytes, uint64_t ticks)
+{
+	record(STAGE_REQUEST, ticks);
+	add(COUNTER_REQUESTS);
+	add((status >= 100 && status < 600) ? (METRIC_COUNTER)(COUNTER_STATUS_1XX + status / 100 - 1) : COUNTER_ABORTED);
+	add(COUNTER_BYTES_SENT, bytes);
+	metrics_shard *s = shard();
+	METRICS_ADD(s->shared, s->node_requests[affinity::current_node()], 1);
+}
+
+static void append(string &out, const char *format, ...)
+{
+	char buf[256];
+	va_list arg;
+	va_start(arg, format);
+	int len = vsnprintf(buf, sizeof(buf), format, arg);
+	va_end(arg);
+	out.append(buf, (len < (int)sizeof(buf)) ? len : sizeof(buf) - 1);
+}
+
+//线程绑定的CPU和所在的NUMA节点,连接对象的内存策略,以及各节点完成的请求数
+//线程的角色取自线程名(web-worker,web-shard,web-io),主线程(事件循环或第0个每核线程)为main,没有绑定时cpu和node为"any"
+void metrics::render_numa(string &out, int count)
+{
+	append(out, "# TYPE webserver_thread_info gauge\n");
+	for (int i = 0; i < count; i++)
+	{
+		char name[16] = "";
+		pthread_getname_np(m_shards[i]->thread, name, sizeof(name));
+		const char *role = (strncmp(name, "web-", 4) == 0) ? name + 4 : "main";
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		pthread_getaffinity_np(m_shards[i]->thread, sizeof(set), &set);
+		int cpu = -1;
+		if (CPU_COUNT(&set) == 1)
+			for (int c = 0; c < CPU_SETSIZE && cpu < 0; c++)
+				if (CPU_ISSET(c, &set))
+					cpu = c;
+		if (cpu >= 0)
+			append(out, "webserver_thread_info{thread=\"%d\",role=\"%s\",cpu=\"%d\",node=\"%d\"} 1\n", i, role, cpu, affinity::cpu_node(cpu));
+		else
+			append(out, "webserver_thread_info{thread=\"%d\",role=\"%s\",cpu=\"any\",node=\"any\"} 1\n", i, role);
+	}
+	append(out, "# TYPE webserver_conn_memory_info gauge\nwebserver_conn_memory_info{policy=\"%s\",nodes=\"%s\"} 1\n",
+		   affinity::memory_policy(), affinity::memory_nodes());
+	append(out, "# TYPE webserver_node_requests_total counter\n");
+	for (int node = 0; node < affinity::node_count(); node++)
+	{
+		uint64_t total = 0;
+		for (int i = 0; i < count; i++)
+			total += METRICS_LOAD(m_shards[i]->node_requests[node]);
+		append(out, "webserver_node_requests_total{node=\"%d\"} %llu\n", node, (unsigned long long)total);
+	}
+}
+
+void metrics::render(string &out)
+{
+	int count = m_shard_count.load(memory_order_acquire);
+	uint64_t counters[COUNTER_COUNT] = {0};
+	for (int i = 0; i < count; i++)
+		for (int j = 0; j < COUNTER_COUNT; j++)
+			counters[j] += METRICS_LOAD(m_shards[i]->counters[j]);
+
+	append(out, "# TYPE webserver_connections gauge\nwebserver_connections %d\n", http_conn::m_user_count.load());
+	append(out, "# TYPE webserver_accepts_total counter\nwebserver_accepts_total %llu\n", (unsigned long long)counters[COUNTER_ACCEPTS]);
+	append(out, "# TYPE webserver_accept_rejected_total counter\nwebserver_accept_rejected_total %llu\n", (unsigned long long)counters[COUNTER_ACCEPT_REJECTED]);
+	append(out, "# TYPE webserver_closes_total counter\nwebserver_closes_total %llu\n", (unsigned long long)counters[COUNTER_CLOSES]);
+	append(out, "# TYPE webserver_requests_total counter\nwebserver_requests_total %llu\n", (unsigned long long)counters[COUNTER_REQUESTS]);
+	append(out, "# TYPE webserver_sent_bytes_total counter\nwebserver_sent_bytes_total %llu\n", (unsigned long long)counters[COUNTER_BYTES_SENT]);
+	append(out, "# TYPE webserver_responses_total counter\n");
+	for (int i = 0; i < 5; i++)
+		append(out, "webserver_responses_total{code=\"%dxx\"} %llu\n", i + 1, (unsigned long long)counters[COUNTER_STATUS_1XX + i]);
+	append(out, "# TYPE webserver_aborted_requests_total counter\nwebserver_aborted_requests_total %llu\n", (unsigned long long)counters[COUNTER_ABORTED]);
+	append(out, "# TYPE webserver_completions_total counter\nwebserver_completions_total %llu\n", (unsigned long long)counters[COUNTER_COMPLETIONS]);
+	append(out, "# TYPE webserver_completion_wakeups_total counter\nwebserver_completion_wakeups_total %llu\n", (unsigned long long)counters[COUNTER_COMPLETION_WAKEUPS]);
+	append(out, "# TYPE webserver_write_yields_total counter\nwebserver_write_yields_total %llu\n", (unsigned long long)counters[COUNTER_WRITE_YIELDS]);
+	append(out, "# TYPE webserver_epoll_polls_total counter\nwebserver_epoll_polls_total{result=\"empty\"} %llu\nwebserver_epoll_polls_total{result=\"events\"} %llu\n",
+		   (unsigned long long)counters[COUNTER_POLL_EMPTY], (unsigned long long)counters[COUNTER_POLL_PRODUCTIVE]);
+	append(out, "# TYPE webserver_epoll_blocking_waits_total counter\nwebserver_epoll_blocking_waits_total %llu\n", (unsigned long long)counters[COUNTER_POLL_BLOCKS]);
+	append(out, "# TYPE webserver_epoll_events_total counter\nwebserver_epoll_events_total %llu\n", (unsigned long long)counters[COUNTER_POLL_EVENTS]);
+	append(out, "# TYPE webserver_static_requests_total counter\nwebserver_static_requests_total{tier=\"inline\"} %llu\n"
+				"webserver_static_requests_total{tier=\"mapped\"} %llu\nwebserver_static_requests_total{tier=\"sendfile\"} %llu\n",
+		   (unsigned long long)counters[COUNTER_TIER_INLINE], (unsigned long long)counters[COUNTER_TIER_MAPPED], (unsigned long long)counters[COUNTER_TIER_SENDFILE]);
+	append(out, "# TYPE webserver_cold_reads_total counter\nwebserver_cold_reads_total %llu\n", (unsigned long long)counters[COUNTER_COLD_READS]);
+	append(out, "# TYPE webserver_cold_read_bytes_total counter\nwebserver_cold_read_bytes_total %llu\n", (unsigned long long)counters[COUNTER_COLD_BYTES]);
+	append(out, "# TYPE webserver_cold_read_overflows_total counter\nwebserver_cold_read_overflows_total %llu\n", (unsigned long long)counters[COUNTER_COLD_OVERFLOWS]);
+	append(out, "# TYPE webserver_negative_cache_hits_total counter\nwebserver_negative_cache_hits_total %llu\n", (unsigned long long)counters[COUNTER_NEG_HITS]);
+	append(out, "# TYPE webserver_negative_cache_invalidations_total counter\nwebserver_negative_cache_invalidations_total %llu\n", (unsigned long long)counters[COUNTER_NEG_INVALIDATIONS]);
+	append(out, "# TYPE webserver_file_cache_maps_total counter\nwebserver_file_cache_maps_total %llu\n", (unsigned long long)counters[COUNTER_FILE_CACHE_MAPS]);
+	append(out, "# TYPE webserver_file_cache_bytes gauge\nwebserver_file_cache_bytes %llu\n", (unsigned long long)file_cache::mapped_bytes());
+	append(out, "# TYPE webserver_file_cache_entries gauge\nwebserver_file_cache_entries %llu\n", (unsigned long long)file_cache::entries());
+	append(out, "# TYPE webserver_bundle_hits_total counter\nwebserver_bundle_hits_total %llu\n", (unsigned long long)counters[COUNTER_BUNDLE_HITS]);
+	append(out, "# TYPE webserver_bundle_swaps_total counter\nwebserver_bundle_swaps_total %llu\n", (unsigned long long)counters[COUNTER_BUNDLE_SWAPS]);
+	append(out, "# TYPE webserver_bundle_reload_failures_total counter\nwebserver_bundle_reload_failures_total %llu\n", (unsigned long long)counters[COUNTER_BUNDLE_RELOAD_FAILS]);
+	append(out, "# TYPE webserver_upstream_downs_total counter\nwebserver_upstream_downs_total %llu\n", (unsigned long long)counters[COUNTER_UPSTREAM_DOWNS]);
+	append(out, "# TYPE webserver_bundle_entries gauge\nwebserver_bundle_entries %llu\n", (unsigned long long)asset_bundle::entries());
+	append(out, "# TYPE webserver_bundle_bytes gauge\nwebserver_bundle_bytes %llu\n", (unsigned long long)asset_bundle::bytes());
+	append(out, "# TYPE webserver_access_log_dropped_total counter\nwebserver_access_log_dropped_total %llu\n", (unsigned long long)access_log::dropped());
+
+	render_numa(out, count);
+
+	append(out, "# TYPE webserver_stage_seconds histogram\n");
+	for (int stage = 0; stage < STAGE_COUNT; stage++)
+	{
+		uint64_t buckets[metrics_histogram::BUCKETS] = {0};
+		uint64_t sum = 0;
+		for (int i = 0; i < count; i++)
+		{
+			const metrics_histogram &h = m_shards[i]->stages[stage];
+			for (int j = 0; j < metrics_histogram::BUCKETS; j++)
+				buckets[j] += h.count(j);
+			sum += h.sum();
+		}
+		uint64_t total = 0;
+		int j = 0;
+		for (size_t b = 0; b < sizeof(export_bounds) / sizeof(export_bounds[0]); b++)
+		{
+			for (; j < metrics_histogram::BUCKETS && to_ns(metrics_histogram::upper_bound(j)) <= export_bounds[b]; j++)
+				total += buckets[j];
+			append(out, "webserver_stage_seconds_bucket{stage=\"%s\",le=\"%g\"} %llu\n",
+				   stage_names[stage], export_bounds[b] / 1e9, (unsigned long long)total);
+		}
+		for (; j < metrics_histogram::BUCKETS; j++)
+			total += buckets[j];
+		append(out, "webserver_stage_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %llu\n", stage_names[stage], (unsigned long long)total);
+		append(out, "webserver_stage_seconds_sum{stage=\"%s\"} %.9f\n", stage_names[stage], to_ns(sum) / 1e9);
+		append(out, "webserver_stage_seconds_count{stage=\"%s\"} %llu\n", stage_names[stage], (unsigned long long)total);
+	}
+}
+
+bool metrics_producer::produce(http_conn *conn)
+{
+	while (m_offset < m_text.size())
+	{
+		int len = m_text.size() - m_offset;
+		if (len > conn->chunk_room())
+			len = conn->chunk_room();
+		if (len <= 0 || !conn->push_chunk(m_text.data() + m_offset, len))
+			return false;
+		m_offset += len;
+	}
+	return true;
+}
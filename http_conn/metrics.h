@@ -0,0 +1,216 @@
+#ifndef METRICS_H_
+#define METRICS_H_
+
+#include <stdint.h>
+#include <time.h>
+#include <atomic>
+#include <string>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#include "http_conn.h"
+#include "affinity.h"
+
+using namespace std;
+
+//需要统计耗时的处理阶段
+enum METRIC_STAGE
+{
+	STAGE_LOOP = 0,		//主线程处理一次epoll_wait返回的所有事件
+	STAGE_READ,			//http_conn::read()
+	STAGE_QUEUE,		//请求在线程池队列中等待
+	STAGE_PARSE,		//process_read()中解析请求的部分
+	STAGE_DO_REQUEST,	//do_request()
+	STAGE_WRITE,		//一次http_conn::write()
+	STAGE_REQUEST,		//从收到请求第一个字节到应答发送完毕
+	STAGE_COLD_READ,	//不在页缓存中的文件内容从交给I/O线程到读完
+	STAGE_COUNT
+};
+
+//计数器
+enum METRIC_COUNTER
+{
+	COUNTER_ACCEPTS = 0,
+	//超过fd上限,接受后立即关闭的连接
+	COUNTER_ACCEPT_REJECTED,
+	COUNTER_CLOSES,
+	COUNTER_REQUESTS,
+	COUNTER_BYTES_SENT,
+	//按状态码分类的应答数,依次为1xx到5xx,状态码为0(应答未完成)记入COUNTER_ABORTED
+	COUNTER_STATUS_1XX,
+	COUNTER_STATUS_2XX,
+	COUNTER_STATUS_3XX,
+	COUNTER_STATUS_4XX,
+	COUNTER_STATUS_5XX,
+	COUNTER_ABORTED,
+	//工作线程放入完成队列的连接数,以及为此唤醒主线程的次数
+	COUNTER_COMPLETIONS,
+	COUNTER_COMPLETION_WAKEUPS,
+	//write()用完发送预算后让出事件循环的次数
+	COUNTER_WRITE_YIELDS,
+	//事件循环的epoll_wait:自旋或不阻塞时没有事件,有事件,阻塞等待的次数,以及取到的事件总数
+	COUNTER_POLL_EMPTY,
+	COUNTER_POLL_PRODUCTIVE,
+	COUNTER_POLL_BLOCKS,
+	COUNTER_POLL_EVENTS,
+	//各种发送方式的静态文件请求数,以及映射缓存新映射的文件数
+	COUNTER_TIER_INLINE,
+	COUNTER_TIER_MAPPED,
+	COUNTER_TIER_SENDFILE,
+	COUNTER_FILE_CACHE_MAPS,
+	//交给I/O线程的冷读次数和字节数,以及I/O线程池队列满而在原线程中阻塞读取的次数
+	COUNTER_COLD_READS,
+	COUNTER_COLD_BYTES,
+	COUNTER_COLD_OVERFLOWS,
+	//由负缓存直接返回404的请求数,以及负缓存因目录变化整体失效的次数
+	COUNTER_NEG_HITS,
+	COUNTER_NEG_INVALIDATIONS,
+	//由包文件直接应答的请求数(含304),包文件被替换的次数,以及新的包加载失败而继续使用原来的包的次数
+	COUNTER_BUNDLE_HITS,
+	COUNTER_BUNDLE_SWAPS,
+	COUNTER_BUNDLE_RELOAD_FAILS,
+	//后端连续失败而被标记为不可用的次数
+	COUNTER_UPSTREAM_DOWNS,
+	COUNTER_COUNT
+};
+
+//对数线性分桶的直方图(类似HDR Histogram),每个2的幂区间分为8个桶,相对误差不超过12.5%
+//值的单位是metrics::now()的时钟周期,导出时才换算为秒
+//只有所属线程写入,写入时不需要原子的读改写操作,其他线程可以随时读取
+//计数用__atomic内建函数的relaxed读写,不优化编译时也不会产生函数调用
+#define METRICS_LOAD(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define METRICS_INC(x, n) __atomic_store_n(&(x), __atomic_load_n(&(x), __ATOMIC_RELAXED) + (n), __ATOMIC_RELAXED)
+//多个线程共用的分片(见metrics::MAX_SHARDS)必须用原子加,否则同时写入时丢失计数
+#define METRICS_ADD(shared, x, n) ((shared) ? (void)__atomic_fetch_add(&(x), (n), __ATOMIC_RELAXED) : (void)METRICS_INC(x, n))
+
+class metrics_histogram
+{
+public:
+	//3GHz时覆盖0到约180秒
+	static const int BUCKETS = 304;
+
+	//shared为true时直方图所在的分片由多个线程共用
+	void record(uint64_t ticks, bool shared)
+	{
+		int index = bucket(ticks);
+		METRICS_ADD(shared, m_counts[index], 1);
+		METRICS_ADD(shared, m_sum, ticks);
+	}
+	uint64_t count(int index) const { return METRICS_LOAD(m_counts[index]); }
+	uint64_t sum() const { return METRICS_LOAD(m_sum); }
+
+	static int bucket(uint64_t ticks)
+	{
+		if (ticks < 8)
+			return ticks;
+		int msb = 63 - __builtin_clzll(ticks);
+		int index = (msb - 2) * 8 + ((ticks >> (msb - 3)) & 7);
+		return (index < BUCKETS) ? index : BUCKETS - 1;
+	}
+	//桶的上界(不含)
+	static uint64_t upper_bound(int index)
+	{
+		if (index < 8)
+			return index + 1;
+		int shift = index / 8 - 1;
+		return (uint64_t)(8 + index % 8 + 1) << shift;
+	}
+
+private:
+	uint64_t m_counts[BUCKETS];
+	uint64_t m_sum;
+};
+
+//一个线程的统计数据
+struct metrics_shard
+{
+	metrics_histogram stages[STAGE_COUNT];
+	uint64_t counters[COUNTER_COUNT];
+	//按完成请求时所在的NUMA节点统计的请求数
+	uint64_t node_requests[affinity::MAX_NODES];
+	//所属线程,导出时读取线程名和绑定的CPU
+	pthread_t thread;
+	//是否由多个线程共用
+	bool shared;
+};
+
+//运行时统计,每个线程写入自己的分片,/metrics请求时才合并所有分片
+class metrics
+{
+public:
+	//最多的分片数,超过的线程共用最后一个分片,这个分片用原子加,只是比其他分片慢
+	static const int MAX_SHARDS = 64;
+
+	//启动时调用一次,校准时钟周期与纳秒的换算关系
+	static void init();
+	//当前时间,x86上为TSC的时钟周期数,比clock_gettime便宜,其他平台为纳秒
+	static uint64_t now()
+	{
+#if defined(__x86_64__) || defined(__i386__)
+		return __rdtsc();
+#else
+		struct timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+	}
+	static uint64_t to_ns(uint64_t ticks) { return ticks * m_ns_per_tick; }
+	static double ns_per_tick() { return m_ns_per_tick; }
+	static void record(METRIC_STAGE stage, uint64_t ticks)
+	{
+		metrics_shard *s = shard();
+		s->stages[stage].record(ticks, s->shared);
+	}
+	static void add(METRIC_COUNTER counter, uint64_t n = 1)
+	{
+		metrics_shard *s = shard();
+		METRICS_ADD(s->shared, s->counters[counter], n);
+	}
+	//记录一个请求结束
+	static void request_done(int status, uint64_t bytes, uint64_t ticks);
+
+	//合并所有分片,生成Prometheus文本格式
+	static void render(string &out);
+
+private:
+	static metrics_shard *shard()
+	{
+		static __thread metrics_shard *local = NULL;
+		if (!local)
+			local = new_shard();
+		return local;
+	}
+	static metrics_shard *new_shard();
+	static void render_numa(string &out, int count);
+
+private:
+	static metrics_shard *m_shards[MAX_SHARDS];
+	static atomic<int> m_shard_count;
+	static double m_ns_per_tick;
+};
+
+//作用域计时,析构时记录到对应阶段的直方图
+class metrics_timer
+{
+public:
+	metrics_timer(METRIC_STAGE stage) : m_stage(stage), m_begin(metrics::now()) {}
+	~metrics_timer() { metrics::record(m_stage, metrics::now() - m_begin); }
+
+private:
+	METRIC_STAGE m_stage;
+	uint64_t m_begin;
+};
+
+//GET /metrics的应答,生成时合并一次,之后分块发送
+class metrics_producer : public stream_producer
+{
+public:
+	metrics_producer() : m_offset(0) { metrics::render(m_text); }
+	bool produce(http_conn *conn);
+
+private:
+	string m_text;
+	size_t m_offset;
+};
+
+#endif
@@ -0,0 +1,538 @@
+//热点代码的微基准测试,直接链接服务器的目标文件,测量与web相同编译选项下的代码
+//用法: ./micro_bench [-m min_ms] [-r runs] [-t thread_counts] [-b filter] [-c corpus_file]
+//  -m 每轮至少运行的毫秒数,默认200
+//  -r 重复的轮数,输出最小值,中位数和最大值,默认5
+//  -t 线程池和锁竞争测试的线程数列表,默认1,2,4,8
+//  -b 只运行名称包含该字符串的测试
+//  -c 请求语料文件,内容为原样拼接的HTTP请求(以空行分隔,不含消息体),默认使用内置的请求
+//每个测试输出一行JSON,如 make micro_bench && ./micro_bench > before.json
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include "http_conn.h"
+#include "threadpool.h"
+#include "locker.h"
+#include "proxy.h"
+
+using namespace std;
+
+static long long now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static long long min_ns = 200 * 1000000LL;
+static int runs = 5;
+static vector<int> thread_counts;
+static const char *filter = NULL;
+
+//一个测试执行iters次操作,param为测试的参数
+typedef void (*bench_fn)(long long iters, void *param);
+
+//先找到使一轮运行至少min_ns的迭代次数,再按该次数重复runs轮
+static void run_bench(const char *name, const char *param, bench_fn fn, void *arg)
+{
+	string full = string(name) + "/" + param;
+	if (filter && !strstr(full.c_str(), filter))
+		return;
+
+	long long iters = 1;
+	while (true)
+	{
+		long long begin = now_ns();
+		fn(iters, arg);
+		long long elapsed = now_ns() - begin;
+		if (elapsed >= min_ns)
+			break;
+		long long next = (elapsed > 0) ? (long long)(iters * 1.2 * min_ns / elapsed) : iters * 100;
+		iters = min(max(next, iters + 1), iters * 100);
+	}
+
+	vector<double> samples;
+	for (int i = 0; i < runs; i++)
+	{
+		long long begin = now_ns();
+		fn(iters, arg);
+		samples.push_back((double)(now_ns() - begin) / iters);
+	}
+	sort(samples.begin(), samples.end());
+	double median = samples[samples.size() / 2];
+	printf("{\"name\": \"%s\", \"param\": \"%s\", \"iterations\": %lld, \"runs\": %d, "
+		   "\"ns_per_op\": {\"min\": %.2f, \"median\": %.2f, \"max\": %.2f}, \"ops_per_s\": %.0f}\n",
+		   name, param, iters, runs, samples.front(), median, samples.back(), 1e9 / median);
+	fflush(stdout);
+}
+
+//----------------------------------------------------------------------------
+//请求解析
+
+//内置的请求语料,分别模拟浏览器,curl,压力测试工具,WebSocket握手,事件流续传,绝对URI和不支持的方法
+static const char *builtin_names[] = {"browser", "curl", "load_gen", "websocket", "sse", "absolute_uri", "post"};
+static const char *builtin_corpus[] = {
+	"GET /index.html HTTP/1.1\r\n"
+	"Host: localhost:3000\r\n"
+	"Connection: keep-alive\r\n"
+	"Cache-Control: max-age=0\r\n"
+	"sec-ch-ua: \"Chromium\";v=\"118\", \"Google Chrome\";v=\"118\", \"Not=A?Brand\";v=\"99\"\r\n"
+	"sec-ch-ua-mobile: ?0\r\n"
+	"sec-ch-ua-platform: \"Linux\"\r\n"
+	"Upgrade-Insecure-Requests: 1\r\n"
+	"User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/118.0.0.0 Safari/537.36\r\n"
+	"Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,image/apng,*/*;q=0.8\r\n"
+	"Sec-Fetch-Site: none\r\n"
+	"Sec-Fetch-Mode: navigate\r\n"
+	"Sec-Fetch-User: ?1\r\n"
+	"Sec-Fetch-Dest: document\r\n"
+	"Accept-Encoding: gzip, deflate, br\r\n"
+	"Accept-Language: zh-CN,zh;q=0.9,en;q=0.8\r\n"
+	"\r\n",
+
+	"GET /index.html HTTP/1.1\r\n"
+	"Host: localhost:3000\r\n"
+	"User-Agent: curl/8.4.0\r\n"
+	"Accept: */*\r\n"
+	"\r\n",
+
+	"GET /index.html HTTP/1.1\r\n"
+	"Host: 127.0.0.1:3000\r\n"
+	"Connection: keep-alive\r\n"
+	"\r\n",
+
+	"GET /ws/chat HTTP/1.1\r\n"
+	"Host: localhost:3000\r\n"
+	"Upgrade: websocket\r\n"
+	"Connection: Upgrade\r\n"
+	"Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+	"Sec-WebSocket-Version: 13\r\n"
+	"\r\n",
+
+	"GET /events/news HTTP/1.1\r\n"
+	"Host: localhost:3000\r\n"
+	"Accept: text/event-stream\r\n"
+	"Last-Event-ID: 4096\r\n"
+	"Connection: keep-alive\r\n"
+	"\r\n",
+
+	"GET http://localhost:3000/sub/file_0001.txt HTTP/1.1\r\n"
+	"Host: localhost:3000\r\n"
+	"Connection: keep-alive\r\n"
+	"\r\n",
+
+	"POST /api/items HTTP/1.1\r\n"
+	"Host: localhost:3000\r\n"
+	"Content-Length: 0\r\n"
+	"\r\n"};
+
+struct corpus_entry
+{
+	string name;
+	string data;
+};
+static vector<corpus_entry> corpus;
+
+//请求按空行分隔,读缓冲区放不下的请求跳过
+static bool load_corpus(const char *path)
+{
+	FILE *fp = fopen(path, "rb");
+	if (!fp)
+		return false;
+	string text;
+	char buf[4096];
+	size_t n;
+	while ((n = fread(buf, 1, sizeof(buf), fp)) > 0)
+		text.append(buf, n);
+	fclose(fp);
+
+	size_t pos = 0;
+	while (pos < text.size())
+	{
+		size_t end = text.find("\r\n\r\n", pos);
+		if (end == string::npos)
+			break;
+		end += 4;
+		if (end - pos < (size_t)http_conn::READ_BUF_SIZE)
+		{
+			corpus_entry entry;
+			char name[32];
+			snprintf(name, sizeof(name), "#%d", (int)corpus.size());
+			entry.name = name;
+			entry.data = text.substr(pos, end - pos);
+			corpus.push_back(entry);
+		}
+		pos = end;
+	}
+	return !corpus.empty();
+}
+
+//http_conn的私有成员只能由友元访问
+class micro_bench
+{
+public:
+	//把请求放入读缓冲区,恢复解析状态机,相当于init()中与解析有关的部分
+	static void load_request(http_conn *conn, const string &data)
+	{
+		memcpy(conn->m_read_buf, data.data(), data.size());
+		conn->m_read_index = data.size();
+		conn->m_check_index = 0;
+		conn->m_start_line = 0;
+		conn->m_check_state = http_conn::CHECK_STATE_REQUESTLINE;
+		conn->m_linger = false;
+		conn->m_method = http_conn::GET;
+		conn->m_url = 0;
+		conn->m_version = 0;
+		conn->m_host = 0;
+		conn->m_content_length = 0;
+		conn->m_ws_upgrade = false;
+		conn->m_ws_key = 0;
+		conn->m_last_event_id = 0;
+		conn->m_proxy_pool = 0;
+		TRACE_RESET(conn->m_trace);
+	}
+
+	//只运行从状态机,把请求拆分为行
+	static void parse_line(long long iters, void *param)
+	{
+		const corpus_entry *entry = (const corpus_entry *)param;
+		http_conn *conn = new http_conn;
+		for (long long i = 0; i < iters; i++)
+		{
+			load_request(conn, entry->data);
+			while (conn->parse_line() == http_conn::LINE_OK)
+				;
+		}
+		delete conn;
+	}
+
+	//完整的主状态机,包括do_request()中的路由匹配
+	static void process_read(long long iters, void *param)
+	{
+		const corpus_entry *entry = (const corpus_entry *)param;
+		http_conn *conn = new http_conn;
+		for (long long i = 0; i < iters; i++)
+		{
+			load_request(conn, entry->data);
+			conn->process_read();
+		}
+		delete conn;
+	}
+
+	//每个请求结束后的init(),清空读写缓冲区
+	static void init(long long iters, void *)
+	{
+		http_conn *conn = new http_conn;
+		for (long long i = 0; i < iters; i++)
+			conn->init();
+		delete conn;
+	}
+
+	//200应答的状态行和头部
+	static void add_headers(long long iters, void *)
+	{
+		http_conn *conn = new http_conn;
+		conn->m_linger = true;
+		for (long long i = 0; i < iters; i++)
+		{
+			conn->m_write_index = 0;
+			conn->add_status(200, "OK");
+			conn->add_headers(123456);
+		}
+		delete conn;
+	}
+
+	//单次格式化,应答头部中每个字段的开销
+	static void add_response(long long iters, void *)
+	{
+		http_conn *conn = new http_conn;
+		for (long long i = 0; i < iters; i++)
+		{
+			conn->m_write_index = 0;
+			conn->add_response("Content-length: %d\r\n", 123456);
+		}
+		delete conn;
+	}
+
+	//错误应答,状态行,头部和内容
+	static void add_error(long long iters, void *)
+	{
+		http_conn *conn = new http_conn;
+		for (long long i = 0; i < iters; i++)
+		{
+			conn->m_write_index = 0;
+			conn->add_status(404, "Not Found");
+			conn->add_headers(49);
+			conn->add_content("The requested file was not found on this server.\n");
+		}
+		delete conn;
+	}
+};
+
+//----------------------------------------------------------------------------
+//线程池
+
+//任务完成时计数,达到目标后通知主线程
+struct bench_task
+{
+	atomic<long long> done;
+	long long target;
+	sem finished;
+
+	void process()
+	{
+		if (done.fetch_add(1, memory_order_acq_rel) + 1 == target)
+			finished.post();
+	}
+};
+
+//线程池没有办法停止工作线程,每种线程数只创建一次
+static threadpool<bench_task> *get_pool(int threads)
+{
+	static threadpool<bench_task> *pools[65];
+	if (!pools[threads])
+	{
+		//构造函数会向cout输出每个线程的创建信息,不能混入JSON
+		streambuf *old = cout.rdbuf(NULL);
+		pools[threads] = new threadpool<bench_task>(threads, 10000);
+		cout.rdbuf(old);
+		cout.clear();
+	}
+	return pools[threads];
+}
+
+//append()的吞吐量:主线程连续放入任务,队列满时让出CPU
+static void pool_throughput(long long iters, void *param)
+{
+	threadpool<bench_task> *pool = get_pool((long)param);
+	bench_task task;
+	task.done = 0;
+	task.target = iters;
+	for (long long i = 0; i < iters; i++)
+	{
+		while (!pool->append(&task))
+			sched_yield();
+	}
+	task.finished.wait();
+}
+
+//一个任务从append()到工作线程执行完毕再通知回主线程的往返时间
+static void pool_handoff(long long iters, void *param)
+{
+	threadpool<bench_task> *pool = get_pool((long)param);
+	bench_task task;
+	task.done = 0;
+	for (long long i = 0; i < iters; i++)
+	{
+		task.target = i + 1;
+		pool->append(&task);
+		task.finished.wait();
+	}
+}
+
+//----------------------------------------------------------------------------
+//锁和信号量
+
+static void locker_uncontended(long long iters, void *)
+{
+	locker lock;
+	for (long long i = 0; i < iters; i++)
+	{
+		lock.lock();
+		lock.unlock();
+	}
+}
+
+static void sem_post_wait(long long iters, void *)
+{
+	sem s;
+	for (long long i = 0; i < iters; i++)
+	{
+		s.post();
+		s.wait();
+	}
+}
+
+//cond::wait()不带条件判断,没有等待者时的signal()会丢失,所以只测量没有等待者时signal()的开销
+static void cond_signal(long long iters, void *)
+{
+	cond c;
+	for (long long i = 0; i < iters; i++)
+		c.signal();
+}
+
+//两个线程用两个信号量交替唤醒对方,每次往返包括两次唤醒
+struct pingpong
+{
+	sem ping;
+	sem pong;
+	long long iters;
+};
+
+static void *pong_thread(void *arg)
+{
+	pingpong *pp = (pingpong *)arg;
+	for (long long i = 0; i < pp->iters; i++)
+	{
+		pp->ping.wait();
+		pp->pong.post();
+	}
+	return NULL;
+}
+
+static void sem_pingpong(long long iters, void *)
+{
+	pingpong pp;
+	pp.iters = iters;
+	pthread_t tid;
+	pthread_create(&tid, NULL, pong_thread, &pp);
+	for (long long i = 0; i < iters; i++)
+	{
+		pp.ping.post();
+		pp.pong.wait();
+	}
+	pthread_join(tid, NULL);
+}
+
+//多个线程争用同一个locker,每个线程各执行iters/threads次加锁解锁
+struct contended
+{
+	locker lock;
+	long long iters;
+	long long counter;
+};
+
+static void *contended_thread(void *arg)
+{
+	contended *c = (contended *)arg;
+	for (long long i = 0; i < c->iters; i++)
+	{
+		c->lock.lock();
+		c->counter++;
+		c->lock.unlock();
+	}
+	return NULL;
+}
+
+static void locker_contended(long long iters, void *param)
+{
+	int threads = (long)param;
+	contended c;
+	c.iters = iters / threads + 1;
+	c.counter = 0;
+	vector<pthread_t> tids(threads);
+	for (int i = 0; i < threads; i++)
+		pthread_create(&tids[i], NULL, contended_thread, &c);
+	for (int i = 0; i < threads; i++)
+		pthread_join(tids[i], NULL);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-m min_ms] [-r runs] [-t 1,2,4,8] [-b filter] [-c corpus_file]\n", prog);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *corpus_path = NULL;
+	const char *threads_arg = "1,2,4,8";
+	int opt;
+	while ((opt = getopt(argc, argv, "m:r:t:b:c:")) != -1)
+	{
+		switch (opt)
+		{
+			case 'm':
+				min_ns = atoll(optarg) * 1000000LL;
+				break;
+			case 'r':
+				runs = atoi(optarg);
+				break;
+			case 't':
+				threads_arg = optarg;
+				break;
+			case 'b':
+				filter = optarg;
+				break;
+			case 'c':
+				corpus_path = optarg;
+				break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+	if (min_ns <= 0 || runs <= 0)
+	{
+		usage(argv[0]);
+		return 1;
+	}
+	for (const char *p = threads_arg; *p;)
+	{
+		int n = atoi(p);
+		if (n <= 0 || n > 64)
+		{
+			usage(argv[0]);
+			return 1;
+		}
+		thread_counts.push_back(n);
+		p += strcspn(p, ",");
+		if (*p == ',')
+			p++;
+	}
+
+	if (corpus_path)
+	{
+		if (!load_corpus(corpus_path))
+		{
+			fprintf(stderr, "%s: no requests loaded\n", corpus_path);
+			return 1;
+		}
+	}
+	else
+	{
+		for (size_t i = 0; i < sizeof(builtin_corpus) / sizeof(builtin_corpus[0]); i++)
+		{
+			corpus_entry entry;
+			entry.name = builtin_names[i];
+			entry.data = builtin_corpus[i];
+			corpus.push_back(entry);
+		}
+	}
+
+	//所有请求都匹配一个反向代理路由,do_request()在路由匹配后返回,不访问文件系统,只测量解析和路由
+	//后端地址只在转发时才连接,这里不会用到
+	proxy_add_route("/=127.0.0.1:9");
+
+	for (size_t i = 0; i < corpus.size(); i++)
+		run_bench("parse_line", corpus[i].name.c_str(), micro_bench::parse_line, &corpus[i]);
+	for (size_t i = 0; i < corpus.size(); i++)
+		run_bench("process_read", corpus[i].name.c_str(), micro_bench::process_read, &corpus[i]);
+	run_bench("http_conn_init", "-", micro_bench::init, NULL);
+	run_bench("add_response", "content_length", micro_bench::add_response, NULL);
+	run_bench("add_response", "ok_200_headers", micro_bench::add_headers, NULL);
+	run_bench("add_response", "error_404", micro_bench::add_error, NULL);
+
+	run_bench("locker", "uncontended", locker_uncontended, NULL);
+	run_bench("sem", "post_wait", sem_post_wait, NULL);
+	run_bench("sem", "pingpong", sem_pingpong, NULL);
+	run_bench("cond", "signal_no_waiter", cond_signal, NULL);
+
+	char param[16];
+	for (size_t i = 0; i < thread_counts.size(); i++)
+	{
+		long n = thread_counts[i];
+		snprintf(param, sizeof(param), "%ld", n);
+		run_bench("locker_contended", param, locker_contended, (void *)n);
+		run_bench("threadpool_append", param, pool_throughput, (void *)n);
+		run_bench("threadpool_handoff", param, pool_handoff, (void *)n);
+	}
+	return 0;
+}
@@ -0,0 +1,143 @@
+#include "neg_cache.h"
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include "metrics.h"
+
+atomic<uint64_t> *neg_cache::m_slots = NULL;
+int neg_cache::m_count = 0;
+atomic<uint64_t> neg_cache::m_generation(0);
+int neg_cache::m_inotify_fd = -1;
+atomic<bool> neg_cache::m_watching(true);
+unordered_map<int, string> neg_cache::m_dirs;
+
+//使已知路径出现的事件;删除不影响不存在的路径
+static const uint32_t WATCH_MASK = IN_CREATE | IN_MOVED_TO | IN_ONLYDIR;
+
+bool neg_cache::init(const char *root, int slots)
+{
+	if (slots <= 0)
+		return true;
+	m_inotify_fd = inotify_init1(IN_CLOEXEC);
+	if (m_inotify_fd < 0)
+		return false;
+	watch_tree(root);
+	if (m_dirs.empty())
+	{
+		close(m_inotify_fd);
+		m_inotify_fd = -1;
+		return false;
+	}
+	pthread_t tid;
+	if (pthread_create(&tid, NULL, work, NULL) != 0)
+		return false;
+	pthread_setname_np(tid, "web-inotify");
+	pthread_detach(tid);
+	m_count = slots;
+	atomic<uint64_t> *table = new atomic<uint64_t>[slots];
+	for (int i = 0; i < slots; i++)
+		table[i].store(0, memory_order_relaxed);
+	m_slots = table;
+	return true;
+}
+
+//FNV-1a
+uint64_t neg_cache::hash(const char *url)
+{
+	uint64_t h = 14695981039346656037ULL;
+	for (const unsigned char *p = (const unsigned char *)url; *p; p++)
+	{
+		h ^= *p;
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+bool neg_cache::lookup(const char *url, uint64_t *tag)
+{
+	uint64_t h = hash(url);
+	//0表示空槽
+	*tag = (h ^ (m_generation.load(memory_order_acquire) * 0x9E3779B97F4A7C15ULL)) | 1;
+	return m_slots[h % m_count].load(memory_order_relaxed) == *tag;
+}
+
+void neg_cache::insert(const char *url, uint64_t tag)
+{
+	m_slots[hash(url) % m_count].store(tag, memory_order_relaxed);
+}
+
+void neg_cache::invalidate()
+{
+	m_generation.fetch_add(1, memory_order_release);
+	metrics::add(COUNTER_NEG_INVALIDATIONS);
+}
+
+void neg_cache::watch_tree(const string &dir)
+{
+	int wd = inotify_add_watch(m_inotify_fd, dir.c_str(), WATCH_MASK);
+	if (wd < 0)
+		return;
+	unordered_map<int, string>::iterator it = m_dirs.find(wd);
+	if (it != m_dirs.end())
+	{
+		//同一个目录已经在监视中(返回原来的监视描述符):经符号链接再次到达时不再深入,避免环;
+		//原来的路径已经不指向它时是被移动了,更新它和子目录的路径
+		struct stat old_st, new_st;
+		if (stat(it->second.c_str(), &old_st) == 0 && stat(dir.c_str(), &new_st) == 0 &&
+			old_st.st_dev == new_st.st_dev && old_st.st_ino == new_st.st_ino)
+			return;
+		it->second = dir;
+	}
+	else
+		m_dirs[wd] = dir;
+	DIR *dp = opendir(dir.c_str());
+	if (!dp)
+		return;
+	struct dirent *entry;
+	while ((entry = readdir(dp)) != NULL)
+	{
+		if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+			continue;
+		if (entry->d_type == DT_DIR || entry->d_type == DT_LNK || entry->d_type == DT_UNKNOWN)
+			watch_tree(dir + "/" + entry->d_name);
+	}
+	closedir(dp);
+}
+
+void *neg_cache::work(void *)
+{
+	char buf[64 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+	while (true)
+	{
+		ssize_t n = read(m_inotify_fd, buf, sizeof(buf));
+		if (n <= 0)
+		{
+			if (n < 0 && errno == EINTR)
+				continue;
+			break;
+		}
+		//先监视新的目录再使缓存失效,之后在新目录中创建的文件一定会产生事件
+		for (char *p = buf; p < buf + n;)
+		{
+			struct inotify_event *ev = (struct inotify_event *)p;
+			if ((ev->mask & IN_ISDIR) && (ev->mask & (IN_CREATE | IN_MOVED_TO)) && ev->len > 0)
+			{
+				unordered_map<int, string>::iterator it = m_dirs.find(ev->wd);
+				if (it != m_dirs.end())
+					watch_tree(it->second + "/" + ev->name);
+			}
+			else if (ev->mask & IN_IGNORED)
+				m_dirs.erase(ev->wd);
+			p += sizeof(struct inotify_event) + ev->len;
+		}
+		//一批事件只失效一次;队列溢出(IN_Q_OVERFLOW)时同样失效
+		invalidate();
+	}
+	//inotify不可用后不再缓存
+	m_watching.store(false);
+	return NULL;
+}
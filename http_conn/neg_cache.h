@@ -0,0 +1,45 @@
+#ifndef NEG_CACHE_H_
+#define NEG_CACHE_H_
+
+#include <stdint.h>
+#include <atomic>
+#include <string>
+#include <unordered_map>
+
+using namespace std;
+
+//不存在的路径的缓存(负缓存),所有线程共享,不加锁:
+//	扫描器每秒请求成千上万个不存在的URL,每个都要拼接路径并stat失败,缓存后直接返回404,不访问文件系统
+//	按URL的64位哈希直接映射到一个槽,冲突时新的覆盖旧的,占用的内存固定
+//	槽中存放哈希与代数混合后的标记,代数加一即整体失效;后台线程用inotify监视根目录下的所有目录,
+//	有文件或目录被创建,移入时代数加一,之前不存在的路径可能已经存在
+class neg_cache
+{
+public:
+	//监视root下的所有目录并分配slots个槽,slots为0时不启用;监视失败(如超过max_user_watches)时不启用
+	static bool init(const char *root, int slots);
+	static bool enabled() { return m_slots != NULL && m_watching.load(memory_order_relaxed); }
+	//url是否在缓存中;tag为url在当前代数下的标记,之后路径不存在时交给insert()
+	//必须在stat之前取得,stat期间代数变化时插入的是旧代数的标记,不会命中
+	static bool lookup(const char *url, uint64_t *tag);
+	static void insert(const char *url, uint64_t tag);
+
+private:
+	static uint64_t hash(const char *url);
+	static void *work(void *);
+	//监视dir及其下的所有子目录,跟随指向目录的符号链接(请求中的路径也跟随)
+	static void watch_tree(const string &dir);
+	static void invalidate();
+
+private:
+	static atomic<uint64_t> *m_slots;
+	static int m_count;
+	static atomic<uint64_t> m_generation;
+	static int m_inotify_fd;
+	//后台线程读取inotify出错时置为false,之后不再使用缓存
+	static atomic<bool> m_watching;
+	//监视描述符对应的目录,只在init和后台线程中访问
+	static unordered_map<int, string> m_dirs;
+};
+
+#endif
@@ -0,0 +1,111 @@
+#include "poller.h"
+#include <errno.h>
+#include <sched.h>
+#include <stdint.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include "metrics.h"
+
+//较早的头文件没有epoll忙轮询的参数(Linux 6.9)
+#ifndef EPIOCSPARAMS
+struct epoll_params
+{
+	uint32_t busy_poll_usecs;
+	uint16_t busy_poll_budget;
+	uint8_t prefer_busy_poll;
+	uint8_t __pad;
+};
+#define EPIOCSPARAMS _IOW(0x8A, 0x01, struct epoll_params)
+#endif
+
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL 69
+#endif
+#ifndef SO_BUSY_POLL_BUDGET
+#define SO_BUSY_POLL_BUDGET 70
+#endif
+
+//每次忙轮询最多处理的网卡数据包数
+static const int BUSY_POLL_BUDGET = 64;
+
+int poller::m_spin_us = 0;
+int poller::m_busy_poll_us = 0;
+
+poller::poller(int epollfd, int max_events)
+	: m_epollfd(epollfd), m_max_events(max_events), m_small_rounds(0), m_events(max_events)
+{
+	m_size = (MIN_EVENTS < max_events) ? MIN_EVENTS : max_events;
+	if (m_busy_poll_us > 0)
+	{
+		struct epoll_params params = {};
+		params.busy_poll_usecs = m_busy_poll_us;
+		params.busy_poll_budget = BUSY_POLL_BUDGET;
+		params.prefer_busy_poll = 1;
+		//内核不支持时忽略,仍然可以自旋
+		ioctl(m_epollfd, EPIOCSPARAMS, &params);
+	}
+}
+
+void poller::setup_socket(int fd)
+{
+	if (m_busy_poll_us <= 0)
+		return;
+	int on = 1, budget = BUSY_POLL_BUDGET;
+	setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &m_busy_poll_us, sizeof(m_busy_poll_us));
+	setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &on, sizeof(on));
+	setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL_BUDGET, &budget, sizeof(budget));
+}
+
+int poller::poll(int timeout)
+{
+	int num = epoll_wait(m_epollfd, &m_events[0], m_size, timeout);
+	if (num < 0)
+		return num;
+	if (timeout != 0)
+		metrics::add(COUNTER_POLL_BLOCKS);
+	else if (num == 0)
+		metrics::add(COUNTER_POLL_EMPTY);
+	if (num > 0)
+	{
+		metrics::add(COUNTER_POLL_PRODUCTIVE);
+		metrics::add(COUNTER_POLL_EVENTS, num);
+	}
+
+	//事件数组填满说明可能还有事件没有取走,加倍;连续多次用得很少时减半
+	if (num == m_size && m_size < m_max_events)
+	{
+		m_size = (m_size * 2 < m_max_events) ? m_size * 2 : m_max_events;
+		m_small_rounds = 0;
+	}
+	else if (num < m_size / 4 && m_size > MIN_EVENTS)
+	{
+		if (++m_small_rounds >= SHRINK_ROUNDS)
+		{
+			m_size /= 2;
+			m_small_rounds = 0;
+		}
+	}
+	else
+		m_small_rounds = 0;
+	return num;
+}
+
+int poller::wait(bool nonblock)
+{
+	if (nonblock)
+		return poll(0);
+	if (m_spin_us > 0)
+	{
+		uint64_t begin = metrics::now();
+		uint64_t spin_ns = m_spin_us * 1000ULL;
+		do
+		{
+			int num = poll(0);
+			if (num != 0)
+				return num;
+			//同一CPU上有其他可运行的线程(如工作线程)时让出,CPU空闲时立即返回
+			sched_yield();
+		} while (metrics::to_ns(metrics::now() - begin) < spin_ns);
+	}
+	return poll(-1);
+}
@@ -0,0 +1,46 @@
+#ifndef POLLER_H_
+#define POLLER_H_
+
+#include <sys/epoll.h>
+#include <vector>
+
+using namespace std;
+
+//事件循环调用epoll_wait的封装
+//1.事件数组按负载调整大小:返回的事件填满数组时加倍,连续多次只用了不到四分之一时减半,在MIN_EVENTS和max_events之间
+//2.低延迟模式(web -P spin_us[:busy_poll_us]):阻塞之前先以超时0反复调用epoll_wait,最多spin_us微秒,
+//  事件到达时不需要经过睡眠和唤醒;监听socket设置SO_BUSY_POLL/SO_PREFER_BUSY_POLL(接受的连接继承),
+//  epoll设置EPIOCSPARAMS,内核在没有事件时直接轮询网卡队列。这种模式用CPU换取微秒级的延迟
+class poller
+{
+public:
+	static const int MIN_EVENTS = 64;
+	//减半之前需要连续的次数
+	static const int SHRINK_ROUNDS = 64;
+
+	//自旋的微秒数,0为不自旋
+	static int m_spin_us;
+	//SO_BUSY_POLL和epoll忙轮询的微秒数,0为不设置
+	static int m_busy_poll_us;
+
+	poller(int epollfd, int max_events);
+	//等待事件,nonblock为true时不阻塞(就绪队列不为空),返回事件数,出错时返回-1
+	int wait(bool nonblock);
+	epoll_event *events() { return &m_events[0]; }
+
+	//按m_busy_poll_us设置监听socket的忙轮询选项
+	static void setup_socket(int fd);
+
+private:
+	int poll(int timeout);
+
+private:
+	int m_epollfd;
+	int m_max_events;
+	//当前使用的事件数组大小,m_events的容量按m_max_events分配,调整大小时不重新分配
+	int m_size;
+	int m_small_rounds;
+	vector<epoll_event> m_events;
+};
+
+#endif
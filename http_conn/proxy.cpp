@@ -0,0 +1,739 @@
+#include "proxy.h"
+#include <netdb.h>
+#include "metrics.h"
+
+extern void modfd(int epollfd, int fd, int ev);
+
+//fd的最大值,与main.cpp中的MAX_FD一致
+static const int MAX_UPSTREAM_FD = 65536;
+//每次从后端splice到管道的最大字节数,与管道的默认容量一致
+static const int PIPE_CAPACITY = 65536;
+
+//fd到后端连接的映射,主线程据此区分客户连接和后端连接上的事件
+static upstream_conn *upstreams[MAX_UPSTREAM_FD];
+//所有的路由
+static vector<upstream_pool *> routes;
+
+upstream_conn *upstream_conn::find(int fd)
+{
+	if (fd < 0 || fd >= MAX_UPSTREAM_FD)
+		return NULL;
+	return upstreams[fd];
+}
+
+upstream_conn::upstream_conn(upstream_pool *pool, upstream_backend *backend)
+	: m_pool(pool),
+	  m_backend(backend),
+	  m_fd(-1),
+	  m_registered(false),
+	  m_pipe_bytes(0),
+	  m_client(NULL),
+	  m_state(STATE_IDLE),
+	  m_reused(false),
+	  m_attempts(0),
+	  m_got_response(false),
+	  m_keep_upstream(true),
+	  m_keep_client(false),
+	  m_req_len(0),
+	  m_body(NULL),
+	  m_body_len(0),
+	  m_iv_count(0),
+	  m_head_len(0),
+	  m_line_len(0),
+	  m_ctl(NULL),
+	  m_ctl_len(0),
+	  m_remaining(0)
+{
+	m_pipe[0] = m_pipe[1] = -1;
+}
+
+upstream_conn::~upstream_conn()
+{
+	close_fd();
+	if (m_pipe[0] != -1)
+	{
+		close(m_pipe[0]);
+		close(m_pipe[1]);
+	}
+}
+
+bool upstream_conn::connect_backend()
+{
+	if (m_pipe[0] == -1 && pipe2(m_pipe, O_NONBLOCK | O_CLOEXEC) < 0)
+		return false;
+
+	m_fd = socket(m_backend->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (m_fd < 0)
+		return false;
+	if (m_fd >= MAX_UPSTREAM_FD)
+	{
+		close(m_fd);
+		m_fd = -1;
+		return false;
+	}
+	int ret = connect(m_fd, (struct sockaddr *)&m_backend->addr, m_backend->addr_len);
+	if (ret < 0 && errno != EINPROGRESS)
+	{
+		close(m_fd);
+		m_fd = -1;
+		return false;
+	}
+	m_state = (ret == 0) ? STATE_SENDING : STATE_CONNECTING;
+	m_reused = false;
+	upstreams[m_fd] = this;
+	return true;
+}
+
+void upstream_conn::close_fd()
+{
+	if (m_fd == -1)
+		return;
+	if (m_registered)
+	{
+		epoll_ctl(http_conn::m_epollfd, EPOLL_CTL_DEL, m_fd, 0);
+		m_registered = false;
+	}
+	upstreams[m_fd] = NULL;
+	close(m_fd);
+	m_fd = -1;
+}
+
+bool upstream_conn::alive()
+{
+	char c;
+	int n = recv(m_fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+	//空闲连接上不应该有数据,读到EOF或数据都说明连接不能再用
+	return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+void upstream_conn::start(http_conn *client, const char *body, int body_len, bool keep_alive)
+{
+	m_client = client;
+	m_body = body;
+	m_body_len = body_len;
+	m_iv[0].iov_base = m_req;
+	m_iv[0].iov_len = m_req_len;
+	m_iv[1].iov_base = (void *)body;
+	m_iv[1].iov_len = body_len;
+	m_iv_count = (body_len > 0) ? 2 : 1;
+	m_pipe_bytes = 0;
+	m_got_response = false;
+	m_keep_upstream = true;
+	m_keep_client = keep_alive;
+	m_head_len = 0;
+	m_line_len = 0;
+	m_ctl_len = 0;
+	m_remaining = 0;
+
+	//最后一步才注册事件,之后该连接就交给主线程处理了
+	epoll_event event;
+	event.data.fd = m_fd;
+	event.events = EPOLLOUT | EPOLLET | EPOLLONESHOT | EPOLLRDHUP;
+	m_registered = true;
+	epoll_ctl(http_conn::m_epollfd, EPOLL_CTL_ADD, m_fd, &event);
+}
+
+bool upstream_conn::retry()
+{
+	close_fd();
+	if (!connect_backend())
+		return false;
+	m_iv[0].iov_base = m_req;
+	m_iv[0].iov_len = m_req_len;
+	m_iv[1].iov_base = (void *)m_body;
+	m_iv[1].iov_len = m_body_len;
+	m_iv_count = (m_body_len > 0) ? 2 : 1;
+	m_head_len = 0;
+
+	epoll_event event;
+	event.data.fd = m_fd;
+	event.events = EPOLLOUT | EPOLLET | EPOLLONESHOT | EPOLLRDHUP;
+	m_registered = true;
+	epoll_ctl(http_conn::m_epollfd, EPOLL_CTL_ADD, m_fd, &event);
+	return true;
+}
+
+bool upstream_conn::send_request()
+{
+	while (1)
+	{
+		int n = writev(m_fd, m_iv, m_iv_count);
+		if (n < 0)
+			return errno == EAGAIN;
+		for (int i = 0; i < m_iv_count && n > 0; i++)
+		{
+			int len = (n < (int)m_iv[i].iov_len) ? n : (int)m_iv[i].iov_len;
+			m_iv[i].iov_base = (char *)m_iv[i].iov_base + len;
+			m_iv[i].iov_len -= len;
+			n -= len;
+		}
+		if (m_iv[m_iv_count - 1].iov_len == 0)
+		{
+			m_state = STATE_HEAD;
+			return true;
+		}
+	}
+}
+
+//查找结束标记,返回结束标记之后的位置,没有找到返回-1
+static int find_end(const char *buf, int from, int to, bool head)
+{
+	int i = (from > 3) ? from - 3 : 0;
+	for (; i < to; i++)
+	{
+		if (buf[i] != '\n')
+			continue;
+		if (!head)
+			return i + 1;
+		if (i >= 3 && buf[i - 1] == '\r' && buf[i - 2] == '\n' && buf[i - 3] == '\r')
+			return i + 1;
+	}
+	return -1;
+}
+
+//先用MSG_PEEK查看数据,只从socket中取走结束标记之前的部分,剩下的数据留给splice
+int upstream_conn::read_until(char *buf, int &len, int size, bool head)
+{
+	while (1)
+	{
+		if (len >= size)
+			return -1;
+		int n = recv(m_fd, buf + len, size - len, MSG_PEEK);
+		if (n < 0)
+			return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+		if (n == 0)
+			return -1;
+		m_got_response = true;
+		int end = find_end(buf, len, len + n, head);
+		int take = (end < 0) ? n : end - len;
+		if (recv(m_fd, buf + len, take, 0) != take)
+			return -1;
+		len += take;
+		buf[len] = '\0';
+		if (end >= 0)
+			return 1;
+	}
+}
+
+bool upstream_conn::parse_head()
+{
+	int major = 0, minor = 0, status = 0;
+	if (sscanf(m_head, "HTTP/%d.%d %d", &major, &minor, &status) != 3)
+		return false;
+	//没有发送Expect,不应该收到1xx应答
+	if (status < 200)
+		return false;
+	m_client->set_status(status);
+
+	//HTTP/1.0默认不保持连接
+	m_keep_upstream = (major == 1 && minor >= 1);
+	long long length = -1;
+	bool chunked = false;
+	char *line = strstr(m_head, "\r\n");
+	while (line && line[2] != '\r')
+	{
+		line += 2;
+		if (strncasecmp(line, "Content-Length:", 15) == 0)
+			length = atoll(line + 15);
+		else if (strncasecmp(line, "Transfer-Encoding:", 18) == 0)
+			chunked = (strncasecmp(line + 18 + strspn(line + 18, " \t"), "chunked", 7) == 0);
+		else if (strncasecmp(line, "Connection:", 11) == 0)
+		{
+			const char *value = line + 11 + strspn(line + 11, " \t");
+			if (strncasecmp(value, "close", 5) == 0)
+				m_keep_upstream = false;
+			else if (strncasecmp(value, "keep-alive", 10) == 0)
+				m_keep_upstream = true;
+		}
+		line = strstr(line, "\r\n");
+	}
+
+	//GET请求的204和304应答没有应答体
+	if (status == 204 || status == 304)
+		m_state = STATE_DONE;
+	else if (chunked)
+		m_state = STATE_CHUNK_LINE;
+	else if (length >= 0)
+	{
+		m_remaining = length;
+		m_state = (length > 0) ? STATE_BODY_LENGTH : STATE_DONE;
+	}
+	else
+	{
+		m_state = STATE_BODY_EOF;
+		m_keep_upstream = false;
+	}
+	//应答头部原样转发给客户,后端要求关闭连接时客户也会关闭
+	if (!m_keep_upstream)
+		m_keep_client = false;
+	return true;
+}
+
+void upstream_conn::queue_ctl(const char *data, int len)
+{
+	m_ctl = data;
+	m_ctl_len = len;
+}
+
+int upstream_conn::pull()
+{
+	//先把上一次没有写完的控制数据写入管道
+	if (m_ctl_len > 0)
+	{
+		int n = ::write(m_pipe[1], m_ctl, m_ctl_len);
+		if (n < 0)
+			return (errno == EAGAIN) ? 0 : -1;
+		m_ctl += n;
+		m_ctl_len -= n;
+		m_pipe_bytes += n;
+		return 1;
+	}
+
+	switch (m_state)
+	{
+		case STATE_HEAD:
+		{
+			int ret = read_until(m_head, m_head_len, HEAD_SIZE, true);
+			if (ret <= 0)
+				return ret;
+			if (!parse_head())
+				return -1;
+			queue_ctl(m_head, m_head_len);
+			return 1;
+		}
+		case STATE_CHUNK_LINE:
+		case STATE_TRAILER:
+		{
+			int ret = read_until(m_line, m_line_len, LINE_SIZE, false);
+			if (ret <= 0)
+				return ret;
+			if (m_state == STATE_CHUNK_LINE)
+			{
+				if (!isxdigit((unsigned char)m_line[0]))
+					return -1;
+				long long size = strtoll(m_line, NULL, 16);
+				if (size > 0)
+				{
+					//chunk数据之后还有\r\n
+					m_remaining = size + 2;
+					m_state = STATE_CHUNK_DATA;
+				}
+				else
+					m_state = STATE_TRAILER;
+			}
+			else if (strcmp(m_line, "\r\n") == 0)
+				m_state = STATE_DONE;
+			queue_ctl(m_line, m_line_len);
+			m_line_len = 0;
+			return 1;
+		}
+		case STATE_BODY_LENGTH:
+		case STATE_CHUNK_DATA:
+		case STATE_BODY_EOF:
+		{
+			long long want = PIPE_CAPACITY - m_pipe_bytes;
+			if (m_state != STATE_BODY_EOF && m_remaining < want)
+				want = m_remaining;
+			if (want <= 0)
+				return 0;
+			int n = splice(m_fd, NULL, m_pipe[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+			if (n < 0)
+				return (errno == EAGAIN) ? 0 : -1;
+			if (n == 0)
+			{
+				if (m_state != STATE_BODY_EOF)
+					return -1;
+				m_state = STATE_DONE;
+				return 1;
+			}
+			m_got_response = true;
+			m_pipe_bytes += n;
+			if (m_state != STATE_BODY_EOF)
+			{
+				m_remaining -= n;
+				if (m_remaining == 0)
+					m_state = (m_state == STATE_BODY_LENGTH) ? STATE_DONE : STATE_CHUNK_LINE;
+			}
+			return 1;
+		}
+		default:
+			return 0;
+	}
+}
+
+//应答数据经管道从后端socket splice到客户socket,不经过用户态缓冲区
+upstream_conn::RELAY_RESULT upstream_conn::relay()
+{
+	int client_fd = m_client->get_sockfd();
+	bool upstream_blocked = false;
+	bool client_blocked = false;
+	while (1)
+	{
+		bool progress = false;
+		upstream_blocked = false;
+		client_blocked = false;
+
+		if (m_state != STATE_DONE || m_ctl_len > 0)
+		{
+			int ret = pull();
+			if (ret < 0)
+				return RELAY_ERROR;
+			if (ret > 0)
+				progress = true;
+			else
+				upstream_blocked = true;
+		}
+
+		if (m_pipe_bytes > 0)
+		{
+			int n = splice(m_pipe[0], NULL, client_fd, NULL, m_pipe_bytes, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+			if (n > 0)
+			{
+				m_pipe_bytes -= n;
+				m_client->add_bytes_sent(n);
+				progress = true;
+			}
+			else if (n == 0 || errno == EAGAIN)
+				client_blocked = true;
+			else
+				return RELAY_ERROR;
+		}
+
+		if (m_state == STATE_DONE && m_ctl_len == 0 && m_pipe_bytes == 0)
+			return m_keep_client ? RELAY_KEEP : RELAY_CLOSE;
+		if (!progress)
+			break;
+	}
+
+	//管道不空时splice返回EAGAIN可能是因为管道满了,此时等客户可写后再从后端读
+	if (client_blocked)
+		modfd(http_conn::m_epollfd, client_fd, EPOLLOUT);
+	else if (upstream_blocked)
+		modfd(http_conn::m_epollfd, m_fd, EPOLLIN);
+	return RELAY_AGAIN;
+}
+
+void upstream_conn::handle_event(uint32_t events)
+{
+	if (!m_client)
+		return;
+
+	if (m_state == STATE_CONNECTING)
+	{
+		int err = 0;
+		socklen_t len = sizeof(err);
+		if (getsockopt(m_fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0 || (events & EPOLLERR))
+		{
+			m_pool->mark_failed(m_backend);
+			fail();
+			return;
+		}
+		m_state = STATE_SENDING;
+	}
+
+	if (m_state == STATE_SENDING)
+	{
+		if (!send_request())
+		{
+			//复用的连接可能已经被后端关闭,换一个新连接再试一次
+			if (m_reused && retry())
+				return;
+			m_pool->mark_failed(m_backend);
+			fail();
+			return;
+		}
+		if (m_state == STATE_SENDING)
+		{
+			modfd(http_conn::m_epollfd, m_fd, EPOLLOUT);
+			return;
+		}
+	}
+
+	RELAY_RESULT ret = relay();
+	if (ret == RELAY_ERROR && !m_got_response)
+	{
+		if (m_reused && retry())
+			return;
+		m_pool->mark_failed(m_backend);
+		fail();
+		return;
+	}
+	if (ret != RELAY_AGAIN)
+		finish(ret);
+}
+
+void upstream_conn::client_writable()
+{
+	RELAY_RESULT ret = relay();
+	if (ret != RELAY_AGAIN)
+		finish(ret);
+}
+
+void upstream_conn::finish(RELAY_RESULT result)
+{
+	http_conn *client = m_client;
+	m_client = NULL;
+	bool reusable = (result != RELAY_ERROR) && m_keep_upstream && m_state == STATE_DONE;
+
+	if (!client->finish_proxy(result == RELAY_KEEP))
+		client->close_conn();
+	//release之后本对象可能已经被释放
+	m_pool->release(this, reusable, result != RELAY_ERROR);
+}
+
+void upstream_conn::fail()
+{
+	http_conn *client = m_client;
+	upstream_pool *pool = m_pool;
+	m_client = NULL;
+
+	upstream_conn *next = NULL;
+	if (m_attempts + 1 < pool->backend_count())
+		next = pool->acquire();
+	if (!next)
+	{
+		client->proxy_failed();
+		pool->release(this, false, false);
+		return;
+	}
+
+	memcpy(next->m_req, m_req, m_req_len);
+	next->m_req_len = m_req_len;
+	next->m_attempts = m_attempts + 1;
+	const char *body = m_body;
+	int body_len = m_body_len;
+	bool keep_alive = m_keep_client;
+	pool->release(this, false, false);
+	client->set_upstream(next);
+	next->start(client, body, body_len, keep_alive);
+}
+
+void upstream_conn::abort()
+{
+	m_client = NULL;
+	m_pool->release(this, false, true);
+}
+
+upstream_pool::upstream_pool(const char *prefix)
+	: m_next(0)
+{
+	snprintf(m_prefix, sizeof(m_prefix), "%s", prefix);
+	m_prefix_len = strlen(m_prefix);
+}
+
+bool upstream_pool::add_backend(const char *spec)
+{
+	upstream_backend *backend = new upstream_backend;
+	memset(&backend->addr, 0, sizeof(backend->addr));
+	snprintf(backend->name, sizeof(backend->name), "%s", spec);
+	backend->outstanding = 0;
+	backend->fails = 0;
+	backend->down_until = 0;
+
+	if (strncmp(spec, "unix:", 5) == 0)
+	{
+		struct sockaddr_un *addr = (struct sockaddr_un *)&backend->addr;
+		addr->sun_family = AF_UNIX;
+		if (strlen(spec + 5) >= sizeof(addr->sun_path))
+		{
+			delete backend;
+			return false;
+		}
+		strcpy(addr->sun_path, spec + 5);
+		backend->addr_len = sizeof(struct sockaddr_un);
+	}
+	else
+	{
+		char host[128];
+		const char *colon = strrchr(spec, ':');
+		if (!colon || colon == spec || colon - spec >= (int)sizeof(host))
+		{
+			delete backend;
+			return false;
+		}
+		memcpy(host, spec, colon - spec);
+		host[colon - spec] = '\0';
+
+		struct addrinfo hints, *res = NULL;
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		if (getaddrinfo(host, colon + 1, &hints, &res) != 0 || !res)
+		{
+			delete backend;
+			return false;
+		}
+		memcpy(&backend->addr, res->ai_addr, res->ai_addrlen);
+		backend->addr_len = res->ai_addrlen;
+		freeaddrinfo(res);
+	}
+	m_backends.push_back(backend);
+	return true;
+}
+
+upstream_backend *upstream_pool::pick(time_t now)
+{
+	upstream_backend *best = NULL;
+	int n = m_backends.size();
+	for (int i = 0; i < n; i++)
+	{
+		upstream_backend *backend = m_backends[(m_next + i) % n];
+		if (backend->down_until > now)
+			continue;
+		if (!best || backend->outstanding < best->outstanding)
+			best = backend;
+	}
+	m_next++;
+	return best;
+}
+
+upstream_conn *upstream_pool::acquire()
+{
+	for (int tries = 0; tries < (int)m_backends.size(); tries++)
+	{
+		upstream_conn *conn = NULL;
+		m_lock.lock();
+		time_t now = time(NULL);
+		upstream_backend *backend = pick(now);
+		if (!backend)
+		{
+			m_lock.unlock();
+			return NULL;
+		}
+		backend->outstanding++;
+		//优先复用最近放回的空闲连接
+		while (!backend->idle.empty() && !conn)
+		{
+			conn = backend->idle.back();
+			backend->idle.pop_back();
+			if (!conn->alive())
+			{
+				delete conn;
+				conn = NULL;
+			}
+		}
+		m_lock.unlock();
+
+		if (conn)
+		{
+			conn->m_attempts = 0;
+			conn->m_reused = true;
+			conn->m_state = upstream_conn::STATE_SENDING;
+			return conn;
+		}
+
+		//在锁外建立新连接
+		conn = new upstream_conn(this, backend);
+		if (conn->connect_backend())
+			return conn;
+		delete conn;
+
+		m_lock.lock();
+		backend->outstanding--;
+		mark_failed_locked(backend, time(NULL));
+		m_lock.unlock();
+	}
+	return NULL;
+}
+
+void upstream_pool::release(upstream_conn *conn, bool reusable, bool ok)
+{
+	upstream_backend *backend = conn->m_backend;
+	if (reusable && conn->m_registered)
+	{
+		//空闲连接不在epoll中,复用前用alive()检查
+		epoll_ctl(http_conn::m_epollfd, EPOLL_CTL_DEL, conn->m_fd, 0);
+		conn->m_registered = false;
+	}
+
+	m_lock.lock();
+	backend->outstanding--;
+	if (ok)
+		backend->fails = 0;
+	if (reusable && (int)backend->idle.size() < MAX_IDLE)
+	{
+		conn->m_state = upstream_conn::STATE_IDLE;
+		backend->idle.push_back(conn);
+		conn = NULL;
+	}
+	m_lock.unlock();
+
+	if (conn)
+		delete conn;
+}
+
+void upstream_pool::mark_failed(upstream_backend *backend)
+{
+	m_lock.lock();
+	mark_failed_locked(backend, time(NULL));
+	m_lock.unlock();
+}
+
+void upstream_pool::mark_failed_locked(upstream_backend *backend, time_t now)
+{
+	backend->fails++;
+	if (backend->fails >= MAX_FAILS && backend->down_until <= now)
+	{
+		backend->down_until = now + DOWN_SECONDS;
+		//持有连接池的锁,不在这里输出,只计数
+		metrics::add(COUNTER_UPSTREAM_DOWNS);
+	}
+}
+
+bool proxy_add_route(const char *route)
+{
+	const char *eq = strchr(route, '=');
+	if (!eq || eq == route || route[0] != '/' || eq - route >= http_conn::MAXFILENAME_LEN)
+		return false;
+
+	char prefix[http_conn::MAXFILENAME_LEN];
+	memcpy(prefix, route, eq - route);
+	prefix[eq - route] = '\0';
+	upstream_pool *pool = new upstream_pool(prefix);
+
+	char spec[256];
+	const char *p = eq + 1;
+	while (*p)
+	{
+		int len = strcspn(p, ",");
+		if (len == 0 || len >= (int)sizeof(spec))
+		{
+			delete pool;
+			return false;
+		}
+		memcpy(spec, p, len);
+		spec[len] = '\0';
+		if (!pool->add_backend(spec))
+		{
+			delete pool;
+			return false;
+		}
+		p += len;
+		if (*p == ',')
+			p++;
+	}
+	routes.push_back(pool);
+	return true;
+}
+
+//前缀必须在'/','?'或URL结尾处结束,/api不匹配/apix;以'/'结尾的前缀本身已经在边界上
+static bool prefix_match(const char *url, const char *prefix, int len)
+{
+	if (strncmp(url, prefix, len) != 0)
+		return false;
+	char next = url[len];
+	return prefix[len - 1] == '/' || next == '\0' || next == '/' || next == '?';
+}
+
+upstream_pool *proxy_match(const char *url)
+{
+	upstream_pool *best = NULL;
+	for (size_t i = 0; i < routes.size(); i++)
+	{
+		upstream_pool *pool = routes[i];
+		if (prefix_match(url, pool->prefix(), pool->prefix_len()) &&
+			(!best || pool->prefix_len() > best->prefix_len()))
+			best = pool;
+	}
+	return best;
+}
@@ -0,0 +1,203 @@
+#ifndef PROXY_H_
+#define PROXY_H_
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <time.h>
+#include <vector>
+#include "http_conn.h"
+#include "locker.h"
+
+using namespace std;
+
+class upstream_pool;
+class upstream_conn;
+
+//一个后端服务器,地址可以是unix域socket或TCP地址
+struct upstream_backend
+{
+	sockaddr_storage addr;
+	socklen_t addr_len;
+	//配置中的原始写法,用于日志
+	char name[128];
+	//正在处理的请求数,用于最少未完成请求的负载均衡
+	int outstanding;
+	//连续失败的次数
+	int fails;
+	//在此时间之前认为该后端不可用
+	time_t down_until;
+	//到该后端的空闲长连接
+	vector<upstream_conn *> idle;
+};
+
+//到后端的一个长连接,一次只服务一个客户请求,请求结束后放回连接池复用
+//所有的I/O都是非阻塞的,注册在主线程的epoll中,由主线程驱动
+class upstream_conn
+{
+public:
+	//后端应答头部的最大长度
+	static const int HEAD_SIZE = 4096;
+	//发往后端的请求头部的最大长度
+	static const int REQ_SIZE = 4096;
+	//chunk长度行的最大长度
+	static const int LINE_SIZE = 256;
+
+	//relay()的结果
+	enum RELAY_RESULT
+	{
+		RELAY_AGAIN = 0, //等待下一次事件
+		RELAY_KEEP,		 //应答转发完毕,客户连接可以继续使用
+		RELAY_CLOSE,	 //应答转发完毕,需要关闭客户连接
+		RELAY_ERROR		 //出错
+	};
+
+public:
+	//根据fd查找后端连接,fd不属于任何后端连接时返回NULL
+	static upstream_conn *find(int fd);
+
+	//由工作线程调用,开始向后端转发一个请求,body指向客户连接读缓冲区中的请求体
+	//keep_alive表示客户是否要求保持连接
+	void start(http_conn *client, const char *body, int body_len, bool keep_alive);
+	//请求头部缓冲区,由http_conn::build_proxy_request()填充
+	char *request_buf() { return m_req; }
+	void set_request_len(int len) { m_req_len = len; }
+
+	//主线程中后端socket上的事件
+	void handle_event(uint32_t events);
+	//主线程中客户socket可写
+	void client_writable();
+	//客户连接异常关闭,放弃本次转发
+	void abort();
+
+private:
+	friend class upstream_pool;
+	upstream_conn(upstream_pool *pool, upstream_backend *backend);
+	~upstream_conn();
+
+	//建立非阻塞连接,失败返回false
+	bool connect_backend();
+	void close_fd();
+	//空闲连接是否仍然可用
+	bool alive();
+	//把请求发送给后端
+	bool send_request();
+	//从后端读数据写入管道,有进展返回1,暂时不能继续返回0,出错返回-1
+	int pull();
+	//读取一行或应答头部,读完返回1,暂时没有数据返回0,出错返回-1
+	int read_until(char *buf, int &len, int size, bool head);
+	bool parse_head();
+	//把应答头部或chunk长度行这样的数据写入管道
+	void queue_ctl(const char *data, int len);
+	//在后端和客户之间转发数据
+	RELAY_RESULT relay();
+	//重新连接同一个后端再发送一次请求,用于复用的连接已被后端关闭的情况
+	bool retry();
+	//转发结束,通知客户连接并将本连接放回连接池
+	void finish(RELAY_RESULT result);
+	//还没有收到后端的应答时出错,换一个后端重试,都失败时给客户返回502
+	void fail();
+
+private:
+	//连接所处的阶段
+	enum STATE
+	{
+		STATE_CONNECTING = 0,
+		STATE_SENDING,
+		STATE_HEAD,			//读取应答头部
+		STATE_BODY_LENGTH,	//按Content-Length转发
+		STATE_CHUNK_LINE,	//读取chunk长度行
+		STATE_CHUNK_DATA,	//转发chunk数据
+		STATE_TRAILER,		//读取结束块后的trailer
+		STATE_BODY_EOF,		//应答没有长度,转发到后端关闭连接为止
+		STATE_DONE,
+		STATE_IDLE
+	};
+
+	upstream_pool *m_pool;
+	upstream_backend *m_backend;
+	int m_fd;
+	//splice需要通过管道中转,管道随连接复用
+	int m_pipe[2];
+	//是否已经注册到epoll
+	bool m_registered;
+	//管道中尚未发送给客户的字节数
+	int m_pipe_bytes;
+
+	http_conn *m_client;
+	STATE m_state;
+	//连接是否是从连接池中复用的
+	bool m_reused;
+	//本次请求已经尝试过的后端数
+	int m_attempts;
+	//后端是否已经返回了数据
+	bool m_got_response;
+	//应答结束后后端连接能否继续使用
+	bool m_keep_upstream;
+	//应答结束后客户连接能否继续使用
+	bool m_keep_client;
+
+	char m_req[REQ_SIZE];
+	int m_req_len;
+	const char *m_body;
+	int m_body_len;
+	struct iovec m_iv[2];
+	int m_iv_count;
+
+	char m_head[HEAD_SIZE + 1];
+	int m_head_len;
+	char m_line[LINE_SIZE + 1];
+	int m_line_len;
+	//等待写入管道的控制数据,指向m_head或m_line
+	const char *m_ctl;
+	int m_ctl_len;
+	//当前应答体或chunk中还需要转发的字节数
+	long long m_remaining;
+};
+
+//一组后端服务器,负责连接的复用和负载均衡
+class upstream_pool
+{
+public:
+	//每个后端最多保留的空闲连接数
+	static const int MAX_IDLE = 32;
+	//连续失败多少次后认为后端不可用
+	static const int MAX_FAILS = 3;
+	//后端不可用的持续时间(秒)
+	static const int DOWN_SECONDS = 5;
+
+	upstream_pool(const char *prefix);
+	//添加一个后端,格式为unix:/path/to.sock或host:port
+	bool add_backend(const char *spec);
+	const char *prefix() const { return m_prefix; }
+	int backend_count() const { return m_backends.size(); }
+	int prefix_len() const { return m_prefix_len; }
+
+	//由工作线程调用,选出一个后端并返回到它的连接,所有后端都不可用时返回NULL
+	upstream_conn *acquire();
+	//转发结束,reusable表示连接可以放回连接池,ok表示后端工作正常
+	void release(upstream_conn *conn, bool reusable, bool ok);
+	//记录一次连接失败
+	void mark_failed(upstream_backend *backend);
+
+private:
+	//在可用的后端中选出未完成请求最少的一个
+	upstream_backend *pick(time_t now);
+	void mark_failed_locked(upstream_backend *backend, time_t now);
+
+private:
+	char m_prefix[http_conn::MAXFILENAME_LEN];
+	int m_prefix_len;
+	vector<upstream_backend *> m_backends;
+	//未完成请求数相同时轮流选择
+	unsigned int m_next;
+	//连接池由工作线程和主线程共同使用
+	locker m_lock;
+};
+
+//添加一条路由,backends为逗号分隔的后端列表,如 /api=unix:/tmp/api.sock,127.0.0.1:8080
+bool proxy_add_route(const char *route);
+//按URL前缀最长匹配查找路由,没有匹配时返回NULL
+upstream_pool *proxy_match(const char *url);
+
+#endif
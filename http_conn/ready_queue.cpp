@@ -0,0 +1,33 @@
+#include "ready_queue.h"
+#include "http_conn.h"
+
+thread_local deque<ready_queue::entry> *ready_queue::m_queue = NULL;
+
+void ready_queue::init()
+{
+	if (!m_queue)
+		m_queue = new deque<entry>;
+}
+
+void ready_queue::push(http_conn *conn)
+{
+	entry e;
+	e.conn = conn;
+	e.generation = conn->generation();
+	m_queue->push_back(e);
+}
+
+void ready_queue::run()
+{
+	if (!m_queue)
+		return;
+	for (size_t n = m_queue->size(); n > 0; n--)
+	{
+		entry e = m_queue->front();
+		m_queue->pop_front();
+		//放入之后连接已经关闭(可能又被新的连接重用)
+		if (e.conn->generation() != e.generation)
+			continue;
+		e.conn->resume_write();
+	}
+}
@@ -0,0 +1,40 @@
+#ifndef READY_QUEUE_H_
+#define READY_QUEUE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <deque>
+
+using namespace std;
+
+class http_conn;
+
+//事件循环线程的就绪队列,保证一个连接不能长时间占用事件循环
+//连接在一次write()中发送的字节数超过预算(web -W)而数据还没有发送完时,不再继续发送,也不重新注册事件,
+//而是放入就绪队列的末尾;事件循环处理完本轮epoll_wait返回的事件后,按先后顺序让队列中的连接各自再发送一份预算,
+//这样一个大文件下载只能在每轮中占用一份预算的时间,其他连接的小请求不会排在它整个文件的后面
+//队列不为空时epoll_wait不阻塞,只取走已经就绪的事件
+//队列中的连接可能被其他线程关闭,文件描述符也可能被新的连接重用,每一项记下放入时连接的代数,轮到时代数不同则跳过
+class ready_queue
+{
+public:
+	//当前线程作为事件循环使用就绪队列,主线程和每核一个线程时的各线程调用
+	static void init();
+	//当前线程是否是事件循环线程,不是时调用者重新注册EPOLLOUT,交给事件循环继续发送
+	static bool active() { return m_queue != NULL; }
+	//只能在事件循环线程中调用
+	static void push(http_conn *conn);
+	static bool empty() { return !m_queue || m_queue->empty(); }
+	//处理本轮开始时已在队列中的连接,处理期间再次放入的留到下一轮
+	static void run();
+
+private:
+	struct entry
+	{
+		http_conn *conn;
+		uint32_t generation;
+	};
+	static thread_local deque<entry> *m_queue;
+};
+
+#endif
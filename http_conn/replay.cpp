@@ -0,0 +1,585 @@
+//重放web -C录制的流量
+//用法: ./replay [-a host] [-p port] [-s speed] [-c max_open] capture_file
+//  -s 1按录制时的节奏重放,N为加速N倍,0为不等待,尽快发送
+//  -c 同时打开的连接数上限,超出的连接等待前面的连接关闭后再打开,默认1000
+//每个连接按录制时的顺序发送每一段数据,一段数据在录制时之前的应答都收到后才发送,
+//同一批流水线请求在录制时之前的应答数相同,重放时也会一起发出
+//结果以JSON输出到标准输出,延迟为一个应答从请求发出(或上一个应答结束)到应答接收完的时间
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/stat.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include "capture.h"
+
+using namespace std;
+
+static const int READ_BUF_SIZE = 65536;
+//没有CLOSE记录(录制结束时连接还没有关闭)的连接,发送完所有数据并空闲这么久后关闭
+static const long long IDLE_CLOSE_NS = 1000000000LL;
+//一个连接这么久没有任何进展认为卡住
+static const long long STALL_NS = 5 * 1000000000LL;
+
+static const char *host = "127.0.0.1";
+static int port = 3000;
+static double speed = 1;
+static int max_open = 1000;
+
+static long long now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+//录制的一段数据
+struct rp_chunk
+{
+	uint64_t time_us;
+	uint32_t responses;
+	size_t offset;
+	uint32_t len;
+};
+
+enum PARSE_STATE
+{
+	PARSE_HEAD = 0,
+	PARSE_BODY,
+	PARSE_CHUNK_SIZE,
+	PARSE_CHUNK_DATA,
+	PARSE_TRAILER,
+	//已经升级为WebSocket,之后的数据不再按HTTP解析
+	PARSE_UPGRADED
+};
+
+struct rp_conn
+{
+	uint64_t open_us;
+	vector<rp_chunk> chunks;
+	bool has_close;
+	uint64_t close_us;
+	uint32_t close_responses;
+
+	int fd;
+	//当前注册的epoll事件
+	uint32_t events;
+	bool connecting;
+	bool finished;
+	size_t next_chunk;
+	//当前正在发送的数据段已发送的字节数
+	uint32_t chunk_off;
+	uint32_t responses;
+	long long last_send;
+	long long last_done;
+	long long last_progress;
+
+	char *buf;
+	int len;
+	PARSE_STATE state;
+	long long remaining;
+};
+
+struct rp_stats
+{
+	vector<long long> latency;
+	long long chunks;
+	long long bytes_sent;
+	long long bytes_received;
+	long long errors;
+	long long status[6];
+};
+
+//所有数据段的内容
+static string payload;
+static vector<rp_conn> conns;
+
+static bool load(const char *path)
+{
+	FILE *fp = fopen(path, "rb");
+	if (!fp)
+		return false;
+	capture_header header;
+	if (fread(&header, sizeof(header), 1, fp) != 1 || memcmp(header.magic, "CAPT", 4) != 0 ||
+		header.record_size != sizeof(capture_record))
+	{
+		fclose(fp);
+		return false;
+	}
+	map<uint32_t, size_t> index;
+	capture_record record;
+	while (fread(&record, sizeof(record), 1, fp) == 1)
+	{
+		size_t offset = payload.size();
+		if (record.len > 0)
+		{
+			payload.resize(offset + record.len);
+			if (fread(&payload[offset], 1, record.len, fp) != record.len)
+				break;
+		}
+		if (record.type == CAPTURE_OPEN)
+		{
+			rp_conn c;
+			c.open_us = record.time_us;
+			c.has_close = false;
+			c.close_us = 0;
+			c.close_responses = 0;
+			c.fd = -1;
+			c.events = 0;
+			c.connecting = false;
+			c.finished = false;
+			c.next_chunk = 0;
+			c.chunk_off = 0;
+			c.responses = 0;
+			c.last_send = c.last_done = c.last_progress = 0;
+			c.buf = NULL;
+			c.len = 0;
+			c.state = PARSE_HEAD;
+			c.remaining = 0;
+			index[record.conn] = conns.size();
+			conns.push_back(c);
+			continue;
+		}
+		//录制开始前已经打开的连接没有OPEN记录,忽略
+		map<uint32_t, size_t>::iterator it = index.find(record.conn);
+		if (it == index.end())
+			continue;
+		rp_conn &c = conns[it->second];
+		if (record.type == CAPTURE_DATA)
+		{
+			rp_chunk chunk;
+			chunk.time_us = record.time_us;
+			chunk.responses = record.responses;
+			chunk.offset = offset;
+			chunk.len = record.len;
+			c.chunks.push_back(chunk);
+		}
+		else if (record.type == CAPTURE_CLOSE)
+		{
+			c.has_close = true;
+			c.close_us = record.time_us;
+			c.close_responses = record.responses;
+		}
+	}
+	fclose(fp);
+	return true;
+}
+
+//录制时间对应的重放时间
+static long long scheduled(long long start, uint64_t time_us)
+{
+	if (speed <= 0)
+		return start;
+	return start + (long long)(time_us * 1000.0 / speed);
+}
+
+static bool open_conn(int epollfd, rp_conn &c, int index)
+{
+	c.fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if (c.fd < 0)
+		return false;
+	int one = 1;
+	setsockopt(c.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	inet_pton(AF_INET, host, &addr.sin_addr);
+	if (connect(c.fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 && errno != EINPROGRESS)
+	{
+		close(c.fd);
+		c.fd = -1;
+		return false;
+	}
+	c.connecting = true;
+	c.buf = new char[READ_BUF_SIZE];
+	c.len = 0;
+	c.state = PARSE_HEAD;
+	c.last_progress = now_ns();
+	c.last_done = 0;
+	c.events = EPOLLIN | EPOLLOUT;
+	epoll_event ev;
+	ev.events = c.events;
+	ev.data.u32 = index;
+	epoll_ctl(epollfd, EPOLL_CTL_ADD, c.fd, &ev);
+	return true;
+}
+
+//连接结束,error为true表示还有没有发送的数据或没有收到的应答
+static void finish_conn(int epollfd, rp_conn &c, rp_stats &stats, bool error)
+{
+	if (c.fd >= 0)
+	{
+		epoll_ctl(epollfd, EPOLL_CTL_DEL, c.fd, 0);
+		close(c.fd);
+		c.fd = -1;
+	}
+	delete[] c.buf;
+	c.buf = NULL;
+	c.finished = true;
+	if (error)
+		stats.errors++;
+}
+
+//应答解析,与load_gen相同,每完成一个应答记录一次延迟,返回false表示连接需要关闭
+static bool on_data(rp_conn &c, rp_stats &stats)
+{
+	int pos = 0;
+	while (pos < c.len)
+	{
+		char *p = c.buf + pos;
+		int avail = c.len - pos;
+		bool done = false;
+		if (c.state == PARSE_UPGRADED)
+		{
+			pos = c.len;
+			break;
+		}
+		if (c.state == PARSE_HEAD)
+		{
+			char *end = (char *)memmem(p, avail, "\r\n\r\n", 4);
+			if (!end)
+			{
+				if (avail >= READ_BUF_SIZE)
+					return false;
+				break;
+			}
+			int status = 0;
+			if (sscanf(p, "HTTP/1.%*d %d", &status) != 1)
+				return false;
+			stats.status[(status >= 100 && status < 600) ? status / 100 : 0]++;
+			c.remaining = 0;
+			bool chunked = false;
+			for (char *line = p; line < end;)
+			{
+				char *next = (char *)memmem(line, end + 2 - line, "\r\n", 2);
+				if (!next)
+					break;
+				*next = '\0';
+				if (strncasecmp(line, "Content-Length:", 15) == 0)
+					c.remaining = atoll(line + 15);
+				else if (strncasecmp(line, "Transfer-Encoding:", 18) == 0 && strstr(line, "chunked"))
+					chunked = true;
+				*next = '\r';
+				line = next + 2;
+			}
+			pos += end + 4 - p;
+			if (status == 101)
+			{
+				c.state = PARSE_UPGRADED;
+				done = true;
+			}
+			else if (chunked)
+				c.state = PARSE_CHUNK_SIZE;
+			else if (c.remaining > 0)
+				c.state = PARSE_BODY;
+			else
+				done = true;
+		}
+		else if (c.state == PARSE_BODY || c.state == PARSE_CHUNK_DATA)
+		{
+			int n = (avail < c.remaining) ? avail : c.remaining;
+			c.remaining -= n;
+			pos += n;
+			if (c.remaining > 0)
+				break;
+			if (c.state == PARSE_BODY)
+				done = true;
+			else
+			{
+				c.remaining = -2;
+				c.state = PARSE_CHUNK_SIZE;
+			}
+		}
+		else if (c.remaining < 0)
+		{
+			int n = (avail < -c.remaining) ? avail : -c.remaining;
+			c.remaining += n;
+			pos += n;
+		}
+		else
+		{
+			char *end = (char *)memmem(p, avail, "\r\n", 2);
+			if (!end)
+				break;
+			pos += end + 2 - p;
+			if (c.state == PARSE_TRAILER)
+				done = (end == p);
+			else
+			{
+				c.remaining = strtoll(p, NULL, 16);
+				c.state = (c.remaining > 0) ? PARSE_CHUNK_DATA : PARSE_TRAILER;
+			}
+		}
+		if (!done)
+			continue;
+
+		long long now = now_ns();
+		stats.latency.push_back(now - max(c.last_send, c.last_done));
+		c.last_done = now;
+		c.last_progress = now;
+		c.responses++;
+		if (c.state != PARSE_UPGRADED)
+			c.state = PARSE_HEAD;
+	}
+	memmove(c.buf, c.buf + pos, c.len - pos);
+	c.len -= pos;
+	return true;
+}
+
+//发送所有到时间且之前的应答已经收到的数据段,返回false表示连接出错
+static bool flush(rp_conn &c, rp_stats &stats, long long start, long long now)
+{
+	if (c.connecting)
+		return true;
+	while (c.next_chunk < c.chunks.size())
+	{
+		const rp_chunk &chunk = c.chunks[c.next_chunk];
+		if (c.chunk_off == 0 && (c.responses < chunk.responses || scheduled(start, chunk.time_us) > now))
+			break;
+		int n = send(c.fd, payload.data() + chunk.offset + c.chunk_off, chunk.len - c.chunk_off, MSG_NOSIGNAL);
+		if (n < 0)
+			return errno == EAGAIN;
+		stats.bytes_sent += n;
+		c.chunk_off += n;
+		if (c.chunk_off < chunk.len)
+			return true;
+		c.chunk_off = 0;
+		c.next_chunk++;
+		c.last_send = now;
+		c.last_progress = now;
+		stats.chunks++;
+	}
+	return true;
+}
+
+static void update_events(int epollfd, rp_conn &c, int index)
+{
+	uint32_t events = EPOLLIN | ((c.connecting || c.chunk_off > 0) ? EPOLLOUT : 0);
+	if (events == c.events)
+		return;
+	c.events = events;
+	epoll_event ev;
+	ev.events = events;
+	ev.data.u32 = index;
+	epoll_ctl(epollfd, EPOLL_CTL_MOD, c.fd, &ev);
+}
+
+//是否在等待服务器的应答,只有这时才检查连接是否卡住,等待录制时的发送时间不算
+static bool waiting_server(const rp_conn &c)
+{
+	if (c.connecting || c.chunk_off > 0)
+		return true;
+	if (c.next_chunk < c.chunks.size())
+		return c.responses < c.chunks[c.next_chunk].responses;
+	return c.has_close && c.responses < c.close_responses;
+}
+
+static void print_result(const rp_stats &stats, double seconds)
+{
+	vector<long long> latency = stats.latency;
+	sort(latency.begin(), latency.end());
+	double sum = 0;
+	for (size_t i = 0; i < latency.size(); i++)
+		sum += latency[i];
+	const double points[] = {50, 75, 90, 99, 99.9, 99.99};
+	const char *names[] = {"p50", "p75", "p90", "p99", "p99.9", "p99.99"};
+	printf("{\"connections\": %zu, \"speed\": %g, \"duration_s\": %.3f, \"chunks\": %lld, \"bytes_sent\": %lld, "
+		   "\"bytes_received\": %lld, \"responses\": %zu, \"errors\": %lld, "
+		   "\"status\": {\"1xx\": %lld, \"2xx\": %lld, \"3xx\": %lld, \"4xx\": %lld, \"5xx\": %lld, \"other\": %lld}, "
+		   "\"latency_us\": {\"mean\": %.1f",
+		   conns.size(), speed, seconds, stats.chunks, stats.bytes_sent, stats.bytes_received, latency.size(), stats.errors,
+		   stats.status[1], stats.status[2], stats.status[3], stats.status[4], stats.status[5], stats.status[0],
+		   latency.empty() ? 0 : sum / latency.size() / 1000);
+	for (int i = 0; i < 6; i++)
+	{
+		double v = 0;
+		if (!latency.empty())
+			v = latency[min(latency.size() - 1, (size_t)(latency.size() * points[i] / 100))] / 1000.0;
+		printf(", \"%s\": %.1f", names[i], v);
+	}
+	printf(", \"max\": %.1f}}\n", latency.empty() ? 0 : latency.back() / 1000.0);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-a host] [-p port] [-s speed] [-c max_open] capture_file\n", prog);
+}
+
+int main(int argc, char *argv[])
+{
+	int opt;
+	while ((opt = getopt(argc, argv, "a:p:s:c:")) != -1)
+	{
+		switch (opt)
+		{
+			case 'a':
+				host = optarg;
+				break;
+			case 'p':
+				port = atoi(optarg);
+				break;
+			case 's':
+				speed = atof(optarg);
+				break;
+			case 'c':
+				max_open = atoi(optarg);
+				break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+	if (optind >= argc || max_open <= 0)
+	{
+		usage(argv[0]);
+		return 1;
+	}
+	if (!load(argv[optind]))
+	{
+		fprintf(stderr, "%s: not a capture file\n", argv[optind]);
+		return 1;
+	}
+
+	rp_stats stats;
+	memset(stats.status, 0, sizeof(stats.status));
+	stats.chunks = stats.bytes_sent = stats.bytes_received = stats.errors = 0;
+	int epollfd = epoll_create1(0);
+	epoll_event events[1024];
+	long long start = now_ns();
+	//下一个要打开的连接,连接按录制时打开的顺序排列
+	size_t next_open = 0;
+	vector<int> open_list;
+
+	while (next_open < conns.size() || !open_list.empty())
+	{
+		long long now = now_ns();
+		while (next_open < conns.size() && (int)open_list.size() < max_open &&
+			   scheduled(start, conns[next_open].open_us) <= now)
+		{
+			rp_conn &c = conns[next_open];
+			if (open_conn(epollfd, c, next_open))
+				open_list.push_back(next_open);
+			else
+				finish_conn(epollfd, c, stats, true);
+			next_open++;
+		}
+
+		//下一个需要处理的时间,决定epoll_wait的超时
+		long long wake = now + 10000000LL;
+		if (next_open < conns.size() && (int)open_list.size() < max_open)
+			wake = min(wake, scheduled(start, conns[next_open].open_us));
+		for (size_t i = 0; i < open_list.size(); i++)
+		{
+			rp_conn &c = conns[open_list[i]];
+			if (waiting_server(c))
+				continue;
+			if (c.next_chunk < c.chunks.size())
+				wake = min(wake, scheduled(start, c.chunks[c.next_chunk].time_us));
+			else if (c.has_close)
+				wake = min(wake, scheduled(start, c.close_us));
+		}
+		int timeout = (wake > now) ? (int)((wake - now + 999999) / 1000000) : 0;
+		int num = epoll_wait(epollfd, events, 1024, timeout);
+		now = now_ns();
+		for (int i = 0; i < num; i++)
+		{
+			int index = events[i].data.u32;
+			rp_conn &c = conns[index];
+			if (c.fd < 0)
+				continue;
+			if (c.connecting && (events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP)))
+			{
+				int err = 0;
+				socklen_t len = sizeof(err);
+				getsockopt(c.fd, SOL_SOCKET, SO_ERROR, &err, &len);
+				if (err != 0)
+				{
+					finish_conn(epollfd, c, stats, true);
+					continue;
+				}
+				c.connecting = false;
+				c.last_progress = now;
+			}
+			if (events[i].events & EPOLLIN)
+			{
+				bool closed = false;
+				while (true)
+				{
+					int n = recv(c.fd, c.buf + c.len, READ_BUF_SIZE - c.len, 0);
+					if (n < 0)
+					{
+						closed = (errno != EAGAIN);
+						break;
+					}
+					if (n == 0)
+					{
+						closed = true;
+						break;
+					}
+					stats.bytes_received += n;
+					c.len += n;
+					if (!on_data(c, stats))
+					{
+						closed = true;
+						break;
+					}
+				}
+				if (closed)
+				{
+					//服务器关闭连接,录制时该连接上还有数据要发送或还有应答没有收到则记为错误
+					bool complete = c.next_chunk == c.chunks.size() &&
+									(!c.has_close || c.responses >= c.close_responses);
+					finish_conn(epollfd, c, stats, !complete);
+				}
+			}
+		}
+
+		//发送数据,关闭已经结束的连接
+		for (size_t i = 0; i < open_list.size();)
+		{
+			int index = open_list[i];
+			rp_conn &c = conns[index];
+			if (!c.finished)
+			{
+				if (!flush(c, stats, start, now))
+					finish_conn(epollfd, c, stats, true);
+				else if (c.next_chunk == c.chunks.size() && !c.connecting)
+				{
+					long long idle = now - max(c.last_send, c.last_done);
+					if (c.has_close && c.responses >= c.close_responses && scheduled(start, c.close_us) <= now)
+						finish_conn(epollfd, c, stats, false);
+					else if (!c.has_close && idle >= IDLE_CLOSE_NS)
+						finish_conn(epollfd, c, stats, false);
+				}
+				if (!c.finished && !waiting_server(c))
+					c.last_progress = now;
+				else if (!c.finished && now - c.last_progress >= STALL_NS)
+					finish_conn(epollfd, c, stats, true);
+				if (!c.finished)
+					update_events(epollfd, c, index);
+			}
+			if (c.finished)
+			{
+				open_list[i] = open_list.back();
+				open_list.pop_back();
+			}
+			else
+				i++;
+		}
+	}
+
+	print_result(stats, (now_ns() - start) / 1e9);
+	close(epollfd);
+	return 0;
+}
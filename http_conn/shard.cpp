@@ -0,0 +1,225 @@
+#include "shard.h"
+#include <sched.h>
+#include <pthread.h>
+#include <time.h>
+#include <linux/filter.h>
+#include <algorithm>
+#include "metrics.h"
+#include "listener.h"
+#include "ready_queue.h"
+#include "poller.h"
+#include "doc_tree.h"
+
+extern void addfd(int epollfd, int fd, bool one_shot);
+
+int shard::m_count = 0;
+http_conn *shard::m_user = NULL;
+int shard::m_max_fd = 0;
+vector<int> shard::m_unix_fds;
+thread_local stat_cache *shard::m_cache = NULL;
+
+//每个线程一次最多处理的事件数
+static const int SHARD_EVENTS = 1024;
+
+static uint64_t coarse_ms()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+int stat_cache::lookup(const char *path, struct stat *st)
+{
+	uint64_t now = coarse_ms();
+	unordered_map<string, entry>::iterator it = m_entries.find(path);
+	if (it != m_entries.end() && now - it->second.checked_ms < TTL_MS)
+	{
+		*st = it->second.st;
+		return 0;
+	}
+	if (doc_tree::stat(path, st) < 0)
+	{
+		if (it != m_entries.end())
+			m_entries.erase(it);
+		return -1;
+	}
+	if (it == m_entries.end())
+	{
+		//缓存满时整体清空,热点文件很快会重新进入缓存
+		if ((int)m_entries.size() >= MAX_ENTRIES)
+			m_entries.clear();
+		it = m_entries.insert(make_pair(string(path), entry())).first;
+	}
+	it->second.st = *st;
+	it->second.checked_ms = now;
+	return 0;
+}
+
+//按收到SYN的CPU选择绑定在该CPU上的线程的监听socket,返回值是SO_REUSEPORT组内socket的序号(即创建顺序)
+//cpus[i]为第i个线程绑定的CPU,没有线程绑定在该CPU上时按CPU编号对线程数取模
+static bool attach_cpu_steering(int listenfd, const vector<int> &cpus)
+{
+	vector<struct sock_filter> code;
+	struct sock_filter load = {BPF_LD | BPF_W | BPF_ABS, 0, 0, (uint32_t)(SKF_AD_OFF + SKF_AD_CPU)};
+	code.push_back(load);
+	for (size_t i = 0; i < cpus.size(); i++)
+	{
+		//相等时执行下一条返回序号,否则跳过它
+		struct sock_filter test = {BPF_JMP | BPF_JEQ | BPF_K, 0, 1, (uint32_t)cpus[i]};
+		struct sock_filter ret = {BPF_RET | BPF_K, 0, 0, (uint32_t)i};
+		code.push_back(test);
+		code.push_back(ret);
+	}
+	struct sock_filter mod = {BPF_ALU | BPF_MOD | BPF_K, 0, 0, (uint32_t)cpus.size()};
+	struct sock_filter ret = {BPF_RET | BPF_A, 0, 0, 0};
+	code.push_back(mod);
+	code.push_back(ret);
+	struct sock_fprog prog;
+	prog.len = code.size();
+	prog.filter = &code[0];
+	return setsockopt(listenfd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) == 0;
+}
+
+int shard::run(int port, const vector<int> &unix_fds, int count, const vector<int> &cpus, http_conn *user, int max_fd)
+{
+	m_count = count;
+	m_user = user;
+	m_max_fd = max_fd;
+	m_unix_fds = unix_fds;
+	int online = sysconf(_SC_NPROCESSORS_ONLN);
+	if (online <= 0)
+		online = 1;
+	//每个线程绑定的CPU,有两个线程绑定到同一个CPU时不能按CPU选择线程
+	vector<int> shard_cpus;
+	bool distinct = true;
+	for (int i = 0; i < count; i++)
+	{
+		int cpu = cpus.empty() ? i % online : cpus[i % cpus.size()];
+		for (size_t j = 0; j < shard_cpus.size(); j++)
+			distinct = distinct && shard_cpus[j] != cpu;
+		shard_cpus.push_back(cpu);
+	}
+
+	//必须按顺序创建,SO_REUSEPORT组内socket的序号就是CBPF程序的返回值
+	shard *shards = new shard[count];
+	for (int i = 0; i < count; i++)
+	{
+		shard &s = shards[i];
+		s.m_index = i;
+		s.m_cpu = shard_cpus[i];
+		s.m_listenfd = (port > 0) ? listener::open(port, true) : -1;
+		if (port > 0 && s.m_listenfd < 0)
+		{
+			cout << "listen fail: " << strerror(errno) << endl;
+			return 1;
+		}
+		s.m_epollfd = epoll_create(5);
+		if (s.m_epollfd < 0)
+		{
+			cout << "epoll_create fail" << endl;
+			return 1;
+		}
+		if (s.m_listenfd >= 0)
+			addfd(s.m_epollfd, s.m_listenfd, false);
+		//有连接时只唤醒其中一个线程,该线程接受到EAGAIN为止
+		for (size_t j = 0; j < unix_fds.size(); j++)
+		{
+			epoll_event event;
+			event.data.fd = unix_fds[j];
+			event.events = EPOLLIN | EPOLLET | EPOLLEXCLUSIVE;
+			epoll_ctl(s.m_epollfd, EPOLL_CTL_ADD, unix_fds[j], &event);
+		}
+	}
+	//没有CBPF程序时内核按四元组哈希选择,仍然可以工作,只是连接不一定由本CPU上的线程处理
+	if (port > 0)
+	{
+		if (!distinct)
+			cout << "more shards than cpus, use hash steering" << endl;
+		else if (!attach_cpu_steering(shards[0].m_listenfd, shard_cpus))
+			cout << "SO_ATTACH_REUSEPORT_CBPF fail, fall back to hash steering" << endl;
+	}
+
+	for (int i = 1; i < count; i++)
+	{
+		pthread_t tid;
+		if (pthread_create(&tid, NULL, work, shards + i) != 0)
+		{
+			cout << "create shard thread fail" << endl;
+			return 1;
+		}
+		pthread_detach(tid);
+	}
+	cout << count << " shards on " << online << " cpus" << endl;
+	shards[0].loop();
+	return 0;
+}
+
+void *shard::work(void *arg)
+{
+	((shard *)arg)->loop();
+	return NULL;
+}
+
+void shard::loop()
+{
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(m_cpu, &set);
+	if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+		cout << "shard " << m_index << ": pin to cpu " << m_cpu << " fail" << endl;
+	//主线程运行第0个,不改名,否则进程名也随之改变
+	if (m_index > 0)
+		pthread_setname_np(pthread_self(), "web-shard");
+	m_cache = &m_stat_cache;
+	ready_queue::init();
+
+	poller poll(m_epollfd, SHARD_EVENTS);
+	epoll_event *events = poll.events();
+	while (true)
+	{
+		int num = poll.wait(!ready_queue::empty());
+		if (num < 0 && errno != EINTR)
+		{
+			cout << "epoll_wait fail" << endl;
+			break;
+		}
+		uint64_t loop_begin = metrics::now();
+		for (int i = 0; i < num; i++)
+		{
+			int sockfd = events[i].data.fd;
+			if (sockfd == m_listenfd || find(m_unix_fds.begin(), m_unix_fds.end(), sockfd) != m_unix_fds.end())
+			{
+				//监听socket是边沿触发,必须接受到EAGAIN为止
+				struct sockaddr_storage cli;
+				int connfd;
+				while ((connfd = listener::accept(sockfd, &cli, m_max_fd)) >= 0)
+				{
+					metrics::add(COUNTER_ACCEPTS);
+					m_user[connfd].init(connfd, cli, m_epollfd);
+				}
+			}
+			else if (events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+				m_user[sockfd].close_conn();
+			else if (events[i].events & EPOLLIN)
+			{
+				//在本线程中处理请求,普通应答由process()直接发送,流式应答也立即开始发送,不必等下一轮EPOLLOUT
+				http_conn &conn = m_user[sockfd];
+				if (!conn.read())
+					conn.close_conn();
+				else
+				{
+					conn.process();
+					if (conn.response_pending() && !conn.write())
+						conn.close_conn();
+				}
+			}
+			else if (events[i].events & EPOLLOUT)
+			{
+				if (!m_user[sockfd].write())
+					m_user[sockfd].close_conn();
+			}
+		}
+		ready_queue::run();
+		metrics::record(STAGE_LOOP, metrics::now() - loop_begin);
+	}
+}
@@ -0,0 +1,68 @@
+#ifndef SHARD_H_
+#define SHARD_H_
+
+#include <sys/stat.h>
+#include <stdint.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "http_conn.h"
+
+using namespace std;
+
+//每核一个线程的运行方式(web -s N),各线程之间不共享任何东西:
+//	每个线程有自己的监听socket(SO_REUSEPORT),自己的epoll和自己的文件元数据缓存,并绑定到一个CPU
+//	内核用CBPF程序按收到SYN的CPU选择监听socket,连接由处理其软中断的CPU上的线程接受
+//	接受,读取,解析,处理和发送都在同一个线程中完成,不经过线程池
+//反向代理,WebSocket和事件流需要在线程之间转发数据,这种方式下不可用
+
+//文件元数据缓存,缓存stat的结果,超过TTL_MS后重新stat,只在一个线程中使用,不加锁
+class stat_cache
+{
+public:
+	static const int MAX_ENTRIES = 4096;
+	static const uint64_t TTL_MS = 1000;
+
+	//与doc_tree::stat相同,成功返回0,失败返回-1(失败的结果不缓存)
+	int lookup(const char *path, struct stat *st);
+
+private:
+	struct entry
+	{
+		struct stat st;
+		uint64_t checked_ms;
+	};
+	unordered_map<string, entry> m_entries;
+};
+
+class shard
+{
+public:
+	//创建count个监听同一端口的socket,启动count-1个线程,当前线程作为第0个,不返回
+	//第i个线程绑定到cpus[i % cpus.size()],cpus为空时绑定到第i个CPU
+	//port为0时不监听TCP;AF_UNIX不支持SO_REUSEPORT,unix_fds中的监听socket由所有线程以EPOLLEXCLUSIVE共享
+	static int run(int port, const vector<int> &unix_fds, int count, const vector<int> &cpus, http_conn *user, int max_fd);
+	static bool enabled() { return m_count > 0; }
+	//当前线程的文件元数据缓存,不是每核线程时返回NULL
+	static stat_cache *cache() { return m_cache; }
+
+private:
+	static void *work(void *arg);
+	//绑定CPU,之后循环处理自己的连接
+	void loop();
+
+private:
+	int m_index;
+	int m_cpu;
+	int m_listenfd;
+	int m_epollfd;
+	stat_cache m_stat_cache;
+
+	static int m_count;
+	static http_conn *m_user;
+	static int m_max_fd;
+	static vector<int> m_unix_fds;
+	static thread_local stat_cache *m_cache;
+};
+
+#endif
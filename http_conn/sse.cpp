@@ -0,0 +1,321 @@
+#include "sse.h"
+#include <map>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
+extern void addfd(int epollfd, int fd, bool enable);
+
+//一个已经格式化好的事件
+struct sse_event
+{
+	unsigned long long id;
+	string text;
+};
+
+class sse_channel
+{
+public:
+	sse_channel(const string &name) : m_name(name), m_next_id(1), m_dirty(false), m_polls(0) {}
+
+	string m_name;
+	//保护m_log和m_next_id,发布者和主线程都会访问
+	locker m_lock;
+	deque<sse_event> m_log;
+	unsigned long long m_next_id;
+	//是否已经在待唤醒列表中,由sse_hub::m_lock保护
+	bool m_dirty;
+	//停放在该频道上的连接,只在主线程中访问
+	vector<sse_producer *> m_parked;
+	//停放的连接中长轮询的个数,为0时expire()不必扫描该频道,只在主线程中访问
+	int m_polls;
+};
+
+static map<string, sse_channel *> channels;
+
+int sse_hub::m_eventfd = -1;
+int sse_hub::m_timerfd = -1;
+locker sse_hub::m_lock;
+vector<sse_channel *> sse_hub::m_dirty;
+
+sse_producer::sse_producer(sse_channel *channel, unsigned long long last_id, bool once)
+	: m_channel(channel),
+	  m_last_id(last_id),
+	  m_once(once),
+	  m_started(false),
+	  m_parked_index(-1),
+	  m_deadline(once ? sse_hub::now() + sse_hub::POLL_TIMEOUT : 0),
+	  m_expired(false),
+	  m_conn(NULL)
+{
+}
+
+sse_producer::~sse_producer()
+{
+	unpark();
+}
+
+void sse_producer::unpark()
+{
+	if (m_parked_index < 0)
+		return;
+	//用末尾的连接填补空位
+	vector<sse_producer *> &parked = m_channel->m_parked;
+	sse_producer *last = parked.back();
+	parked[m_parked_index] = last;
+	last->m_parked_index = m_parked_index;
+	parked.pop_back();
+	m_parked_index = -1;
+	if (m_once)
+		m_channel->m_polls--;
+}
+
+bool sse_producer::produce(http_conn *conn)
+{
+	m_conn = conn;
+	if (m_parked_index >= 0)
+		return false;
+
+	//事件流开头先发送一个注释行,让客户端尽快收到应答头部
+	if (!m_started && !m_once)
+		conn->push_chunk(":ok\n\n", 5);
+	m_started = true;
+
+	string batch;
+	int room = conn->chunk_room();
+	bool more = false;
+	m_channel->m_lock.lock();
+	//落后太多的订阅者从保留的最早事件开始
+	if (!m_channel->m_log.empty() && m_channel->m_log.front().id > m_last_id + 1)
+		m_last_id = m_channel->m_log.front().id - 1;
+	for (deque<sse_event>::iterator it = m_channel->m_log.begin(); it != m_channel->m_log.end(); ++it)
+	{
+		if (it->id <= m_last_id)
+			continue;
+		if ((int)(batch.size() + it->text.size()) > room)
+		{
+			more = true;
+			break;
+		}
+		batch += it->text;
+		m_last_id = it->id;
+	}
+	m_channel->m_lock.unlock();
+
+	//多个事件合并成一个chunk
+	if (!batch.empty())
+	{
+		conn->push_chunk(batch.data(), batch.size());
+		return m_once;
+	}
+	if (more || conn->stream_pending())
+		return false;
+	//长轮询到期仍没有新事件,以空的应答体结束,客户端带同样的since重新请求
+	if (m_expired)
+		return true;
+
+	//没有新事件且数据都已发出,停放连接直到有新事件
+	m_parked_index = m_channel->m_parked.size();
+	m_channel->m_parked.push_back(this);
+	if (m_once)
+		m_channel->m_polls++;
+	conn->park_stream();
+	return false;
+}
+
+bool sse_hub::init(int epollfd)
+{
+	m_eventfd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (m_eventfd < 0)
+		return false;
+	addfd(epollfd, m_eventfd, false);
+	//长轮询的截止时间以秒计,每秒检查一次即可
+	m_timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (m_timerfd < 0)
+		return false;
+	struct itimerspec spec;
+	memset(&spec, 0, sizeof(spec));
+	spec.it_value.tv_sec = 1;
+	spec.it_interval.tv_sec = 1;
+	if (timerfd_settime(m_timerfd, 0, &spec, NULL) < 0)
+		return false;
+	addfd(epollfd, m_timerfd, false);
+	return true;
+}
+
+time_t sse_hub::now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return ts.tv_sec;
+}
+
+bool sse_hub::match(const char *url)
+{
+	const char *name = NULL;
+	if (strncmp(url, "/events/", 8) == 0)
+		name = url + 8;
+	else if (strncmp(url, "/poll/", 6) == 0)
+		name = url + 6;
+	//频道名不能为空
+	return name && *name != '\0' && *name != '?';
+}
+
+sse_channel *sse_hub::get_channel(const char *name, int len)
+{
+	string key(name, len);
+	m_lock.lock();
+	sse_channel *channel = NULL;
+	map<string, sse_channel *>::iterator it = channels.find(key);
+	if (it == channels.end())
+	{
+		channel = new sse_channel(key);
+		channels[key] = channel;
+	}
+	else
+		channel = it->second;
+	m_lock.unlock();
+	return channel;
+}
+
+sse_producer *sse_hub::subscribe(const char *url, unsigned long long last_id)
+{
+	bool once = (strncmp(url, "/poll/", 6) == 0);
+	const char *name = url + (once ? 6 : 8);
+	int len = strcspn(name, "?");
+	if (len == 0)
+		return NULL;
+
+	//长轮询用?since=<id>代替Last-Event-ID
+	const char *since = strstr(name + len, "since=");
+	if (since)
+		last_id = strtoull(since + 6, NULL, 10);
+
+	sse_channel *channel = get_channel(name, len);
+	//没有指定时只接收之后发布的事件,超过最新编号的(如服务器重启前的编号)也一样
+	channel->m_lock.lock();
+	if ((last_id == 0 && !since) || last_id >= channel->m_next_id)
+		last_id = channel->m_next_id - 1;
+	channel->m_lock.unlock();
+	return new sse_producer(channel, last_id, once);
+}
+
+void sse_hub::publish(const char *channel_name, const char *event, const char *data, int len)
+{
+	sse_channel *channel = get_channel(channel_name, strlen(channel_name));
+
+	channel->m_lock.lock();
+	sse_event ev;
+	ev.id = channel->m_next_id++;
+	char head[128];
+	snprintf(head, sizeof(head), "id: %llu\n", ev.id);
+	ev.text = head;
+	if (event)
+	{
+		ev.text += "event: ";
+		ev.text += event;
+		ev.text += "\n";
+	}
+	const char *end = data + len;
+	while (data <= end && (int)ev.text.size() < MAX_EVENT_SIZE - 16)
+	{
+		const char *newline = (const char *)memchr(data, '\n', end - data);
+		const char *line_end = newline ? newline : end;
+		int line_len = line_end - data;
+		if ((int)ev.text.size() + line_len > MAX_EVENT_SIZE - 16)
+			line_len = MAX_EVENT_SIZE - 16 - ev.text.size();
+		ev.text += "data: ";
+		ev.text.append(data, line_len);
+		ev.text += "\n";
+		if (!newline)
+			break;
+		data = newline + 1;
+	}
+	ev.text += "\n";
+	channel->m_log.push_back(ev);
+	if ((int)channel->m_log.size() > LOG_SIZE)
+		channel->m_log.pop_front();
+	channel->m_lock.unlock();
+
+	//同一频道在主线程处理之前的多次发布只唤醒一次
+	bool signal = false;
+	m_lock.lock();
+	if (!channel->m_dirty)
+	{
+		channel->m_dirty = true;
+		signal = m_dirty.empty();
+		m_dirty.push_back(channel);
+	}
+	m_lock.unlock();
+	if (signal)
+	{
+		uint64_t one = 1;
+		::write(m_eventfd, &one, sizeof(one));
+	}
+}
+
+//直接在主线程中写出事件,连接的socket可写时不需要再经过一次epoll_ctl和epoll_wait
+void sse_hub::dispatch()
+{
+	uint64_t count;
+	while (read(m_eventfd, &count, sizeof(count)) > 0)
+		;
+
+	vector<sse_channel *> dirty;
+	m_lock.lock();
+	dirty.swap(m_dirty);
+	for (size_t i = 0; i < dirty.size(); i++)
+		dirty[i]->m_dirty = false;
+	m_lock.unlock();
+
+	for (size_t i = 0; i < dirty.size(); i++)
+	{
+		vector<sse_producer *> parked;
+		parked.swap(dirty[i]->m_parked);
+		dirty[i]->m_polls = 0;
+		for (size_t j = 0; j < parked.size(); j++)
+			parked[j]->m_parked_index = -1;
+		for (size_t j = 0; j < parked.size(); j++)
+		{
+			http_conn *conn = parked[j]->m_conn;
+			if (!conn->write())
+				conn->close_conn();
+		}
+	}
+}
+
+void sse_hub::expire()
+{
+	uint64_t count;
+	while (read(m_timerfd, &count, sizeof(count)) > 0)
+		;
+
+	//频道只增不减,其他线程只会加入新的频道,复制出来后在锁外扫描
+	vector<sse_channel *> polled;
+	m_lock.lock();
+	for (map<string, sse_channel *>::iterator it = channels.begin(); it != channels.end(); ++it)
+		if (it->second->m_polls > 0)
+			polled.push_back(it->second);
+	m_lock.unlock();
+
+	time_t current = now();
+	vector<sse_producer *> expired;
+	for (size_t i = 0; i < polled.size(); i++)
+	{
+		vector<sse_producer *> &parked = polled[i]->m_parked;
+		for (size_t j = 0; j < parked.size(); j++)
+			if (parked[j]->m_once && parked[j]->m_deadline <= current)
+				expired.push_back(parked[j]);
+	}
+	for (size_t i = 0; i < expired.size(); i++)
+	{
+		expired[i]->unpark();
+		expired[i]->m_expired = true;
+	}
+	//结束应答,之后连接按普通应答结束处理(保持连接或关闭)
+	for (size_t i = 0; i < expired.size(); i++)
+	{
+		http_conn *conn = expired[i]->m_conn;
+		if (!conn->write())
+			conn->close_conn();
+	}
+}
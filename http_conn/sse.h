@@ -0,0 +1,86 @@
+#ifndef SSE_H_
+#define SSE_H_
+
+#include <time.h>
+#include <deque>
+#include <string>
+#include <vector>
+#include "http_conn.h"
+#include "locker.h"
+
+using namespace std;
+
+class sse_channel;
+
+//Server-Sent Events的生产者,没有新事件时连接停放,只占用内存,不占用工作线程
+//GET /events/<channel> 持续推送事件; GET /poll/<channel>?since=<id> 长轮询,收到一批事件后结束应答
+class sse_producer : public stream_producer
+{
+public:
+	sse_producer(sse_channel *channel, unsigned long long last_id, bool once);
+	~sse_producer();
+	bool produce(http_conn *conn);
+
+private:
+	friend class sse_hub;
+	//从频道的停放列表中移除
+	void unpark();
+
+private:
+	sse_channel *m_channel;
+	//已经发送的最后一个事件的编号
+	unsigned long long m_last_id;
+	//长轮询模式,发送一批事件后结束应答
+	bool m_once;
+	//是否已经发送了应答开头的注释行
+	bool m_started;
+	//在频道停放列表中的位置,-1表示没有停放
+	int m_parked_index;
+	//长轮询的截止时间(CLOCK_MONOTONIC,秒),到期时没有新事件则以空的应答体结束
+	time_t m_deadline;
+	//已经到期,下次没有新事件时结束应答而不是停放
+	bool m_expired;
+	http_conn *m_conn;
+};
+
+//频道和事件的发布,publish可以在任意线程中调用
+//发布时只把频道标记为有新事件并通过eventfd唤醒主线程,由主线程成批地向停放的连接直接写出事件
+class sse_hub
+{
+public:
+	//每个频道保留的最近事件数,落后更多的订阅者会丢失事件
+	static const int LOG_SIZE = 64;
+	//格式化后一个事件的最大长度,保证能放入连接的流式应答缓冲区
+	static const int MAX_EVENT_SIZE = 8192;
+	//长轮询最长等待的秒数,没有新事件的连接不会一直停放
+	static const int POLL_TIMEOUT = 30;
+
+	//创建eventfd和每秒一次的timerfd,注册到主线程的epoll中
+	static bool init(int epollfd);
+	static int eventfd() { return m_eventfd; }
+	static int timerfd() { return m_timerfd; }
+	//URL是否是事件流或长轮询的地址
+	static bool match(const char *url);
+	//由工作线程调用,为请求创建生产者,last_id为请求头部Last-Event-ID的值
+	static sse_producer *subscribe(const char *url, unsigned long long last_id);
+	//发布一个事件,event可以为NULL,data中的换行会拆成多个data字段,过长的data被截断
+	static void publish(const char *channel, const char *event, const char *data, int len);
+	//主线程中eventfd可读时调用,唤醒有新事件的频道上停放的连接
+	static void dispatch();
+	//主线程中timerfd可读时调用,结束到期的长轮询
+	static void expire();
+	//单调时钟的秒数
+	static time_t now();
+
+private:
+	static sse_channel *get_channel(const char *name, int len);
+
+private:
+	static int m_eventfd;
+	static int m_timerfd;
+	//保护频道表和待唤醒的频道列表
+	static locker m_lock;
+	static vector<sse_channel *> m_dirty;
+};
+
+#endif
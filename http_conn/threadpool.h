@@ -6,6 +6,7 @@
 #include <pthread.h>
 
 #include <list>
+#include <vector>
 #include <iostream>
 
 #include "locker.h"
@@ -17,7 +18,8 @@ class threadpool
 {
 public:
 	//thread_num是线程池中线程的数量,max_requests是请求队列中最多允许的等待处理的请求的数量
-	threadpool(int pthread_num = 8, int max_requests = 1000);
+	//cpus不为空时第i个线程绑定到cpus[i % cpus.size()],name为线程名(/metrics据此区分线程的角色)
+	threadpool(int pthread_num = 8, int max_requests = 1000, const vector<int> &cpus = vector<int>(), const char *name = "web-worker");
 	~threadpool();
 	//往请求队列中添加任务
 	bool append(T *request);
@@ -45,7 +47,7 @@ private:
 };
 
 template <typename T>
-threadpool<T>::threadpool(int pthread_num, int max_requests) 
+threadpool<T>::threadpool(int pthread_num, int max_requests, const vector<int> &cpus, const char *name) 
 	: m_pthread_num(pthread_num), 
 	  m_max_requests(max_requests), 
 	  pthreads(NULL), 
@@ -71,6 +73,15 @@ threadpool<T>::threadpool(int pthread_num, int max_requests)
 			delete[] pthreads;
 			throw std::exception();
 		}
+		//线程名用于/metrics区分线程的角色
+		pthread_setname_np(pthreads[i], name);
+		if (!cpus.empty())
+		{
+			cpu_set_t set;
+			CPU_ZERO(&set);
+			CPU_SET(cpus[i % cpus.size()], &set);
+			pthread_setaffinity_np(pthreads[i], sizeof(set), &set);
+		}
 	}
 }
 
@@ -86,7 +97,7 @@ bool threadpool<T>::append(T *request)
 {
 	//操作工作队列是一定要加锁,因为他被所有线程共享
 	m_queuelocker.lock();
-	if (m_workqueue.size() > m_max_requests)
+	if ((int)m_workqueue.size() > m_max_requests)
 	{
 		m_queuelocker.unlock();
 		return false;
@@ -0,0 +1,88 @@
+#include "trace.h"
+
+#ifdef WEB_TRACE
+
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include "metrics.h"
+
+trace_header *tracer::m_header = NULL;
+trace_record *tracer::m_records = NULL;
+int tracer::m_sample_every = 0;
+uint64_t tracer::m_slow_ticks = 0;
+atomic<uint64_t> tracer::m_requests(0);
+
+void request_trace::mark(int point)
+{
+	//记录满时覆盖最后一个,保证最后一个埋点(通常是TP_LAST_BYTE)总能被记录
+	int index = (count < MAX_MARKS) ? count++ : MAX_MARKS - 1;
+	ticks[index] = metrics::now();
+	points[index] = point;
+}
+
+bool tracer::open(const char *path, int sample_every, int slow_ms)
+{
+	size_t size = sizeof(trace_header) + sizeof(trace_record) * CAPACITY;
+	int fd = ::open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
+		return false;
+	if (ftruncate(fd, size) < 0)
+	{
+		close(fd);
+		return false;
+	}
+	void *addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (addr == MAP_FAILED)
+		return false;
+
+	m_header = (trace_header *)addr;
+	m_records = (trace_record *)((char *)addr + sizeof(trace_header));
+	memcpy(m_header->magic, "TRCE", 4);
+	m_header->record_size = sizeof(trace_record);
+	m_header->capacity = CAPACITY;
+	m_header->ns_per_tick = metrics::ns_per_tick();
+	m_header->base_ticks = metrics::now();
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	m_header->base_realtime_ns = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+
+	m_sample_every = sample_every;
+	if (slow_ms > 0)
+		m_slow_ticks = slow_ms * 1000000.0 / m_header->ns_per_tick;
+	return true;
+}
+
+void tracer::finish(const request_trace &trace, int fd, int status, const char *url, uint64_t total_ticks)
+{
+	if (!m_header)
+		return;
+	uint8_t flags = 0;
+	uint64_t n = m_requests.fetch_add(1, memory_order_relaxed);
+	if (m_sample_every > 0 && n % m_sample_every == 0)
+		flags |= TRACE_SAMPLED;
+	if (m_slow_ticks > 0 && total_ticks >= m_slow_ticks)
+		flags |= TRACE_SLOW;
+	if (!flags)
+		return;
+
+	//多个线程同时写入时各自占用不同的槽位,读者通过seq判断记录是否完整
+	uint64_t seq = m_header->head.fetch_add(1, memory_order_relaxed);
+	trace_record &record = m_records[seq % CAPACITY];
+	record.seq.store(0, memory_order_release);
+	record.id = n;
+	record.fd = fd;
+	record.status = status;
+	record.count = trace.count;
+	record.flags = flags;
+	memcpy(record.ticks, trace.ticks, sizeof(uint64_t) * trace.count);
+	memcpy(record.points, trace.points, trace.count);
+	strncpy(record.url, url, sizeof(record.url) - 1);
+	record.url[sizeof(record.url) - 1] = '\0';
+	record.seq.store(seq + 1, memory_order_release);
+}
+
+#endif
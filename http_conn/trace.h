@@ -0,0 +1,112 @@
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <stdint.h>
+#include <atomic>
+
+using namespace std;
+
+//单个请求的采样跟踪,编译时定义WEB_TRACE(make FLAGS=-DWEB_TRACE)才启用,否则所有埋点都编译为空
+//每个请求在各阶段记录TSC时间戳,请求结束时被采样(每N个一个)或用时超过阈值的请求写入文件映射的环形缓冲区,
+//用trace_dump工具查看时间线或导出为Chrome trace-event JSON
+
+//埋点
+enum TRACE_POINT
+{
+	TP_ACCEPT = 0,		//接受连接
+	TP_READ,			//每次读到数据
+	TP_ENQUEUE,			//放入线程池队列
+	TP_DEQUEUE,			//工作线程取出
+	TP_PARSED,			//请求解析完毕
+	TP_RESOLVED,		//目标文件查找完毕
+	TP_FIRST_BYTE,		//应答的第一个字节写出
+	TP_LAST_BYTE,		//应答的最后一个字节写出
+	TP_COUNT
+};
+
+//一个请求的埋点记录,属于http_conn
+struct request_trace
+{
+	//每个请求最多记录的埋点数,超出的忽略
+	static const int MAX_MARKS = 16;
+
+	uint64_t ticks[MAX_MARKS];
+	uint8_t points[MAX_MARKS];
+	int count;
+
+	void reset() { count = 0; }
+	void mark(int point);
+};
+
+//环形缓冲区中的一条记录,定长256字节
+struct trace_record
+{
+	//写入完成后为槽位序号+1,正在写入时为0,读者据此判断记录是否完整
+	atomic<uint64_t> seq;
+	uint64_t id;
+	uint32_t fd;
+	uint16_t status;
+	uint8_t count;
+	//TRACE_FLAG的组合
+	uint8_t flags;
+	uint64_t ticks[request_trace::MAX_MARKS];
+	uint8_t points[request_trace::MAX_MARKS];
+	char url[88];
+};
+
+//记录被写入的原因
+enum TRACE_FLAG
+{
+	TRACE_SAMPLED = 1,	//被采样
+	TRACE_SLOW = 2		//用时超过阈值
+};
+
+//跟踪文件的头部,之后是capacity条trace_record
+struct trace_header
+{
+	char magic[4];
+	uint32_t record_size;
+	uint32_t capacity;
+	uint32_t pad;
+	//下一条记录的序号
+	atomic<uint64_t> head;
+	//时钟换算,ticks转换为实时时钟: realtime_ns = base_realtime_ns + (ticks - base_ticks) * ns_per_tick
+	double ns_per_tick;
+	uint64_t base_ticks;
+	uint64_t base_realtime_ns;
+};
+
+#ifdef WEB_TRACE
+
+class tracer
+{
+public:
+	//环形缓冲区的记录数
+	static const uint32_t CAPACITY = 4096;
+
+	//创建跟踪文件,每sample_every个请求采样一个(0表示不采样),用时超过slow_ms毫秒的请求都记录(0表示不记录)
+	static bool open(const char *path, int sample_every, int slow_ms);
+	//请求结束,决定是否写入环形缓冲区
+	static void finish(const request_trace &trace, int fd, int status, const char *url, uint64_t total_ticks);
+
+private:
+	static trace_header *m_header;
+	static trace_record *m_records;
+	static int m_sample_every;
+	static uint64_t m_slow_ticks;
+	static atomic<uint64_t> m_requests;
+};
+
+#define TRACE_MARK(trace, point) (trace).mark(point)
+#define TRACE_RESET(trace) (trace).reset()
+#define TRACE_FINISH(trace, fd, status, url, total) tracer::finish(trace, fd, status, url, total)
+
+#else
+
+#define TRACE_MARK(trace, point) ((void)0)
+#define TRACE_RESET(trace) ((void)0)
+#define TRACE_FINISH(trace, fd, status, url, total) ((void)0)
+
+#endif
+
+#endif
@@ -0,0 +1,150 @@
+//查看web -t生成的跟踪文件,服务器运行时也可以读取
+//用法: ./trace_dump [-c] [-s slow_ms] web.trace
+//默认按时间顺序输出每个请求的时间线,-c输出Chrome trace-event JSON(chrome://tracing或Perfetto打开),
+//-s只输出用时超过slow_ms毫秒的请求
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <vector>
+#include <algorithm>
+#include "trace.h"
+
+static const char *point_names[TP_COUNT] = {"accept", "read", "enqueue", "dequeue", "parsed", "resolved", "first_byte", "last_byte"};
+
+//从共享的环形缓冲区中复制出的一条完整记录
+struct snapshot
+{
+	uint64_t seq;
+	uint64_t id;
+	uint32_t fd;
+	uint16_t status;
+	uint8_t count;
+	uint8_t flags;
+	uint64_t ticks[request_trace::MAX_MARKS];
+	uint8_t points[request_trace::MAX_MARKS];
+	char url[88];
+};
+
+static bool by_seq(const snapshot &a, const snapshot &b)
+{
+	return a.seq < b.seq;
+}
+
+int main(int argc, char *argv[])
+{
+	bool chrome = false;
+	double slow_ms = 0;
+	int opt;
+	while ((opt = getopt(argc, argv, "cs:")) != -1)
+	{
+		switch (opt)
+		{
+			case 'c':
+				chrome = true;
+				break;
+			case 's':
+				slow_ms = atof(optarg);
+				break;
+			default:
+				fprintf(stderr, "usage: %s [-c] [-s slow_ms] trace_file\n", argv[0]);
+				return 1;
+		}
+	}
+	if (optind >= argc)
+	{
+		fprintf(stderr, "usage: %s [-c] [-s slow_ms] trace_file\n", argv[0]);
+		return 1;
+	}
+
+	int fd = open(argv[optind], O_RDONLY);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(trace_header))
+	{
+		perror(argv[optind]);
+		return 1;
+	}
+	char *addr = (char *)mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (addr == MAP_FAILED)
+	{
+		perror("mmap");
+		return 1;
+	}
+	const trace_header *header = (const trace_header *)addr;
+	if (memcmp(header->magic, "TRCE", 4) != 0 || header->record_size != sizeof(trace_record) ||
+		sizeof(trace_header) + (off_t)header->capacity * sizeof(trace_record) > (size_t)st.st_size)
+	{
+		fprintf(stderr, "%s: not a trace file or record size mismatch\n", argv[optind]);
+		return 1;
+	}
+
+	//复制前后seq相同且不为0才是完整的记录
+	const trace_record *records = (const trace_record *)(addr + sizeof(trace_header));
+	vector<snapshot> list;
+	for (uint32_t i = 0; i < header->capacity; i++)
+	{
+		const trace_record &r = records[i];
+		snapshot s;
+		s.seq = r.seq.load(memory_order_acquire);
+		if (s.seq == 0)
+			continue;
+		s.id = r.id;
+		s.fd = r.fd;
+		s.status = r.status;
+		s.count = (r.count < request_trace::MAX_MARKS) ? r.count : request_trace::MAX_MARKS;
+		s.flags = r.flags;
+		memcpy(s.ticks, r.ticks, sizeof(s.ticks));
+		memcpy(s.points, r.points, sizeof(s.points));
+		memcpy(s.url, r.url, sizeof(s.url));
+		s.url[sizeof(s.url) - 1] = '\0';
+		if (r.seq.load(memory_order_acquire) != s.seq || s.count == 0)
+			continue;
+		double total_ms = (s.ticks[s.count - 1] - s.ticks[0]) * header->ns_per_tick / 1e6;
+		if (total_ms < slow_ms)
+			continue;
+		list.push_back(s);
+	}
+	sort(list.begin(), list.end(), by_seq);
+
+	if (chrome)
+		printf("{\"traceEvents\":[\n");
+	bool first = true;
+	for (size_t i = 0; i < list.size(); i++)
+	{
+		const snapshot &s = list[i];
+		double start_us = (header->base_realtime_ns + ((double)s.ticks[0] - header->base_ticks) * header->ns_per_tick) / 1000.0;
+		if (!chrome)
+		{
+			double total_ms = (s.ticks[s.count - 1] - s.ticks[0]) * header->ns_per_tick / 1e6;
+			printf("#%llu fd=%u status=%u %s %.3fms%s%s\n", (unsigned long long)s.id, s.fd, s.status, s.url, total_ms,
+				   (s.flags & TRACE_SAMPLED) ? " sampled" : "", (s.flags & TRACE_SLOW) ? " slow" : "");
+			for (int j = 0; j < s.count; j++)
+			{
+				double at = (s.ticks[j] - s.ticks[0]) * header->ns_per_tick / 1000.0;
+				double step = j ? (s.ticks[j] - s.ticks[j - 1]) * header->ns_per_tick / 1000.0 : 0;
+				printf("    %12.1fus %+10.1fus  %s\n", at, step, (s.points[j] < TP_COUNT) ? point_names[s.points[j]] : "?");
+			}
+			continue;
+		}
+		//整个请求和相邻埋点之间的每一段各输出一个完整事件,同一连接的请求显示在同一行
+		double total_us = (s.ticks[s.count - 1] - s.ticks[0]) * header->ns_per_tick / 1000.0;
+		printf("%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"status\":%u,\"id\":%llu}}",
+			   first ? "" : ",\n", s.url, s.fd, start_us, total_us, s.status, (unsigned long long)s.id);
+		first = false;
+		for (int j = 1; j < s.count; j++)
+		{
+			double ts = start_us + (s.ticks[j - 1] - s.ticks[0]) * header->ns_per_tick / 1000.0;
+			double dur = (s.ticks[j] - s.ticks[j - 1]) * header->ns_per_tick / 1000.0;
+			const char *name = (s.points[j] < TP_COUNT) ? point_names[s.points[j]] : "?";
+			printf(",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}", name, s.fd, ts, dur);
+		}
+	}
+	if (chrome)
+		printf("\n]}\n");
+	munmap(addr, st.st_size);
+	return 0;
+}
@@ -0,0 +1,548 @@
+#include "ws.h"
+#include "sse.h"
+#include <map>
+#include <string>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+extern void modfd(int epollfd, int fd, int ev);
+
+//一个主题及其订阅者
+class ws_topic
+{
+public:
+	ws_topic(const string &name) : m_name(name) {}
+	void add(ws_session *session);
+	//用数组末尾的订阅者填补空位,O(1)删除
+	void remove(int index);
+	bool empty() const { return m_subs.empty(); }
+
+public:
+	string m_name;
+	vector<ws_session *> m_subs;
+};
+
+static map<string, ws_topic *> topics;
+
+int ws_hub::m_max_queue = 256;
+WS_SLOW_POLICY ws_hub::m_policy = WS_DROP_NEWEST;
+
+#define SHA1_ROL(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+
+static void sha1(const unsigned char *msg, int len, unsigned char digest[20])
+{
+	uint32_t h[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+	//调用者保证len不超过119,补位后最多两个分组
+	unsigned char buf[128];
+	int total = ((len + 8) / 64 + 1) * 64;
+	memset(buf, 0, sizeof(buf));
+	memcpy(buf, msg, len);
+	buf[len] = 0x80;
+	uint64_t bits = (uint64_t)len * 8;
+	for (int i = 0; i < 8; i++)
+		buf[total - 1 - i] = (unsigned char)(bits >> (i * 8));
+
+	for (int block = 0; block < total; block += 64)
+	{
+		uint32_t w[80];
+		for (int i = 0; i < 16; i++)
+			w[i] = (buf[block + i * 4] << 24) | (buf[block + i * 4 + 1] << 16) |
+				   (buf[block + i * 4 + 2] << 8) | buf[block + i * 4 + 3];
+		for (int i = 16; i < 80; i++)
+			w[i] = SHA1_ROL(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+		uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+		for (int i = 0; i < 80; i++)
+		{
+			uint32_t f, k;
+			if (i < 20)
+			{
+				f = (b & c) | (~b & d);
+				k = 0x5A827999;
+			}
+			else if (i < 40)
+			{
+				f = b ^ c ^ d;
+				k = 0x6ED9EBA1;
+			}
+			else if (i < 60)
+			{
+				f = (b & c) | (b & d) | (c & d);
+				k = 0x8F1BBCDC;
+			}
+			else
+			{
+				f = b ^ c ^ d;
+				k = 0xCA62C1D6;
+			}
+			uint32_t temp = SHA1_ROL(a, 5) + f + e + k + w[i];
+			e = d;
+			d = c;
+			c = SHA1_ROL(b, 30);
+			b = a;
+			a = temp;
+		}
+		h[0] += a;
+		h[1] += b;
+		h[2] += c;
+		h[3] += d;
+		h[4] += e;
+	}
+	for (int i = 0; i < 5; i++)
+	{
+		digest[i * 4] = h[i] >> 24;
+		digest[i * 4 + 1] = h[i] >> 16;
+		digest[i * 4 + 2] = h[i] >> 8;
+		digest[i * 4 + 3] = h[i];
+	}
+}
+
+void ws_accept_key(const char *key, char *accept)
+{
+	static const char *guid = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+	static const char *table = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	unsigned char msg[120];
+	//合法的key是24字节,过长的key截断,握手会失败但不会越界
+	int key_len = strlen(key);
+	if (key_len > 64)
+		key_len = 64;
+	memcpy(msg, key, key_len);
+	memcpy(msg + key_len, guid, 36);
+	unsigned char digest[20];
+	sha1(msg, key_len + 36, digest);
+
+	//20字节的摘要base64编码后为28字节
+	int j = 0;
+	for (int i = 0; i < 18; i += 3)
+	{
+		uint32_t v = (digest[i] << 16) | (digest[i + 1] << 8) | digest[i + 2];
+		accept[j++] = table[(v >> 18) & 63];
+		accept[j++] = table[(v >> 12) & 63];
+		accept[j++] = table[(v >> 6) & 63];
+		accept[j++] = table[v & 63];
+	}
+	uint32_t v = (digest[18] << 16) | (digest[19] << 8);
+	accept[j++] = table[(v >> 18) & 63];
+	accept[j++] = table[(v >> 12) & 63];
+	accept[j++] = table[(v >> 6) & 63];
+	accept[j++] = '=';
+	accept[j] = '\0';
+}
+
+void ws_unmask(char *data, uint64_t len, const unsigned char mask[4])
+{
+	uint64_t i = 0;
+#if defined(__SSE2__)
+	uint32_t m;
+	memcpy(&m, mask, 4);
+#if defined(__AVX2__)
+	__m256i mask256 = _mm256_set1_epi32(m);
+	for (; i + 32 <= len; i += 32)
+	{
+		__m256i v = _mm256_loadu_si256((__m256i *)(data + i));
+		_mm256_storeu_si256((__m256i *)(data + i), _mm256_xor_si256(v, mask256));
+	}
+#endif
+	__m128i mask128 = _mm_set1_epi32(m);
+	for (; i + 16 <= len; i += 16)
+	{
+		__m128i v = _mm_loadu_si128((__m128i *)(data + i));
+		_mm_storeu_si128((__m128i *)(data + i), _mm_xor_si128(v, mask128));
+	}
+#endif
+	//向量部分每次处理4的整数倍字节,剩下的部分掩码位置仍然是i & 3
+	for (; i < len; i++)
+		data[i] ^= mask[i & 3];
+}
+
+ws_frame *ws_frame_create(int opcode, const char *payload, int len)
+{
+	ws_frame *frame = (ws_frame *)malloc(sizeof(ws_frame) + 10 + len);
+	if (!frame)
+		return NULL;
+	unsigned char *p = (unsigned char *)frame->data;
+	int header = 2;
+	p[0] = 0x80 | opcode;
+	if (len < 126)
+		p[1] = len;
+	else if (len < 65536)
+	{
+		p[1] = 126;
+		p[2] = len >> 8;
+		p[3] = len;
+		header = 4;
+	}
+	else
+	{
+		p[1] = 127;
+		for (int i = 0; i < 8; i++)
+			p[2 + i] = (unsigned char)((uint64_t)len >> (56 - i * 8));
+		header = 10;
+	}
+	memcpy(p + header, payload, len);
+	frame->len = header + len;
+	frame->refs = 1;
+	return frame;
+}
+
+void ws_frame_put(ws_frame *frame)
+{
+	if (--frame->refs == 0)
+		free(frame);
+}
+
+void ws_topic::add(ws_session *session)
+{
+	ws_session::membership m;
+	m.topic = this;
+	m.index = m_subs.size();
+	m_subs.push_back(session);
+	session->m_topics.push_back(m);
+}
+
+void ws_topic::remove(int index)
+{
+	ws_session *last = m_subs.back();
+	m_subs[index] = last;
+	m_subs.pop_back();
+	if (index == (int)m_subs.size())
+		return;
+	//被移动的订阅者记录的位置也要更新
+	for (size_t i = 0; i < last->m_topics.size(); i++)
+	{
+		if (last->m_topics[i].topic == this)
+		{
+			last->m_topics[i].index = index;
+			break;
+		}
+	}
+}
+
+ws_session::ws_session(http_conn *conn, const char *topic)
+	: m_conn(conn),
+	  m_sockfd(conn->get_sockfd()),
+	  m_open(false),
+	  m_closing(false),
+	  m_read_index(0),
+	  m_dropped(0)
+{
+	snprintf(m_topic, sizeof(m_topic), "%s", topic);
+}
+
+ws_session::~ws_session()
+{
+	if (m_open)
+		ws_hub::unsubscribe_all(this);
+	for (size_t i = 0; i < m_queue.size(); i++)
+		ws_frame_put(m_queue[i].frame);
+}
+
+void ws_session::open()
+{
+	m_open = true;
+	if (m_topic[0])
+		ws_hub::subscribe(this, m_topic);
+}
+
+void ws_session::rearm()
+{
+	modfd(http_conn::m_epollfd, m_sockfd, m_queue.empty() ? EPOLLIN : (EPOLLIN | EPOLLOUT));
+}
+
+bool ws_session::flush()
+{
+	while (!m_queue.empty())
+	{
+		struct iovec iv[16];
+		int count = 0;
+		for (deque<out_frame>::iterator it = m_queue.begin(); it != m_queue.end() && count < 16; ++it)
+		{
+			iv[count].iov_base = it->frame->data + it->offset;
+			iv[count].iov_len = it->frame->len - it->offset;
+			count++;
+		}
+		int n = writev(m_sockfd, iv, count);
+		if (n < 0)
+			return errno == EAGAIN;
+		while (n > 0)
+		{
+			out_frame &front = m_queue.front();
+			int left = front.frame->len - front.offset;
+			if (n < left)
+			{
+				front.offset += n;
+				break;
+			}
+			n -= left;
+			ws_frame_put(front.frame);
+			m_queue.pop_front();
+		}
+	}
+	return true;
+}
+
+bool ws_session::send_frame(ws_frame *frame)
+{
+	if (m_closing)
+		return true;
+	if ((int)m_queue.size() >= ws_hub::max_queue())
+	{
+		if (ws_hub::policy() == WS_CLOSE_SLOW)
+			return false;
+		m_dropped++;
+		return true;
+	}
+
+	bool was_empty = m_queue.empty();
+	out_frame out;
+	out.frame = frame;
+	out.offset = 0;
+	frame->refs++;
+	m_queue.push_back(out);
+	//写队列原来不空说明已经在等待EPOLLOUT
+	if (!was_empty)
+		return true;
+	if (!flush())
+		return false;
+	if (!m_queue.empty())
+		rearm();
+	return true;
+}
+
+bool ws_session::on_writable()
+{
+	if (!flush())
+		return false;
+	if (m_closing && m_queue.empty())
+		return false;
+	rearm();
+	return true;
+}
+
+bool ws_session::on_readable()
+{
+	while (!m_closing)
+	{
+		if (m_read_index >= READ_BUF_SIZE)
+			return false;
+		int n = recv(m_sockfd, m_read_buf + m_read_index, READ_BUF_SIZE - m_read_index, 0);
+		if (n < 0)
+		{
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			return false;
+		}
+		if (n == 0)
+			return false;
+		m_read_index += n;
+
+		int pos = 0;
+		while (!m_closing)
+		{
+			unsigned char *p = (unsigned char *)m_read_buf + pos;
+			int avail = m_read_index - pos;
+			if (avail < 2)
+				break;
+			bool fin = p[0] & 0x80;
+			int opcode = p[0] & 0x0f;
+			//客户帧必须带掩码
+			if (!(p[1] & 0x80))
+				return false;
+			uint64_t len = p[1] & 0x7f;
+			int header = 2;
+			if (len == 126)
+			{
+				if (avail < 4)
+					break;
+				len = (p[2] << 8) | p[3];
+				header = 4;
+			}
+			else if (len == 127)
+			{
+				if (avail < 10)
+					break;
+				len = 0;
+				for (int i = 0; i < 8; i++)
+					len = (len << 8) | p[2 + i];
+				header = 10;
+			}
+			header += 4;
+			//消息不能超过读缓冲区
+			if (len > (uint64_t)(READ_BUF_SIZE - header))
+				return false;
+			if ((uint64_t)avail < header + len)
+				break;
+			//不支持分片消息
+			if (!fin || opcode == WS_CONTINUATION)
+				return false;
+
+			char *payload = (char *)p + header;
+			ws_unmask(payload, len, p + header - 4);
+			on_message(opcode, payload, len);
+			pos += header + len;
+		}
+		if (pos > 0)
+		{
+			memmove(m_read_buf, m_read_buf + pos, m_read_index - pos);
+			m_read_index -= pos;
+		}
+	}
+
+	if (!flush())
+		return false;
+	if (m_closing && m_queue.empty())
+		return false;
+	rearm();
+	return true;
+}
+
+//客户消息: SUB <topic>, UNSUB <topic>, PUB <topic> <data>
+void ws_session::on_message(int opcode, char *payload, int len)
+{
+	switch (opcode)
+	{
+		case WS_PING:
+		{
+			//内存不足时不回应,对方可以再次ping
+			ws_frame *pong = ws_frame_create(WS_PONG, payload, len);
+			if (!pong)
+				return;
+			send_frame(pong);
+			ws_frame_put(pong);
+			return;
+		}
+		case WS_CLOSE:
+		{
+			//回应关闭帧,发送完毕后关闭连接
+			ws_frame *frame = ws_frame_create(WS_CLOSE, payload, (len >= 2) ? 2 : 0);
+			if (!frame)
+			{
+				//内存不足时不回应,直接关闭,由主线程在HUP事件中释放
+				m_closing = true;
+				shutdown(m_sockfd, SHUT_RDWR);
+				return;
+			}
+			send_frame(frame);
+			ws_frame_put(frame);
+			m_closing = true;
+			return;
+		}
+		case WS_TEXT:
+			break;
+		default:
+			return;
+	}
+
+	char topic[64];
+	if (len > 4 && strncmp(payload, "SUB ", 4) == 0 && len - 4 < (int)sizeof(topic))
+	{
+		memcpy(topic, payload + 4, len - 4);
+		topic[len - 4] = '\0';
+		ws_hub::subscribe(this, topic);
+	}
+	else if (len > 6 && strncmp(payload, "UNSUB ", 6) == 0 && len - 6 < (int)sizeof(topic))
+	{
+		memcpy(topic, payload + 6, len - 6);
+		topic[len - 6] = '\0';
+		ws_hub::unsubscribe(this, topic);
+	}
+	else if (len > 4 && strncmp(payload, "PUB ", 4) == 0)
+	{
+		char *name = payload + 4;
+		char *space = (char *)memchr(name, ' ', len - 4);
+		if (!space || space - name >= (int)sizeof(topic))
+			return;
+		memcpy(topic, name, space - name);
+		topic[space - name] = '\0';
+		ws_hub::publish(topic, space + 1, payload + len - space - 1);
+		//同名的事件流频道也会收到这条消息
+		sse_hub::publish(topic, NULL, space + 1, payload + len - space - 1);
+	}
+}
+
+void ws_hub::subscribe(ws_session *session, const char *topic)
+{
+	string name(topic);
+	ws_topic *t = NULL;
+	map<string, ws_topic *>::iterator it = topics.find(name);
+	if (it == topics.end())
+	{
+		t = new ws_topic(name);
+		topics[name] = t;
+	}
+	else
+	{
+		t = it->second;
+		//重复订阅
+		for (size_t i = 0; i < session->m_topics.size(); i++)
+			if (session->m_topics[i].topic == t)
+				return;
+	}
+	t->add(session);
+}
+
+void ws_hub::unsubscribe(ws_session *session, const char *topic)
+{
+	for (size_t i = 0; i < session->m_topics.size(); i++)
+	{
+		ws_topic *t = session->m_topics[i].topic;
+		if (t->m_name != topic)
+			continue;
+		t->remove(session->m_topics[i].index);
+		session->m_topics.erase(session->m_topics.begin() + i);
+		if (t->empty())
+		{
+			topics.erase(t->m_name);
+			delete t;
+		}
+		return;
+	}
+}
+
+void ws_hub::unsubscribe_all(ws_session *session)
+{
+	for (size_t i = 0; i < session->m_topics.size(); i++)
+	{
+		ws_topic *t = session->m_topics[i].topic;
+		t->remove(session->m_topics[i].index);
+		if (t->empty())
+		{
+			topics.erase(t->m_name);
+			delete t;
+		}
+	}
+	session->m_topics.clear();
+}
+
+//帧只编码一次,每个订阅者的写队列中只保存它的引用
+int ws_hub::publish(const char *topic, const char *data, int len)
+{
+	map<string, ws_topic *>::iterator it = topics.find(topic);
+	if (it == topics.end())
+		return 0;
+	ws_topic *t = it->second;
+	ws_frame *frame = ws_frame_create(WS_TEXT, data, len);
+	//内存不足时丢弃这条消息,不影响订阅者
+	if (!frame)
+		return 0;
+	int count = t->m_subs.size();
+	for (int i = 0; i < count; i++)
+	{
+		ws_session *session = t->m_subs[i];
+		if (!session->send_frame(frame))
+		{
+			//不能在遍历订阅者时释放连接,关闭socket后由主线程在HUP事件中释放
+			session->m_closing = true;
+			shutdown(session->m_sockfd, SHUT_RDWR);
+		}
+	}
+	ws_frame_put(frame);
+	return count;
+}
+
+void ws_hub::set_limit(int max_queue, WS_SLOW_POLICY policy)
+{
+	m_max_queue = max_queue;
+	m_policy = policy;
+}
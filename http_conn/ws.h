@@ -0,0 +1,134 @@
+#ifndef WS_H_
+#define WS_H_
+
+#include <stdint.h>
+#include <deque>
+#include <vector>
+#include "http_conn.h"
+
+using namespace std;
+
+//WebSocket帧的操作码
+enum WS_OPCODE
+{
+	WS_CONTINUATION = 0x0,
+	WS_TEXT = 0x1,
+	WS_BINARY = 0x2,
+	WS_CLOSE = 0x8,
+	WS_PING = 0x9,
+	WS_PONG = 0xA
+};
+
+//写队列满时的处理策略
+enum WS_SLOW_POLICY
+{
+	WS_DROP_NEWEST = 0, //丢弃新的帧
+	WS_CLOSE_SLOW		//关闭跟不上的连接
+};
+
+//一个编码好的服务器帧,广播时所有订阅者共享同一份,按引用计数释放
+//只在主线程中使用,所以引用计数不需要原子操作
+struct ws_frame
+{
+	int refs;
+	int len;
+	char data[1];
+};
+
+//内存不足时返回NULL
+ws_frame *ws_frame_create(int opcode, const char *payload, int len);
+void ws_frame_put(ws_frame *frame);
+
+//根据客户的Sec-WebSocket-Key计算Sec-WebSocket-Accept,accept至少29字节
+void ws_accept_key(const char *key, char *accept);
+//用掩码还原客户帧的数据,支持时使用SIMD指令每次处理16或32字节
+void ws_unmask(char *data, uint64_t len, const unsigned char mask[4]);
+
+class ws_topic;
+
+//一个已完成握手的WebSocket连接,所有操作都在主线程中进行
+class ws_session
+{
+public:
+	//读缓冲区的大小,客户只发送订阅命令这样的短消息
+	static const int READ_BUF_SIZE = 1024;
+
+	//握手时由工作线程创建,topic为URL中/ws/之后的部分,可以为空
+	ws_session(http_conn *conn, const char *topic);
+	~ws_session();
+
+	//101应答发送完毕,开始按WebSocket协议收发数据
+	void open();
+	bool is_open() const { return m_open; }
+
+	//读取并处理客户帧,返回false表示需要关闭连接
+	bool on_readable();
+	//发送写队列,返回false表示需要关闭连接
+	bool on_writable();
+
+	//把帧放入写队列并尝试立即发送,写队列满时按策略处理,返回false表示需要关闭连接
+	bool send_frame(ws_frame *frame);
+	//被丢弃的帧数
+	unsigned long long dropped() const { return m_dropped; }
+
+private:
+	friend class ws_topic;
+	friend class ws_hub;
+
+	//写队列中的一项,offset为已经发送的字节数
+	struct out_frame
+	{
+		ws_frame *frame;
+		int offset;
+	};
+	//订阅的主题,以及本连接在主题订阅者数组中的位置
+	struct membership
+	{
+		ws_topic *topic;
+		int index;
+	};
+
+	//尽量多地发送写队列中的数据,返回false表示出错
+	bool flush();
+	//根据写队列是否为空重新注册事件
+	void rearm();
+	//处理一个完整的消息
+	void on_message(int opcode, char *payload, int len);
+
+private:
+	http_conn *m_conn;
+	int m_sockfd;
+	bool m_open;
+	//收到关闭帧或协议错误,写队列发送完后关闭连接
+	bool m_closing;
+	char m_topic[64];
+
+	char m_read_buf[READ_BUF_SIZE];
+	int m_read_index;
+
+	deque<out_frame> m_queue;
+	vector<membership> m_topics;
+	unsigned long long m_dropped;
+};
+
+//主题和订阅关系,广播时帧只编码一次,由所有订阅者的写队列共享
+//所有函数都只能在主线程中调用
+class ws_hub
+{
+public:
+	static void subscribe(ws_session *session, const char *topic);
+	static void unsubscribe(ws_session *session, const char *topic);
+	static void unsubscribe_all(ws_session *session);
+	//向主题的所有订阅者广播一条文本消息,返回订阅者数量
+	static int publish(const char *topic, const char *data, int len);
+	//每个连接写队列中最多的帧数和写队列满时的策略
+	static void set_limit(int max_queue, WS_SLOW_POLICY policy);
+	static int max_queue() { return m_max_queue; }
+	static WS_SLOW_POLICY policy() { return m_policy; }
+
+private:
+	static int m_max_queue;
+	static WS_SLOW_POLICY m_policy;
+};
+
+#endif
@@ -0,0 +1,385 @@
+//WebSocket广播基准测试: 建立大量订阅同一主题的连接,由一个发布连接发送消息,
+//统计从发布到每个订阅者收到消息的延迟分布
+//用法: ./ws_bench [-p port] [-n connections] [-t threads] [-r rounds]
+//连接数较多时需要先调大两端的文件描述符上限,如 ulimit -n 200000
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <atomic>
+#include <vector>
+#include <algorithm>
+
+using namespace std;
+
+//每个源地址最多使用的连接数,超过后换一个127.0.0.x源地址,避免临时端口耗尽
+static const int CONNS_PER_SOURCE = 20000;
+//每个线程同时进行握手的连接数
+static const int MAX_INFLIGHT = 256;
+
+static int port = 3000;
+static int conn_num = 1000;
+static int thread_num = 4;
+static int rounds = 20;
+
+static atomic<long> opened(0);
+static atomic<long> failed(0);
+static atomic<long> received(0);
+static atomic<bool> stop(false);
+
+static const char *handshake =
+	"GET /ws/bench HTTP/1.1\r\n"
+	"Host: localhost\r\n"
+	"Upgrade: websocket\r\n"
+	"Connection: Upgrade\r\n"
+	"Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+	"Sec-WebSocket-Version: 13\r\n\r\n";
+
+static long long now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+enum CONN_STATE
+{
+	CONNECTING = 0,
+	HANDSHAKE,
+	OPEN,
+	CLOSED
+};
+
+struct bench_conn
+{
+	int fd;
+	CONN_STATE state;
+	char buf[512];
+	int len;
+};
+
+struct bench_worker
+{
+	int first;
+	int count;
+	pthread_t tid;
+	vector<long long> latency;
+};
+
+static int open_conn(int index)
+{
+	int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if (fd < 0)
+		return -1;
+	struct sockaddr_in local;
+	memset(&local, 0, sizeof(local));
+	local.sin_family = AF_INET;
+	local.sin_addr.s_addr = htonl(0x7f000002 + index / CONNS_PER_SOURCE);
+	bind(fd, (struct sockaddr *)&local, sizeof(local));
+
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 && errno != EINPROGRESS)
+	{
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static void close_conn(int epollfd, bench_conn &c)
+{
+	epoll_ctl(epollfd, EPOLL_CTL_DEL, c.fd, 0);
+	close(c.fd);
+	c.state = CLOSED;
+}
+
+//处理收到的数据,握手阶段等待101应答,之后解析服务器帧并记录延迟
+static bool on_data(bench_conn &c, bench_worker *w)
+{
+	while (1)
+	{
+		int n = recv(c.fd, c.buf + c.len, sizeof(c.buf) - c.len, 0);
+		if (n < 0)
+			return errno == EAGAIN;
+		if (n == 0)
+			return false;
+		c.len += n;
+
+		if (c.state == HANDSHAKE)
+		{
+			c.buf[c.len < (int)sizeof(c.buf) ? c.len : (int)sizeof(c.buf) - 1] = '\0';
+			char *end = strstr(c.buf, "\r\n\r\n");
+			if (!end)
+				continue;
+			if (strncmp(c.buf, "HTTP/1.1 101", 12) != 0)
+				return false;
+			int head = end + 4 - c.buf;
+			memmove(c.buf, c.buf + head, c.len - head);
+			c.len -= head;
+			c.state = OPEN;
+			opened++;
+		}
+
+		int pos = 0;
+		while (c.len - pos >= 2)
+		{
+			unsigned char *p = (unsigned char *)c.buf + pos;
+			int len = p[1] & 0x7f;
+			int header = 2;
+			if (len == 126)
+			{
+				if (c.len - pos < 4)
+					break;
+				len = (p[2] << 8) | p[3];
+				header = 4;
+			}
+			if (len == 127 || header + len > (int)sizeof(c.buf))
+				return false;
+			if (c.len - pos < header + len)
+				break;
+			if ((p[0] & 0x0f) == 0x1)
+			{
+				char text[32];
+				int copy = (len < 31) ? len : 31;
+				memcpy(text, p + header, copy);
+				text[copy] = '\0';
+				w->latency.push_back(now_ns() - atoll(text));
+				received++;
+			}
+			pos += header + len;
+		}
+		memmove(c.buf, c.buf + pos, c.len - pos);
+		c.len -= pos;
+	}
+}
+
+static void *run_worker(void *arg)
+{
+	bench_worker *w = (bench_worker *)arg;
+	vector<bench_conn> conns(w->count);
+	int epollfd = epoll_create1(0);
+	epoll_event events[1024];
+	int next = 0;
+	int inflight = 0;
+
+	while (!stop)
+	{
+		//限制同时握手的连接数,避免服务器的监听队列溢出
+		while (next < w->count && inflight < MAX_INFLIGHT)
+		{
+			bench_conn &c = conns[next];
+			c.fd = open_conn(w->first + next);
+			c.len = 0;
+			next++;
+			if (c.fd < 0)
+			{
+				c.state = CLOSED;
+				failed++;
+				continue;
+			}
+			c.state = CONNECTING;
+			epoll_event ev;
+			ev.events = EPOLLOUT | EPOLLIN;
+			ev.data.u32 = next - 1;
+			epoll_ctl(epollfd, EPOLL_CTL_ADD, c.fd, &ev);
+			inflight++;
+		}
+
+		int num = epoll_wait(epollfd, events, 1024, 100);
+		for (int i = 0; i < num; i++)
+		{
+			bench_conn &c = conns[events[i].data.u32];
+			if (c.state == CLOSED)
+				continue;
+			if (c.state == CONNECTING)
+			{
+				int err = 0;
+				socklen_t len = sizeof(err);
+				getsockopt(c.fd, SOL_SOCKET, SO_ERROR, &err, &len);
+				if (err != 0 || send(c.fd, handshake, strlen(handshake), 0) != (int)strlen(handshake))
+				{
+					close_conn(epollfd, c);
+					failed++;
+					inflight--;
+					continue;
+				}
+				c.state = HANDSHAKE;
+				epoll_event ev;
+				ev.events = EPOLLIN;
+				ev.data.u32 = events[i].data.u32;
+				epoll_ctl(epollfd, EPOLL_CTL_MOD, c.fd, &ev);
+				continue;
+			}
+			CONN_STATE before = c.state;
+			if (!on_data(c, w))
+			{
+				close_conn(epollfd, c);
+				if (before == HANDSHAKE)
+				{
+					failed++;
+					inflight--;
+				}
+				continue;
+			}
+			if (before == HANDSHAKE && c.state == OPEN)
+				inflight--;
+		}
+	}
+
+	for (int i = 0; i < w->count; i++)
+		if (conns[i].state != CLOSED)
+			close(conns[i].fd);
+	close(epollfd);
+	return NULL;
+}
+
+//发布连接使用阻塞socket
+static int open_publisher()
+{
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+		return -1;
+	const char *req =
+		"GET /ws HTTP/1.1\r\nHost: localhost\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+		"Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\nSec-WebSocket-Version: 13\r\n\r\n";
+	send(fd, req, strlen(req), 0);
+	char buf[1024];
+	int len = 0;
+	while (len < (int)sizeof(buf) - 1)
+	{
+		int n = recv(fd, buf + len, sizeof(buf) - 1 - len, 0);
+		if (n <= 0)
+			return -1;
+		len += n;
+		buf[len] = '\0';
+		if (strstr(buf, "\r\n\r\n"))
+			break;
+	}
+	return (strncmp(buf, "HTTP/1.1 101", 12) == 0) ? fd : -1;
+}
+
+static void publish(int fd, const char *text)
+{
+	unsigned char frame[128];
+	int len = strlen(text);
+	const unsigned char mask[4] = {0x12, 0x34, 0x56, 0x78};
+	frame[0] = 0x81;
+	frame[1] = 0x80 | len;
+	memcpy(frame + 2, mask, 4);
+	for (int i = 0; i < len; i++)
+		frame[6 + i] = text[i] ^ mask[i & 3];
+	send(fd, frame, 6 + len, 0);
+}
+
+static long long percentile(const vector<long long> &v, double p)
+{
+	if (v.empty())
+		return 0;
+	size_t index = (size_t)(p * (v.size() - 1));
+	return v[index];
+}
+
+int main(int argc, char *argv[])
+{
+	int opt;
+	while ((opt = getopt(argc, argv, "p:n:t:r:")) != -1)
+	{
+		switch (opt)
+		{
+			case 'p':
+				port = atoi(optarg);
+				break;
+			case 'n':
+				conn_num = atoi(optarg);
+				break;
+			case 't':
+				thread_num = atoi(optarg);
+				break;
+			case 'r':
+				rounds = atoi(optarg);
+				break;
+			default:
+				fprintf(stderr, "usage: %s [-p port] [-n connections] [-t threads] [-r rounds]\n", argv[0]);
+				return 1;
+		}
+	}
+
+	struct rlimit limit;
+	getrlimit(RLIMIT_NOFILE, &limit);
+	limit.rlim_cur = limit.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &limit);
+
+	vector<bench_worker> workers(thread_num);
+	int per = conn_num / thread_num;
+	for (int i = 0; i < thread_num; i++)
+	{
+		workers[i].first = i * per;
+		workers[i].count = (i == thread_num - 1) ? conn_num - i * per : per;
+		pthread_create(&workers[i].tid, NULL, run_worker, &workers[i]);
+	}
+
+	//等待所有连接完成握手
+	long long deadline = now_ns() + 120 * 1000000000LL;
+	while (opened + failed < conn_num && now_ns() < deadline)
+		usleep(10000);
+	long subscribers = opened;
+	fprintf(stderr, "%ld connections open, %ld failed\n", subscribers, (long)failed);
+
+	int pub = open_publisher();
+	if (pub < 0)
+	{
+		fprintf(stderr, "publisher handshake failed\n");
+		return 1;
+	}
+	long long expected = 0;
+	long timeouts = 0;
+	for (int r = 0; r < rounds; r++)
+	{
+		expected += subscribers;
+		char text[64];
+		snprintf(text, sizeof(text), "PUB bench %lld", now_ns());
+		publish(pub, text);
+		long long wait_until = now_ns() + 5 * 1000000000LL;
+		while (received < expected && now_ns() < wait_until)
+			usleep(100);
+		if (received < expected)
+		{
+			timeouts++;
+			expected = received;
+		}
+		usleep(20000);
+	}
+
+	stop = true;
+	vector<long long> all;
+	for (int i = 0; i < thread_num; i++)
+	{
+		pthread_join(workers[i].tid, NULL);
+		all.insert(all.end(), workers[i].latency.begin(), workers[i].latency.end());
+	}
+	sort(all.begin(), all.end());
+	printf("{\"connections\": %ld, \"rounds\": %d, \"delivered\": %zu, \"expected\": %lld, \"timeouts\": %ld, "
+		   "\"latency_us\": {\"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, \"p999\": %.1f, \"max\": %.1f}}\n",
+		   subscribers, rounds, all.size(), (long long)subscribers * rounds, timeouts,
+		   percentile(all, 0.5) / 1000.0, percentile(all, 0.9) / 1000.0, percentile(all, 0.99) / 1000.0,
+		   percentile(all, 0.999) / 1000.0, all.empty() ? 0.0 : all.back() / 1000.0);
+	close(pub);
+	return 0;
+}